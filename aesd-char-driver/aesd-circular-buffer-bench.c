@@ -0,0 +1,175 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Throughput benchmark for aesd_circular_buffer_add_entry() and
+ * aesd_circular_buffer_find_entry_offset_for_fpos()
+ *
+ * Built against the same sources as the unit tests, once per
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED value (see CMakeLists.txt).
+ *
+ * Usage: circular-buffer-bench [iterations]
+ *
+ * Results are written to stdout as CSV, one row per case:
+ *   max_entries,entries,entry_size,op,pattern,iterations,ns_per_op,checksum
+ * where entries is the number of populated entries and pattern is one of
+ *   sequential - offsets walk the buffer from start to end
+ *   random     - uniformly distributed offsets
+ *   tail       - 90% of offsets land in the most recent entry (replay of new data)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define MAX_ENTRY_SIZE 4096
+
+static const size_t entry_sizes[] = { 16, 256, MAX_ENTRY_SIZE };
+
+static char payload[MAX_ENTRY_SIZE];
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// xorshift64, deterministic between runs so results are comparable
+static size_t next_random(size_t *state)
+{
+    size_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void report(size_t entries, size_t entry_size, const char *op, const char *pattern,
+                   size_t iterations, double elapsed_ns, size_t checksum)
+{
+    printf("%d,%zu,%zu,%s,%s,%zu,%.2f,%zu\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+           entries, entry_size, op, pattern, iterations, elapsed_ns / iterations, checksum);
+}
+
+/*
+ * Populate @param buffer with @param entries entries of @param entry_size bytes.
+ * A full buffer is wrapped first so out_offs does not start at 0.
+ */
+static void fill(struct aesd_circular_buffer *buffer, size_t entries, size_t entry_size)
+{
+    struct aesd_buffer_entry entry = { .buffptr = payload, .size = entry_size };
+    size_t i;
+
+    aesd_circular_buffer_init(buffer);
+    if (entries == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        entries += AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED / 2;
+    }
+    for (i = 0; i < entries; i++)
+    {
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static void bench_add(size_t entry_size, size_t iterations)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry = { .buffptr = payload, .size = entry_size };
+    size_t checksum = 0;
+    size_t i;
+    double start;
+
+    aesd_circular_buffer_init(&buffer);
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        checksum += (aesd_circular_buffer_add_entry(&buffer, &entry) != NULL);
+    }
+    report(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, entry_size, "add_entry", "overwrite",
+           iterations, now_ns() - start, checksum);
+}
+
+static void bench_find(size_t entries, size_t entry_size, const char *pattern, size_t iterations)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *found;
+    size_t entry_offset = 0;
+    size_t total = entries * entry_size;
+    size_t tail_start = total - entry_size;
+    size_t rng = 0x9e3779b97f4a7c15ULL;
+    size_t *offsets;
+    size_t checksum = 0;
+    size_t i;
+    double start;
+
+    // Precompute offsets so the pattern generator is not part of the measurement
+    offsets = malloc(iterations * sizeof(*offsets));
+    if (!offsets)
+    {
+        fprintf(stderr, "allocation failed\n");
+        exit(1);
+    }
+    for (i = 0; i < iterations; i++)
+    {
+        if (strcmp(pattern, "sequential") == 0)
+            offsets[i] = (i * 7) % total;
+        else if (strcmp(pattern, "random") == 0)
+            offsets[i] = next_random(&rng) % total;
+        else if (next_random(&rng) % 10 != 0)
+            offsets[i] = tail_start + next_random(&rng) % entry_size;
+        else
+            offsets[i] = next_random(&rng) % total;
+    }
+
+    fill(&buffer, entries, entry_size);
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i], &entry_offset);
+        checksum += (found != NULL) + entry_offset;
+    }
+    report(entries, entry_size, "find_fpos", pattern, iterations, now_ns() - start, checksum);
+
+    free(offsets);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *patterns[] = { "sequential", "random", "tail" };
+    size_t iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+    size_t counts[] = { 1, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED / 2, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED };
+    size_t s, c, p;
+
+    if (iterations == 0)
+    {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    memset(payload, 'a', sizeof(payload));
+
+    printf("max_entries,entries,entry_size,op,pattern,iterations,ns_per_op,checksum\n");
+
+    for (s = 0; s < sizeof(entry_sizes) / sizeof(entry_sizes[0]); s++)
+    {
+        bench_add(entry_sizes[s], iterations);
+    }
+
+    for (s = 0; s < sizeof(entry_sizes) / sizeof(entry_sizes[0]); s++)
+    {
+        for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+        {
+            for (p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+            {
+                bench_find(counts[c], entry_sizes[s], patterns[p], iterations);
+            }
+        }
+    }
+
+    return 0;
+}
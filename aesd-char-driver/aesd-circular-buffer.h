@@ -16,7 +16,11 @@
 #include <stdbool.h>
 #endif
 
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+// May be overridden at build time (e.g. by the benchmarks), must stay below 256
+// since in_offs/out_offs are uint8_t
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
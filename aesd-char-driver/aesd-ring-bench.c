@@ -0,0 +1,225 @@
+/**
+ * @file aesd-ring-bench.c
+ * @brief Microbenchmark for the userspace rings in aesd-ring.h
+ *
+ * Usage: aesd-ring-bench [operations] [producers] [consumers] [capacity]
+ *
+ * Prints one line per case:
+ *   <case> ops=<n> threads=<p>x<c> capacity=<n> sec=<s> mops=<million ops/sec>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "aesd-ring.h"
+
+struct bench_ctx
+{
+    struct aesd_spsc_ring spsc;
+    struct aesd_mpmc_ring mpmc;
+    size_t producer_ops;
+    size_t consumer_ops;
+    atomic_size_t checksum;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t ops, int producers, int consumers, size_t capacity, double sec)
+{
+    printf("%s ops=%zu threads=%dx%d capacity=%zu sec=%.3f mops=%.2f\n",
+           name, ops, producers, consumers, capacity, sec, ops / sec / 1e6);
+}
+
+static void *spsc_producer(void *arg)
+{
+    struct bench_ctx *ctx = arg;
+    struct aesd_buffer_entry entry = { .buffptr = NULL, .size = 1 };
+    size_t i;
+
+    for (i = 0; i < ctx->producer_ops; i++)
+    {
+        while (!aesd_spsc_ring_push(&ctx->spsc, &entry))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *spsc_consumer(void *arg)
+{
+    struct bench_ctx *ctx = arg;
+    struct aesd_buffer_entry entry;
+    size_t i;
+    size_t sum = 0;
+
+    for (i = 0; i < ctx->consumer_ops; i++)
+    {
+        while (!aesd_spsc_ring_pop(&ctx->spsc, &entry))
+            sched_yield();
+        sum += entry.size;
+    }
+    atomic_fetch_add(&ctx->checksum, sum);
+    return NULL;
+}
+
+static void *mpmc_producer(void *arg)
+{
+    struct bench_ctx *ctx = arg;
+    struct aesd_buffer_entry entry = { .buffptr = NULL, .size = 1 };
+    size_t i;
+
+    for (i = 0; i < ctx->producer_ops; i++)
+    {
+        while (!aesd_mpmc_ring_push(&ctx->mpmc, &entry))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *mpmc_consumer(void *arg)
+{
+    struct bench_ctx *ctx = arg;
+    struct aesd_buffer_entry entry;
+    size_t i;
+    size_t sum = 0;
+
+    for (i = 0; i < ctx->consumer_ops; i++)
+    {
+        while (!aesd_mpmc_ring_pop(&ctx->mpmc, &entry))
+            sched_yield();
+        sum += entry.size;
+    }
+    atomic_fetch_add(&ctx->checksum, sum);
+    return NULL;
+}
+
+static int run_threads(struct bench_ctx *ctx, void *(*producer)(void *), int producers,
+                       void *(*consumer)(void *), int consumers)
+{
+    pthread_t tids[producers + consumers];
+    int i;
+
+    for (i = 0; i < producers; i++)
+    {
+        if (pthread_create(&tids[i], NULL, producer, ctx) != 0) return -1;
+    }
+    for (i = 0; i < consumers; i++)
+    {
+        if (pthread_create(&tids[producers + i], NULL, consumer, ctx) != 0) return -1;
+    }
+    for (i = 0; i < producers + consumers; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    return 0;
+}
+
+static void bench_find(struct bench_ctx *ctx, size_t capacity, size_t ops)
+{
+    struct aesd_buffer_entry entry = { .buffptr = "0123456789abcdef", .size = 16 };
+    struct aesd_buffer_entry *found;
+    size_t entry_offset;
+    size_t total;
+    size_t i;
+    size_t hits = 0;
+    double start;
+
+    aesd_spsc_ring_init(&ctx->spsc, ctx->spsc.slots, capacity);
+    aesd_mpmc_ring_init(&ctx->mpmc, ctx->mpmc.slots, capacity);
+    for (i = 0; i < capacity; i++)
+    {
+        aesd_spsc_ring_push(&ctx->spsc, &entry);
+        aesd_mpmc_ring_push(&ctx->mpmc, &entry);
+    }
+    total = capacity * entry.size;
+
+    start = now_sec();
+    for (i = 0; i < ops; i++)
+    {
+        found = aesd_spsc_ring_find_entry_offset_for_fpos(&ctx->spsc, (i * 7919) % total, &entry_offset);
+        hits += (found != NULL);
+    }
+    report("spsc_find_fpos", ops, 1, 0, capacity, now_sec() - start);
+
+    start = now_sec();
+    for (i = 0; i < ops; i++)
+    {
+        found = aesd_mpmc_ring_find_entry_offset_for_fpos(&ctx->mpmc, (i * 7919) % total, &entry_offset);
+        hits += (found != NULL);
+    }
+    report("mpmc_find_fpos", ops, 1, 0, capacity, now_sec() - start);
+
+    if (hits != 2 * ops) fprintf(stderr, "find_fpos missed %zu lookups\n", 2 * ops - hits);
+}
+
+int main(int argc, char **argv)
+{
+    size_t ops = (argc > 1) ? strtoul(argv[1], NULL, 0) : 10000000;
+    int producers = (argc > 2) ? atoi(argv[2]) : 2;
+    int consumers = (argc > 3) ? atoi(argv[3]) : 2;
+    size_t capacity = (argc > 4) ? strtoul(argv[4], NULL, 0) : 1024;
+    struct bench_ctx ctx;
+    double start;
+    int rc = 0;
+
+    if (!aesd_ring_capacity_valid(capacity) || producers < 1 || consumers < 1)
+    {
+        fprintf(stderr, "usage: %s [operations] [producers] [consumers] [capacity (power of two)]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.spsc.slots = calloc(capacity, sizeof(struct aesd_buffer_entry));
+    ctx.mpmc.slots = calloc(capacity, sizeof(struct aesd_mpmc_slot));
+    if (!ctx.spsc.slots || !ctx.mpmc.slots)
+    {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+
+    // SPSC: one producer, one consumer
+    aesd_spsc_ring_init(&ctx.spsc, ctx.spsc.slots, capacity);
+    ctx.producer_ops = ops;
+    ctx.consumer_ops = ops;
+    atomic_store(&ctx.checksum, 0);
+    start = now_sec();
+    rc |= run_threads(&ctx, spsc_producer, 1, spsc_consumer, 1);
+    report("spsc", ops, 1, 1, capacity, now_sec() - start);
+    if (atomic_load(&ctx.checksum) != ops) rc = 1;
+
+    // MPMC with a single producer and consumer, for comparison with spsc
+    aesd_mpmc_ring_init(&ctx.mpmc, ctx.mpmc.slots, capacity);
+    atomic_store(&ctx.checksum, 0);
+    start = now_sec();
+    rc |= run_threads(&ctx, mpmc_producer, 1, mpmc_consumer, 1);
+    report("mpmc", ops, 1, 1, capacity, now_sec() - start);
+    if (atomic_load(&ctx.checksum) != ops) rc = 1;
+
+    // MPMC with the requested thread counts, ops rounded so that producers
+    // and consumers agree on the total
+    ctx.producer_ops = ops / ((size_t)producers * consumers) * consumers;
+    ctx.consumer_ops = ops / ((size_t)producers * consumers) * producers;
+    ops = ctx.producer_ops * producers;
+    aesd_mpmc_ring_init(&ctx.mpmc, ctx.mpmc.slots, capacity);
+    atomic_store(&ctx.checksum, 0);
+    start = now_sec();
+    rc |= run_threads(&ctx, mpmc_producer, producers, mpmc_consumer, consumers);
+    report("mpmc", ops, producers, consumers, capacity, now_sec() - start);
+    if (atomic_load(&ctx.checksum) != ops) rc = 1;
+
+    bench_find(&ctx, (capacity > 256) ? 256 : capacity, ops / 10);
+
+    free(ctx.spsc.slots);
+    free(ctx.mpmc.slots);
+
+    if (rc) fprintf(stderr, "benchmark failed consistency check\n");
+    return rc ? 1 : 0;
+}
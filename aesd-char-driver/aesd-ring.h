@@ -0,0 +1,373 @@
+/*
+ * aesd-ring.h
+ *
+ *  Userspace, header-only ring buffers of struct aesd_buffer_entry records.
+ *
+ *  Two variants are provided:
+ *  - aesd_spsc_ring: lock-free single-producer/single-consumer ring
+ *  - aesd_mpmc_ring: bounded multi-producer/multi-consumer ring (sequence
+ *    numbered slots, one CAS per push/pop)
+ *
+ *  Both rings mirror the aesd_circular_buffer API: entries describe memory
+ *  owned by the caller, and *_find_entry_offset_for_fpos() resolves a
+ *  concatenated character offset to an entry and the byte within it.
+ *  Capacities must be a power of two and the slot storage is supplied by
+ *  the caller.
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#ifdef __KERNEL__
+#error "aesd-ring.h is a userspace only header, use aesd-circular-buffer.h in the kernel"
+#endif
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesd-circular-buffer.h"
+
+#define AESD_RING_CACHELINE 64
+
+/**
+ * Lock-free single-producer/single-consumer ring.
+ * head is only written by the producer, tail only by the consumer.  Each side
+ * keeps a cached copy of the other side's index so the shared cache line is
+ * only touched when the ring looks full (producer) or empty (consumer).
+ */
+struct aesd_spsc_ring
+{
+    _Alignas(AESD_RING_CACHELINE) atomic_size_t head;
+    size_t cached_tail;
+
+    _Alignas(AESD_RING_CACHELINE) atomic_size_t tail;
+    size_t cached_head;
+
+    _Alignas(AESD_RING_CACHELINE) struct aesd_buffer_entry *slots;
+    size_t mask;
+    /**
+     * Number of bytes described by all entries currently in the ring
+     */
+    atomic_size_t size;
+};
+
+struct aesd_mpmc_slot
+{
+    atomic_size_t seq;
+    struct aesd_buffer_entry entry;
+};
+
+/**
+ * Bounded multi-producer/multi-consumer ring.
+ * A slot at position pos is free for a producer when seq == pos and holds a
+ * published entry for a consumer when seq == pos + 1.
+ */
+struct aesd_mpmc_ring
+{
+    _Alignas(AESD_RING_CACHELINE) atomic_size_t enqueue_pos;
+
+    _Alignas(AESD_RING_CACHELINE) atomic_size_t dequeue_pos;
+
+    _Alignas(AESD_RING_CACHELINE) struct aesd_mpmc_slot *slots;
+    size_t mask;
+    /**
+     * Number of bytes described by all entries. Producers add before
+     * publishing, so it may briefly include entries not yet visible.
+     */
+    atomic_size_t size;
+};
+
+static inline bool aesd_ring_capacity_valid(size_t capacity)
+{
+    return capacity >= 2 && (capacity & (capacity - 1)) == 0;
+}
+
+/**
+ * Initializes @param ring to use @param slots, an array of @param capacity entries.
+ * @return 0 on success, -1 if capacity is not a power of two
+ */
+static inline int aesd_spsc_ring_init(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *slots, size_t capacity)
+{
+    if (!ring || !slots || !aesd_ring_capacity_valid(capacity)) return -1;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->size, 0);
+    ring->cached_head = 0;
+    ring->cached_tail = 0;
+    ring->slots = slots;
+    ring->mask = capacity - 1;
+
+    return 0;
+}
+
+/**
+ * Producer side. Copies @param add_entry into the ring.
+ * @return false if the ring is full
+ */
+static inline bool aesd_spsc_ring_push(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *add_entry)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - ring->cached_tail > ring->mask)
+    {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->cached_tail > ring->mask) return false;
+    }
+
+    ring->slots[head & ring->mask] = *add_entry;
+    atomic_fetch_add_explicit(&ring->size, add_entry->size, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+/**
+ * Consumer side. Removes the oldest entry and copies it to @param entry_rtn.
+ * @return false if the ring is empty
+ */
+static inline bool aesd_spsc_ring_pop(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entry_rtn)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail == ring->cached_head)
+    {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == ring->cached_head) return false;
+    }
+
+    *entry_rtn = ring->slots[tail & ring->mask];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    atomic_fetch_sub_explicit(&ring->size, entry_rtn->size, memory_order_relaxed);
+
+    return true;
+}
+
+/**
+ * Consumer side. @return the published entry at absolute position @param pos,
+ * or NULL if nothing has been published there yet.  pos must not be older
+ * than the current tail.
+ */
+static inline struct aesd_buffer_entry *aesd_spsc_ring_entry_at(struct aesd_spsc_ring *ring, size_t pos)
+{
+    if (pos >= ring->cached_head)
+    {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (pos >= ring->cached_head) return NULL;
+    }
+
+    return &ring->slots[pos & ring->mask];
+}
+
+static inline size_t aesd_spsc_ring_count(struct aesd_spsc_ring *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/**
+ * Initializes @param ring to use @param slots, an array of @param capacity slots.
+ * @return 0 on success, -1 if capacity is not a power of two
+ */
+static inline int aesd_mpmc_ring_init(struct aesd_mpmc_ring *ring, struct aesd_mpmc_slot *slots, size_t capacity)
+{
+    size_t i;
+
+    if (!ring || !slots || !aesd_ring_capacity_valid(capacity)) return -1;
+
+    for (i = 0; i < capacity; i++)
+    {
+        atomic_init(&slots[i].seq, i);
+        slots[i].entry.buffptr = NULL;
+        slots[i].entry.size = 0;
+    }
+
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    atomic_init(&ring->size, 0);
+    ring->slots = slots;
+    ring->mask = capacity - 1;
+
+    return 0;
+}
+
+/**
+ * Safe to call from any number of threads.
+ * @return false if the ring is full
+ */
+static inline bool aesd_mpmc_ring_push(struct aesd_mpmc_ring *ring, const struct aesd_buffer_entry *add_entry)
+{
+    struct aesd_mpmc_slot *slot;
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    size_t seq;
+    intptr_t diff;
+
+    for (;;)
+    {
+        slot = &ring->slots[pos & ring->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // Slot still holds an entry from the previous lap, ring is full
+            return false;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->entry = *add_entry;
+    atomic_fetch_add_explicit(&ring->size, add_entry->size, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    return true;
+}
+
+/**
+ * Safe to call from any number of threads.
+ * @return false if the ring is empty
+ */
+static inline bool aesd_mpmc_ring_pop(struct aesd_mpmc_ring *ring, struct aesd_buffer_entry *entry_rtn)
+{
+    struct aesd_mpmc_slot *slot;
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    size_t seq;
+    intptr_t diff;
+
+    for (;;)
+    {
+        slot = &ring->slots[pos & ring->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *entry_rtn = slot->entry;
+    atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+    atomic_fetch_sub_explicit(&ring->size, entry_rtn->size, memory_order_relaxed);
+
+    return true;
+}
+
+/**
+ * Consumer side. @return the published entry at absolute position @param pos,
+ * or NULL if pos has not been published (or was already consumed).
+ * Producers may run concurrently, but the caller must serialize this against
+ * aesd_mpmc_ring_pop() (e.g. by holding the lock used by all consumers) for
+ * the returned entry to stay valid.
+ */
+static inline struct aesd_buffer_entry *aesd_mpmc_ring_entry_at(struct aesd_mpmc_ring *ring, size_t pos)
+{
+    struct aesd_mpmc_slot *slot = &ring->slots[pos & ring->mask];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) return NULL;
+
+    return &slot->entry;
+}
+
+static inline size_t aesd_mpmc_ring_count(struct aesd_mpmc_ring *ring)
+{
+    size_t enq = atomic_load_explicit(&ring->enqueue_pos, memory_order_acquire);
+    size_t deq = atomic_load_explicit(&ring->dequeue_pos, memory_order_acquire);
+
+    return (enq > deq) ? enq - deq : 0;
+}
+
+/**
+ * Iterate over the published entries of a ring, oldest first, stopping at the
+ * first position which has not been published.  Must be used from the
+ * consumer side, see aesd_spsc_ring_entry_at()/aesd_mpmc_ring_entry_at().
+ * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
+ * @param ring is the ring to iterate
+ * @param pos is a size_t stack allocated value used by this macro for the position
+ */
+#define AESD_SPSC_RING_FOREACH(entryptr,ring,pos) \
+    for(pos=atomic_load_explicit(&(ring)->tail, memory_order_relaxed); \
+            (entryptr=aesd_spsc_ring_entry_at(ring, pos)) != NULL; \
+            pos++)
+
+#define AESD_MPMC_RING_FOREACH(entryptr,ring,pos) \
+    for(pos=atomic_load_explicit(&(ring)->dequeue_pos, memory_order_acquire); \
+            (entryptr=aesd_mpmc_ring_entry_at(ring, pos)) != NULL; \
+            pos++)
+
+/**
+ * Consumer side equivalent of aesd_circular_buffer_find_entry_offset_for_fpos().
+ * @param char_offset the zero referenced character index if all entries were concatenated end to end
+ * @param entry_offset_byte_rtn is set to the byte within the returned entry corresponding to char_offset
+ * @return the entry containing char_offset, or NULL if not enough data is in the ring
+ */
+static inline struct aesd_buffer_entry *aesd_spsc_ring_find_entry_offset_for_fpos(struct aesd_spsc_ring *ring,
+            size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry *entry;
+    size_t pos;
+
+    if (!ring || !entry_offset_byte_rtn) return NULL;
+
+    AESD_SPSC_RING_FOREACH(entry, ring, pos)
+    {
+        if (entry->size <= char_offset)
+        {
+            char_offset -= entry->size;
+            continue;
+        }
+        *entry_offset_byte_rtn = char_offset;
+        return entry;
+    }
+
+    return NULL;
+}
+
+/**
+ * See aesd_spsc_ring_find_entry_offset_for_fpos(). The caller must serialize
+ * this against aesd_mpmc_ring_pop().
+ */
+static inline struct aesd_buffer_entry *aesd_mpmc_ring_find_entry_offset_for_fpos(struct aesd_mpmc_ring *ring,
+            size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    struct aesd_buffer_entry *entry;
+    size_t pos;
+
+    if (!ring || !entry_offset_byte_rtn) return NULL;
+
+    AESD_MPMC_RING_FOREACH(entry, ring, pos)
+    {
+        if (entry->size <= char_offset)
+        {
+            char_offset -= entry->size;
+            continue;
+        }
+        *entry_offset_byte_rtn = char_offset;
+        return entry;
+    }
+
+    return NULL;
+}
+
+#endif /* AESD_RING_H */
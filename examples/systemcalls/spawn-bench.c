@@ -0,0 +1,137 @@
+/**
+ * @file spawn-bench.c
+ * @brief Latency of starting and reaping a short command as the parent grows
+ *
+ * For each parent size the benchmark touches that many MiB of heap, then
+ * runs /bin/true repeatedly with
+ *   fork        - fork() + execv(), what do_exec() used to do
+ *   vfork       - vfork() + execv()
+ *   do_exec     - posix_spawn(), see systemcalls.c
+ *   do_exec_capture - posix_spawn() with stdout and stderr piped back
+ *
+ * Usage: spawn-bench [iterations] [max parent MiB]
+ *
+ * Results are written to stdout as CSV, one row per case:
+ *   parent_mib,method,iterations,us_per_spawn
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+
+#define COMMAND "/bin/true"
+
+static char *const command[] = { COMMAND, NULL };
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static bool run_fork(void)
+{
+    int status;
+    pid_t pid = fork();
+
+    if (pid < 0)
+        return false;
+    if (pid == 0)
+    {
+        execv(command[0], command);
+        _exit(127);
+    }
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool run_vfork(void)
+{
+    int status;
+    pid_t pid = vfork();
+
+    if (pid < 0)
+        return false;
+    if (pid == 0)
+    {
+        execv(command[0], command);
+        _exit(127);
+    }
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool run_do_exec(void)
+{
+    return do_exec(1, COMMAND);
+}
+
+static bool run_do_exec_capture(void)
+{
+    char out[64];
+    struct exec_capture capture = { .buf = out, .size = sizeof(out) };
+
+    return do_exec_capture(&capture, &capture, 1, COMMAND);
+}
+
+static int bench(size_t parent_mib, const char *name, bool (*run)(void), size_t iterations)
+{
+    size_t failures = 0;
+    size_t i;
+    double start = now_us();
+
+    for (i = 0; i < iterations; i++)
+    {
+        failures += !run();
+    }
+    printf("%zu,%s,%zu,%.1f\n", parent_mib, name, iterations, (now_us() - start) / iterations);
+    if (failures)
+        fprintf(stderr, "%s: %zu of %zu runs failed\n", name, failures, iterations);
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : 200;
+    size_t max_mib = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1024;
+    size_t parent_mib;
+    char *heap = NULL;
+    int rc = 0;
+
+    if (iterations == 0)
+    {
+        fprintf(stderr, "usage: %s [iterations] [max parent MiB]\n", argv[0]);
+        return 1;
+    }
+
+    printf("parent_mib,method,iterations,us_per_spawn\n");
+
+    for (parent_mib = 0; parent_mib <= max_mib; parent_mib = parent_mib ? parent_mib * 4 : 16)
+    {
+        // Resident and dirty, like the heap of a long running process
+        free(heap);
+        heap = NULL;
+        if (parent_mib > 0)
+        {
+            heap = malloc(parent_mib << 20);
+            if (!heap)
+            {
+                fprintf(stderr, "allocation of %zu MiB failed\n", parent_mib);
+                return 1;
+            }
+            memset(heap, 1, parent_mib << 20);
+        }
+
+        rc |= bench(parent_mib, "fork", run_fork, iterations);
+        rc |= bench(parent_mib, "vfork", run_vfork, iterations);
+        rc |= bench(parent_mib, "do_exec", run_do_exec, iterations);
+        rc |= bench(parent_mib, "do_exec_capture", run_do_exec_capture, iterations);
+    }
+
+    free(heap);
+    return rc;
+}
@@ -1,10 +1,24 @@
+#define _GNU_SOURCE     // pipe2()
 #include "systemcalls.h"
+#include <errno.h>
+#include <string.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 
+extern char **environ;
+
+#define EXEC_KILL_GRACE_MS 1000     // Default time between SIGTERM and SIGKILL
+#define EXEC_POLL_MS 10             // Exit polling interval without pidfds
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -26,6 +40,36 @@ bool do_system(const char *cmd)
     return true;
 }
 
+/**
+ * Start @param command with posix_spawn(), which glibc implements with
+ * clone(CLONE_VM | CLONE_VFORK): the child borrows the parent's address
+ * space until it execs instead of getting a copy of its page tables, so the
+ * cost does not grow with the size of the parent the way fork() does.
+ * @param actions may be NULL
+ * @return true if the command was started, its id is in @param pid
+ */
+static bool spawn_command(char *const command[], const posix_spawn_file_actions_t *actions, pid_t *pid)
+{
+    // Keep our buffered output ahead of the command's
+    fflush(stdout);
+    return posix_spawn(pid, command[0], actions, NULL, command, environ) == 0;
+}
+
+/**
+ * @return true if @param pid exited with status 0
+ */
+static bool wait_command(pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+            return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -47,124 +91,570 @@ bool do_exec(int count, ...)
     char * command[count+1];
     int i;
     pid_t pid;
-    int status;
 
     for(i=0; i<count; i++)
     {
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
+    va_end(args);
 
-/*
- * TODO:
- *   Execute a system command by calling fork, execv(),
- *   and wait instead of system (see LSP page 161).
- *   Use the command[0] as the full path to the command to execute
- *   (first argument to execv), and use the remaining arguments
- *   as second argument to the execv() command.
- *
+    if (!spawn_command(command, NULL, &pid))
+        return false;
+
+    return wait_command(pid);
+}
+
+/**
+* @param outputfile - The full path to the file to write with command output.
+*   This file will be closed at completion of the function call.
+* All other parameters, see do_exec above
 */
-    fflush(stdout);
-    pid = fork();
-    if (pid < 0) 
+bool do_exec_redirect(const char *outputfile, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    pid_t pid;
+    int fd;
+    bool started;
+    posix_spawn_file_actions_t actions;
+
+    for(i=0; i<count; i++)
     {
-        // Fork failed
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    // Close-on-exec, only the child's dup2() copy on stdout survives exec
+    fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+    started = spawn_command(command, &actions, &pid);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fd);
+
+    if (!started)
         return false;
-    } 
-    else if (pid == 0) 
+
+    return wait_command(pid);
+}
+
+/**
+ * Append @param n bytes from @param data to @param capture, dropping what
+ * does not fit
+ */
+static void capture_append(struct exec_capture *capture, const char *data, size_t n)
+{
+    size_t room = 0;
+
+    if (capture->buf && capture->size > 0)
+        room = capture->size - 1 - capture->len;
+    if (n > room)
     {
-        // Child process
-        execv(command[0], command);
-        exit(-1);
+        capture->truncated = true;
+        n = room;
+    }
+    if (n > 0)
+    {
+        memcpy(capture->buf + capture->len, data, n);
+        capture->len += n;
+        capture->buf[capture->len] = '\0';
     }
+}
 
-    // Parent process
-    va_end(args);
+/**
+ * Read both pipes until the command closed them
+ * @param fds read ends for stdout and stderr, -1 for a stream not captured
+ */
+static bool capture_drain(int fds[2], struct exec_capture *captures[2])
+{
+    struct pollfd pfd[2];
+    char chunk[4096];
+    ssize_t n;
+    int i;
 
-    if (waitpid(pid, &status, 0) == -1) 
+    for (i = 0; i < 2; i++)
     {
-        return false;
+        pfd[i].fd = fds[i];
+        pfd[i].events = POLLIN;
     }
 
-    if (WIFEXITED(status)) 
+    while (pfd[0].fd >= 0 || pfd[1].fd >= 0)
     {
-        if (WEXITSTATUS(status) != 0)
+        if (poll(pfd, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
             return false;
-        else
-            return true;
+        }
+        for (i = 0; i < 2; i++)
+        {
+            if (pfd[i].fd < 0 || !(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            n = read(pfd[i].fd, chunk, sizeof(chunk));
+            if (n > 0)
+                capture_append(captures[i], chunk, n);
+            else if (n == 0 || errno != EINTR)
+                pfd[i].fd = -1;     // poll() skips negative descriptors
+        }
     }
-
-    return false;
+    return true;
 }
 
 /**
-* @param outputfile - The full path to the file to write with command output.
-*   This file will be closed at completion of the function call.
-* All other parameters, see do_exec above
+* Like do_exec(), but the command's stdout and stderr are read through pipes
+* into @param out and @param err instead of going to ours. Either may be NULL
+* to leave that stream alone.
+* @return true if the command ran and exited with status 0. The captured
+*   output is valid either way.
 */
-bool do_exec_redirect(const char *outputfile, int count, ...)
+bool do_exec_capture(struct exec_capture *out, struct exec_capture *err, int count, ...)
 {
     va_list args;
     va_start(args, count);
     char * command[count+1];
-    int i;
+    struct exec_capture *captures[2] = { out, err };
+    int pipes[2][2] = { { -1, -1 }, { -1, -1 } };
+    int fds[2] = { -1, -1 };
+    posix_spawn_file_actions_t actions;
+    bool started = false;
+    bool drained;
     pid_t pid;
-    int fd;
-    int status;
+    int i;
 
     for(i=0; i<count; i++)
     {
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
+    va_end(args);
+
+    posix_spawn_file_actions_init(&actions);
+    for (i = 0; i < 2; i++)
+    {
+        if (!captures[i])
+            continue;
+        captures[i]->len = 0;
+        captures[i]->truncated = false;
+        if (captures[i]->buf && captures[i]->size > 0)
+            captures[i]->buf[0] = '\0';
+        if (pipe2(pipes[i], O_CLOEXEC) != 0)
+            goto close_pipes;
+        posix_spawn_file_actions_adddup2(&actions, pipes[i][1], STDOUT_FILENO + i);
+    }
 
+    started = spawn_command(command, &actions, &pid);
 
-/*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
+close_pipes:
+    posix_spawn_file_actions_destroy(&actions);
+    // Our write ends must be gone for the reads below to see EOF
+    for (i = 0; i < 2; i++)
+    {
+        if (pipes[i][1] >= 0)
+            close(pipes[i][1]);
+        fds[i] = pipes[i][0];
+    }
+
+    if (!started)
+    {
+        for (i = 0; i < 2; i++)
+        {
+            if (fds[i] >= 0)
+                close(fds[i]);
+        }
+        return false;
+    }
+
+    drained = capture_drain(fds, captures);
+    for (i = 0; i < 2; i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+
+    return wait_command(pid) && drained;
+}
+
+static long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/**
+ * Reap @param pid without a pidfd, @param result->code is -1 if
+ * @param pid could not be waited for
+ */
+static void reap_pid(pid_t pid, long started_us, struct exec_result *result)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            result->code = -1;
+            return;
+        }
+    }
+    result->elapsed_us = now_us() - started_us;
+    result->signaled = WIFSIGNALED(status);
+    result->code = result->signaled ? WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/**
+ * Record how the child behind @param pidfd, @param pid ended and release it
+ */
+static void reap_pidfd(int pidfd, pid_t pid, long started_us, struct exec_result *result)
+{
+    siginfo_t info;
+    int rc;
+
+    memset(&info, 0, sizeof(info));
+    while ((rc = waitid(P_PIDFD, pidfd, &info, WEXITED)) == -1 && errno == EINTR)
+        ;
+    close(pidfd);
+    if (rc != 0)
+    {
+        // waitid(P_PIDFD) needs Linux 5.4, pidfd_open() is there from 5.3
+        reap_pid(pid, started_us, result);
+        return;
+    }
+    result->elapsed_us = now_us() - started_us;
+    result->signaled = (info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED);
+    result->code = info.si_status;
+}
+
+/**
+* Run @param count commands, at most @param parallelism at a time. Each entry
+* of @param commands is a NULL terminated argument vector as for execv(), the
+* first element being the full path of the command.
+*
+* Children are watched through pidfds, so a slot is refilled as soon as any
+* running command exits regardless of the order they were started in.
+*
+* @param results receives one entry per command, in the order of @param commands
+* @return true if every command was started and exited with status 0
 */
-    fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-    if (fd < 0) return false;
+bool do_exec_parallel(char *const *commands[], size_t count, size_t parallelism,
+                      struct exec_result results[])
+{
+    struct pollfd *running;
+    size_t *slot_command;
+    pid_t *slot_pid;
+    long *slot_started;
+    size_t next = 0;
+    size_t active = 0;
+    size_t i;
+    pid_t pid;
+    int pidfd;
+    bool ok = true;
 
-    pid = fork();
-    if (pid < 0)
+    if (parallelism == 0)
+        parallelism = 1;
+    if (parallelism > count)
+        parallelism = count;
+
+    running = calloc(parallelism, sizeof(*running));
+    slot_command = calloc(parallelism, sizeof(*slot_command));
+    slot_pid = calloc(parallelism, sizeof(*slot_pid));
+    slot_started = calloc(parallelism, sizeof(*slot_started));
+    if (count > 0 && (!running || !slot_command || !slot_pid || !slot_started))
+    {
+        free(running);
+        free(slot_command);
+        free(slot_pid);
+        free(slot_started);
         return false;
-    else if (pid == 0)
+    }
+
+    memset(results, 0, count * sizeof(*results));
+    for (i = 0; i < parallelism; i++)
     {
-        // Redirect stdout to file
-        if (dup2(fd, STDOUT_FILENO) < 0)
-            return false;
+        running[i].fd = -1;
+        running[i].events = POLLIN;
+    }
 
-        close(fd);
-        execv(command[0], command);
-        exit(-1);       // If this executes, then execv somehow failed
+    while (next < count || active > 0)
+    {
+        // Fill free slots
+        for (i = 0; i < parallelism && next < count; i++)
+        {
+            if (running[i].fd >= 0)
+                continue;
+
+            slot_started[i] = now_us();
+            if (!spawn_command(commands[next], NULL, &pid))
+            {
+                results[next++].started = false;
+                ok = false;
+                continue;
+            }
+            results[next].started = true;
+
+            pidfd = syscall(SYS_pidfd_open, pid, 0);
+            if (pidfd < 0)
+            {
+                // Kernel without pidfds, wait for this one in place
+                reap_pid(pid, slot_started[i], &results[next]);
+                ok &= !results[next].signaled && results[next].code == 0;
+                next++;
+                continue;
+            }
+            running[i].fd = pidfd;
+            slot_command[i] = next++;
+            slot_pid[i] = pid;
+            active++;
+        }
+
+        if (active == 0)
+            continue;
+
+        if (poll(running, parallelism, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // Cannot watch them any more, reap in order
+            for (i = 0; i < parallelism; i++)
+                running[i].revents = (running[i].fd >= 0) ? POLLIN : 0;
+        }
+
+        for (i = 0; i < parallelism; i++)
+        {
+            if (running[i].fd < 0 || !(running[i].revents & POLLIN))
+                continue;
+            reap_pidfd(running[i].fd, slot_pid[i], slot_started[i], &results[slot_command[i]]);
+            ok &= !results[slot_command[i]].signaled && results[slot_command[i]].code == 0;
+            running[i].fd = -1;
+            active--;
+        }
     }
 
-    // Parent
-    close(fd);
-    va_end(args);
+    free(running);
+    free(slot_command);
+    free(slot_pid);
+    free(slot_started);
+    return ok;
+}
+
+/**
+ * Apply the non-zero limits in @param limits to the calling process
+ */
+static int apply_limits(const struct exec_limits *limits)
+{
+    const struct {
+        int resource;
+        unsigned long value;
+    } table[] = {
+        { RLIMIT_CPU, limits->cpu_seconds },
+        { RLIMIT_AS, limits->address_space },
+        { RLIMIT_NOFILE, limits->open_files },
+    };
+    struct rlimit rl;
+    size_t i;
+
+    for (i = 0; i < sizeof(table) / sizeof(table[0]); i++)
+    {
+        if (table[i].value == 0)
+            continue;
+        rl.rlim_cur = table[i].value;
+        rl.rlim_max = table[i].value;
+        if (setrlimit(table[i].resource, &rl) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wait up to @param timeout_ms (-1 for ever) for @param pid to exit without
+ * reaping it. Uses @param pidfd when there is one.
+ * @return true once it exited
+ */
+static bool wait_exit(pid_t pid, int pidfd, long timeout_ms)
+{
+    struct timespec nap = { 0, EXEC_POLL_MS * 1000000L };
+    long deadline_us = now_us() + timeout_ms * 1000;
+    long remaining_ms = timeout_ms;
+    struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+    siginfo_t info;
+    int rc;
+
+    while (true)
+    {
+        if (timeout_ms >= 0)
+        {
+            remaining_ms = (deadline_us - now_us() + 999) / 1000;
+            if (remaining_ms < 0)
+                remaining_ms = 0;
+        }
+
+        if (pidfd >= 0)
+        {
+            rc = poll(&pfd, 1, timeout_ms >= 0 ? (int)remaining_ms : -1);
+            if (rc > 0)
+                return true;
+            if (rc == 0)
+                return false;
+            if (errno != EINTR)
+                pidfd = -1;     // Fall back to polling below
+            continue;
+        }
+
+        info.si_pid = 0;
+        if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid)
+            return true;
+        if (timeout_ms >= 0 && remaining_ms == 0)
+            return false;
+        nanosleep(&nap, NULL);
+    }
+}
+
+static void signal_child(pid_t pid, int pidfd, int sig)
+{
+    // The child is not reaped yet, so its pid cannot have been reused
+    if (pidfd < 0 || syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0) != 0)
+        kill(pid, sig);
+}
+
+/**
+ * Run @param command with @param limits_arg, stdout going to @param outputfile
+ * when not NULL, and fill @param usage
+ */
+static bool exec_limited(const char *outputfile, const struct exec_limits *limits_arg,
+                         struct exec_usage *usage, char *const command[])
+{
+    struct exec_limits none = {0};
+    // Live across vfork(), so kept out of registers the child may reuse
+    const struct exec_limits *volatile limits = limits_arg ? limits_arg : &none;
+    volatile int fd = -1;
+    struct sigaction dfl = { .sa_handler = SIG_DFL };
+    struct sigaction sa;
+    sigset_t all, saved;
+    struct rusage ru;
+    long grace_ms;
+    long start_us;
+    int status;
+    int pidfd;
+    int sig;
+    pid_t pid;
+
+    memset(usage, 0, sizeof(*usage));
+    grace_ms = limits->kill_grace_ms > 0 ? limits->kill_grace_ms : EXEC_KILL_GRACE_MS;
 
-    if (waitpid(pid, &status, 0) == -1)
+    if (outputfile)
     {
+        fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+    }
+
+    fflush(stdout);
+    start_us = now_us();
+    // posix_spawn() cannot set rlimits. vfork() shares our address space like
+    // it does, the child only makes system calls before it execs. Signals stay
+    // blocked until then, a handler run by the child would do so on our stack.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pid = vfork();
+    if (pid == 0)
+    {
+        for (sig = 1; sig < NSIG; sig++)
+        {
+            if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL)
+                sigaction(sig, &dfl, NULL);
+        }
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        if ((fd >= 0 && dup2(fd, STDOUT_FILENO) < 0) || apply_limits(limits) != 0)
+            _exit(127);
+        execv(command[0], command);
+        _exit(127);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (fd >= 0)
+        close(fd);
+    if (pid < 0)
         return false;
+
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (limits->timeout_ms > 0 && !wait_exit(pid, pidfd, limits->timeout_ms))
+    {
+        usage->timed_out = true;
+        signal_child(pid, pidfd, SIGTERM);
+        if (!wait_exit(pid, pidfd, grace_ms))
+            signal_child(pid, pidfd, SIGKILL);
     }
 
-    if (WIFEXITED(status)) 
+    while (wait4(pid, &status, 0, &ru) == -1)
     {
-        if (WEXITSTATUS(status) != 0)
+        if (errno != EINTR)
+        {
+            if (pidfd >= 0) close(pidfd);
             return false;
-        else
-            return true;
+        }
     }
+    if (pidfd >= 0)
+        close(pidfd);
+
+    usage->elapsed_us = now_us() - start_us;
+    usage->user_us = ru.ru_utime.tv_sec * 1000000L + ru.ru_utime.tv_usec;
+    usage->system_us = ru.ru_stime.tv_sec * 1000000L + ru.ru_stime.tv_usec;
+    usage->max_rss_kb = ru.ru_maxrss;
+    usage->signaled = WIFSIGNALED(status);
+    usage->code = usage->signaled ? WTERMSIG(status) : WEXITSTATUS(status);
+
+    return !usage->timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+* Like do_exec(), but the command is stopped once it runs past
+* @param limits->timeout_ms (SIGTERM, then SIGKILL after kill_grace_ms) and
+* starts with the CPU, address space and open file rlimits in @param limits.
+* @param limits may be NULL for no limits.
+* @param usage receives the exit status, whether the deadline hit, and the
+*   child's CPU time and peak RSS
+* @return true if the command exited with status 0 before the deadline
+*/
+bool do_exec_limited(const struct exec_limits *limits, struct exec_usage *usage, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
 
-    return false;
-}
\ No newline at end of file
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    return exec_limited(NULL, limits, usage, command);
+}
+
+/**
+* do_exec_limited() with stdout redirected to @param outputfile, see
+* do_exec_redirect()
+*/
+bool do_exec_redirect_limited(const char *outputfile, const struct exec_limits *limits,
+                              struct exec_usage *usage, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    return exec_limited(outputfile, limits, usage, command);
+}
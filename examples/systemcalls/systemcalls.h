@@ -1,9 +1,67 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * Caller owned buffer receiving one output stream of a command run with
+ * do_exec_capture(). Output beyond size - 1 bytes is read and dropped so the
+ * command never blocks on a full pipe.
+ */
+struct exec_capture {
+    char *buf;          // May be NULL to discard the stream
+    size_t size;
+    size_t len;         // Bytes stored, buf is NUL terminated when size > 0
+    bool truncated;
+};
+
+bool do_exec_capture(struct exec_capture *out, struct exec_capture *err, int count, ...);
+
+/**
+ * Outcome of one command run by do_exec_parallel()
+ */
+struct exec_result {
+    bool started;       // false if the command could not be spawned
+    bool signaled;      // Killed by signal number code
+    int code;           // Exit status, or the signal number
+    long elapsed_us;    // From spawn until the exit was noticed
+};
+
+bool do_exec_parallel(char *const *commands[], size_t count, size_t parallelism,
+                      struct exec_result results[]);
+
+/**
+ * Limits for do_exec_limited() and do_exec_redirect_limited(), 0 leaves a
+ * value unlimited or inherited
+ */
+struct exec_limits {
+    long timeout_ms;            // SIGTERM once the command ran this long
+    long kill_grace_ms;         // SIGKILL this long after SIGTERM
+    unsigned long cpu_seconds;  // RLIMIT_CPU
+    unsigned long address_space;// RLIMIT_AS, bytes
+    unsigned long open_files;   // RLIMIT_NOFILE
+};
+
+/**
+ * How a command run by do_exec_limited() ended and what it used
+ */
+struct exec_usage {
+    bool timed_out;             // Killed for running past timeout_ms
+    bool signaled;              // Killed by signal number code
+    int code;                   // Exit status, or the signal number
+    long elapsed_us;
+    long user_us;               // CPU time from the child's rusage
+    long system_us;
+    long max_rss_kb;
+};
+
+bool do_exec_limited(const struct exec_limits *limits, struct exec_usage *usage, int count, ...);
+
+bool do_exec_redirect_limited(const char *outputfile, const struct exec_limits *limits,
+                              struct exec_usage *usage, int count, ...);
@@ -0,0 +1,275 @@
+/**
+ * @file lock-bench.c
+ * @brief Lock contention benchmark grown from threadfunc() in threading.c
+ *
+ * Each thread repeats threadfunc()'s cycle of wait, lock, hold, unlock for a
+ * fixed time, with the wait and hold spent spinning rather than sleeping so
+ * sub-millisecond critical sections like the server's storage writes can be
+ * modelled. Every acquire is timed from the lock call until it returns.
+ *
+ * Locks:
+ *   mutex    - default pthread_mutex_t
+ *   adaptive - PTHREAD_MUTEX_ADAPTIVE_NP, spins briefly before sleeping
+ *   ticket   - ticket_lock_t from locks.h
+ *   futex    - futex_lock_t from locks.h
+ *
+ * Wait and hold times are drawn per cycle from a distribution with the
+ * given mean:
+ *   fixed   - always the mean
+ *   uniform - uniform over [0, 2 * mean]
+ *   exp     - exponential, a few long holds among many short ones
+ *
+ * Usage: lock-bench [threads] [wait ns] [hold ns] [distribution] [seconds]
+ *
+ * Results are written to stdout as CSV, one row per lock:
+ *   lock,threads,wait_ns,hold_ns,distribution,ops,ops_per_sec,p50_ns,p90_ns,p99_ns,max_ns
+ */
+
+#define _GNU_SOURCE     // PTHREAD_MUTEX_ADAPTIVE_NP
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "locks.h"
+
+#define MAX_SAMPLES_PER_THREAD (1 << 20)
+
+enum lock_kind { LOCK_MUTEX, LOCK_ADAPTIVE, LOCK_TICKET, LOCK_FUTEX, LOCK_KINDS };
+
+static const char *lock_names[LOCK_KINDS] = { "mutex", "adaptive", "ticket", "futex" };
+
+struct bench_lock
+{
+    enum lock_kind kind;
+    pthread_mutex_t mutex;
+    ticket_lock_t ticket;
+    futex_lock_t futex;
+    uint64_t counter;       // Plain increment under the lock, checks exclusion
+};
+
+struct bench_thread
+{
+    pthread_t tid;
+    struct bench_lock *lock;
+    const char *distribution;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t end_ns;
+    uint64_t rng;
+    uint64_t ops;
+    uint64_t *samples;      // Acquire latencies, the first MAX_SAMPLES_PER_THREAD
+    size_t nsamples;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64, deterministic between runs so results are comparable
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static uint64_t draw(struct bench_thread *t, uint64_t mean)
+{
+    double u;
+
+    if (mean == 0 || strcmp(t->distribution, "fixed") == 0)
+        return mean;
+    if (strcmp(t->distribution, "uniform") == 0)
+        return next_random(&t->rng) % (2 * mean + 1);
+    u = (next_random(&t->rng) >> 11) * (1.0 / 9007199254740992.0);
+    return (uint64_t)(-log(1.0 - u) * mean);
+}
+
+static void spin_ns(uint64_t ns)
+{
+    uint64_t until;
+
+    if (ns == 0)
+        return;
+    until = now_ns() + ns;
+    while (now_ns() < until)
+        ;
+}
+
+static void bench_lock_acquire(struct bench_lock *l)
+{
+    switch (l->kind)
+    {
+        case LOCK_MUTEX:
+        case LOCK_ADAPTIVE:
+            pthread_mutex_lock(&l->mutex);
+            break;
+        case LOCK_TICKET:
+            ticket_lock(&l->ticket);
+            break;
+        default:
+            futex_lock(&l->futex);
+            break;
+    }
+}
+
+static void bench_lock_release(struct bench_lock *l)
+{
+    switch (l->kind)
+    {
+        case LOCK_MUTEX:
+        case LOCK_ADAPTIVE:
+            pthread_mutex_unlock(&l->mutex);
+            break;
+        case LOCK_TICKET:
+            ticket_unlock(&l->ticket);
+            break;
+        default:
+            futex_unlock(&l->futex);
+            break;
+    }
+}
+
+static void *bench_threadfunc(void *arg)
+{
+    struct bench_thread *t = arg;
+    uint64_t start;
+    uint64_t hold;
+
+    while (now_ns() < t->end_ns)
+    {
+        spin_ns(draw(t, t->wait_ns));
+        hold = draw(t, t->hold_ns);
+
+        start = now_ns();
+        bench_lock_acquire(t->lock);
+        if (t->nsamples < MAX_SAMPLES_PER_THREAD)
+            t->samples[t->nsamples++] = now_ns() - start;
+        t->lock->counter++;
+        spin_ns(hold);
+        bench_lock_release(t->lock);
+        t->ops++;
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int bench(enum lock_kind kind, int threads, uint64_t wait_ns, uint64_t hold_ns,
+                 const char *distribution, double seconds)
+{
+    struct bench_lock lock;
+    struct bench_thread *t = calloc(threads, sizeof(*t));
+    pthread_mutexattr_t attr;
+    uint64_t *all;
+    uint64_t ops = 0;
+    uint64_t start;
+    double elapsed;
+    size_t n = 0;
+    int i;
+
+    if (!t)
+        return 1;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.kind = kind;
+    pthread_mutexattr_init(&attr);
+    if (kind == LOCK_ADAPTIVE)
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    pthread_mutex_init(&lock.mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    start = now_ns();
+    for (i = 0; i < threads; i++)
+    {
+        t[i].lock = &lock;
+        t[i].distribution = distribution;
+        t[i].wait_ns = wait_ns;
+        t[i].hold_ns = hold_ns;
+        t[i].end_ns = start + (uint64_t)(seconds * 1e9);
+        t[i].rng = 0x9e3779b97f4a7c15ULL + i;
+        t[i].samples = malloc(MAX_SAMPLES_PER_THREAD * sizeof(uint64_t));
+        if (!t[i].samples || pthread_create(&t[i].tid, NULL, bench_threadfunc, &t[i]) != 0)
+        {
+            fprintf(stderr, "failed to start thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(t[i].tid, NULL);
+        ops += t[i].ops;
+        n += t[i].nsamples;
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    all = malloc((n ? n : 1) * sizeof(uint64_t));
+    if (!all)
+        return 1;
+    n = 0;
+    for (i = 0; i < threads; i++)
+    {
+        memcpy(all + n, t[i].samples, t[i].nsamples * sizeof(uint64_t));
+        n += t[i].nsamples;
+        free(t[i].samples);
+    }
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+
+    printf("%s,%d,%llu,%llu,%s,%llu,%.0f,%llu,%llu,%llu,%llu\n", lock_names[kind], threads,
+           (unsigned long long)wait_ns, (unsigned long long)hold_ns, distribution,
+           (unsigned long long)ops, ops / elapsed,
+           (unsigned long long)(n ? all[n / 2] : 0), (unsigned long long)(n ? all[n * 9 / 10] : 0),
+           (unsigned long long)(n ? all[n * 99 / 100] : 0), (unsigned long long)(n ? all[n - 1] : 0));
+
+    pthread_mutex_destroy(&lock.mutex);
+    free(all);
+    free(t);
+    if (lock.counter != ops)
+    {
+        fprintf(stderr, "%s: %llu increments for %llu ops, lock is broken\n", lock_names[kind],
+                (unsigned long long)lock.counter, (unsigned long long)ops);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int threads = (argc > 1) ? atoi(argv[1]) : 4;
+    uint64_t wait_ns = (argc > 2) ? strtoull(argv[2], NULL, 0) : 1000;
+    uint64_t hold_ns = (argc > 3) ? strtoull(argv[3], NULL, 0) : 200;
+    const char *distribution = (argc > 4) ? argv[4] : "fixed";
+    double seconds = (argc > 5) ? atof(argv[5]) : 1.0;
+    int rc = 0;
+    int k;
+
+    if (threads < 1 || seconds <= 0 ||
+        (strcmp(distribution, "fixed") && strcmp(distribution, "uniform") && strcmp(distribution, "exp")))
+    {
+        fprintf(stderr, "usage: %s [threads] [wait ns] [hold ns] [fixed|uniform|exp] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    printf("lock,threads,wait_ns,hold_ns,distribution,ops,ops_per_sec,p50_ns,p90_ns,p99_ns,max_ns\n");
+    for (k = 0; k < LOCK_KINDS; k++)
+    {
+        rc |= bench(k, threads, wait_ns, hold_ns, distribution, seconds);
+    }
+    return rc;
+}
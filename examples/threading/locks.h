@@ -0,0 +1,96 @@
+/**
+ * @file locks.h
+ * @brief Userspace locks compared against pthread_mutex_t by lock-bench.c
+ *
+ *   ticket_lock_t - FIFO spinlock, yields after TICKET_SPIN_LIMIT polls so an
+ *                   oversubscribed machine still makes progress
+ *   futex_lock_t  - three state futex mutex (Drepper, "Futexes Are Tricky"),
+ *                   only enters the kernel when the lock is contended
+ *
+ * Both are valid when zero initialized.
+ */
+
+#ifndef LOCKS_H
+#define LOCKS_H
+
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define TICKET_SPIN_LIMIT 128
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+typedef struct
+{
+    atomic_uint next;
+    atomic_uint serving;
+} ticket_lock_t;
+
+static inline void ticket_lock(ticket_lock_t *l)
+{
+    unsigned int me = atomic_fetch_add_explicit(&l->next, 1, memory_order_relaxed);
+    unsigned int spins = 0;
+
+    while (atomic_load_explicit(&l->serving, memory_order_acquire) != me)
+    {
+        if (++spins < TICKET_SPIN_LIMIT)
+            cpu_relax();
+        else
+            sched_yield();
+    }
+}
+
+static inline void ticket_unlock(ticket_lock_t *l)
+{
+    unsigned int serving = atomic_load_explicit(&l->serving, memory_order_relaxed);
+
+    atomic_store_explicit(&l->serving, serving + 1, memory_order_release);
+}
+
+// 0 unlocked, 1 locked, 2 locked and maybe waiters
+typedef struct
+{
+    atomic_int state;
+} futex_lock_t;
+
+static inline void futex_call(atomic_int *addr, int op, int val)
+{
+    syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static inline void futex_lock(futex_lock_t *l)
+{
+    int c = 0;
+
+    if (atomic_compare_exchange_strong_explicit(&l->state, &c, 1, memory_order_acquire, memory_order_relaxed))
+        return;
+
+    if (c != 2)
+        c = atomic_exchange_explicit(&l->state, 2, memory_order_acquire);
+    while (c != 0)
+    {
+        futex_call(&l->state, FUTEX_WAIT_PRIVATE, 2);
+        c = atomic_exchange_explicit(&l->state, 2, memory_order_acquire);
+    }
+}
+
+static inline void futex_unlock(futex_lock_t *l)
+{
+    if (atomic_fetch_sub_explicit(&l->state, 1, memory_order_release) != 1)
+    {
+        atomic_store_explicit(&l->state, 0, memory_order_release);
+        futex_call(&l->state, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+#endif
@@ -0,0 +1,258 @@
+/**
+ * @file task-bench.c
+ * @brief Task throughput of task_pool.c against a thread per task
+ *
+ *   pthread     - pthread_create() + pthread_join() per task, as
+ *                 start_thread_obtaining_mutex() does, `workers` at a time
+ *   pool_post   - task_post() with a completion callback
+ *   pool_future - task_submit() + task_future_wait() in batches
+ *   pool_spawn  - one task fanning out a binary tree of tasks from the
+ *                 workers, which exercises the deques and stealing
+ *   pool_delay  - task_post() with delays up to 50 ms, reports how late the
+ *                 timer wheel ran them
+ *
+ * Usage: task-bench [tasks] [workers]
+ * Prints one line per case:
+ *   <case> tasks=<n> workers=<n> sec=<s> tasks_per_sec=<n> [late_p50_us=<n> late_p99_us=<n>]
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "task_pool.h"
+
+#define FUTURE_BATCH 1024
+#define MAX_DELAY_MS 50
+
+static atomic_long completed;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long tasks, int workers, double sec)
+{
+    printf("%s tasks=%ld workers=%d sec=%.3f tasks_per_sec=%.0f\n", name, tasks, workers, sec, tasks / sec);
+}
+
+static void *work(void *arg)
+{
+    return arg;
+}
+
+static void count_done(void *result, void *ctx)
+{
+    (void)result;
+    (void)ctx;
+    atomic_fetch_add(&completed, 1);
+}
+
+static void wait_completed(long tasks)
+{
+    struct timespec nap = { 0, 100000 };
+
+    while (atomic_load(&completed) < tasks)
+        nanosleep(&nap, NULL);
+}
+
+static void bench_pthread(long tasks, int workers)
+{
+    pthread_t *tids = malloc(workers * sizeof(*tids));
+    double start = now_sec();
+    long done = 0;
+    int n, i;
+
+    while (done < tasks)
+    {
+        n = (tasks - done < workers) ? tasks - done : workers;
+        for (i = 0; i < n; i++)
+        {
+            if (pthread_create(&tids[i], NULL, work, NULL) != 0)
+            {
+                fprintf(stderr, "pthread_create failed\n");
+                exit(1);
+            }
+        }
+        for (i = 0; i < n; i++)
+            pthread_join(tids[i], NULL);
+        done += n;
+    }
+    report("pthread", tasks, workers, now_sec() - start);
+    free(tids);
+}
+
+static void bench_post(task_pool_t *pool, long tasks, int workers)
+{
+    double start = now_sec();
+    long i;
+
+    atomic_store(&completed, 0);
+    for (i = 0; i < tasks; i++)
+    {
+        if (!task_post(pool, 0, work, NULL, count_done, NULL))
+            exit(1);
+    }
+    wait_completed(tasks);
+    report("pool_post", tasks, workers, now_sec() - start);
+}
+
+static void bench_future(task_pool_t *pool, long tasks, int workers)
+{
+    task_future_t *futures[FUTURE_BATCH];
+    double start = now_sec();
+    long done = 0;
+    long sum = 0;
+    int n, i;
+
+    while (done < tasks)
+    {
+        n = (tasks - done < FUTURE_BATCH) ? tasks - done : FUTURE_BATCH;
+        for (i = 0; i < n; i++)
+        {
+            futures[i] = task_submit(pool, work, (void *)(intptr_t)1);
+            if (!futures[i])
+                exit(1);
+        }
+        for (i = 0; i < n; i++)
+            sum += (intptr_t)task_future_wait(futures[i]);
+        done += n;
+    }
+    report("pool_future", tasks, workers, now_sec() - start);
+    if (sum != tasks)
+        fprintf(stderr, "pool_future: %ld results for %ld tasks\n", sum, tasks);
+}
+
+struct spawn_ctx
+{
+    task_pool_t *pool;
+    long remaining;     // Tasks in this subtree, including this one
+};
+
+static void *spawn_tree(void *arg)
+{
+    struct spawn_ctx *ctx = arg;
+    struct spawn_ctx *child;
+    long left = (ctx->remaining - 1) / 2;
+    long right = ctx->remaining - 1 - left;
+    long sizes[2] = { left, right };
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (sizes[i] == 0)
+            continue;
+        child = malloc(sizeof(*child));
+        if (!child)
+            exit(1);
+        child->pool = ctx->pool;
+        child->remaining = sizes[i];
+        if (!task_post(ctx->pool, 0, spawn_tree, child, count_done, NULL))
+            exit(1);
+    }
+    free(ctx);
+    return NULL;
+}
+
+static void bench_spawn(task_pool_t *pool, long tasks, int workers)
+{
+    struct spawn_ctx *root = malloc(sizeof(*root));
+    double start = now_sec();
+
+    atomic_store(&completed, 0);
+    root->pool = pool;
+    root->remaining = tasks;
+    if (!task_post(pool, 0, spawn_tree, root, count_done, NULL))
+        exit(1);
+    wait_completed(tasks);
+    report("pool_spawn", tasks, workers, now_sec() - start);
+}
+
+struct delay_ctx
+{
+    double due;
+    double late;
+};
+
+static void *record_lateness(void *arg)
+{
+    struct delay_ctx *d = arg;
+
+    d->late = now_sec() - d->due;
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_delay(task_pool_t *pool, long tasks, int workers)
+{
+    struct delay_ctx *ctx = malloc(tasks * sizeof(*ctx));
+    double *late = malloc(tasks * sizeof(*late));
+    unsigned int delay;
+    double start = now_sec();
+    long i;
+
+    if (!ctx || !late)
+        exit(1);
+
+    atomic_store(&completed, 0);
+    for (i = 0; i < tasks; i++)
+    {
+        delay = 1 + (i * 7919) % MAX_DELAY_MS;
+        ctx[i].due = now_sec() + delay / 1000.0;
+        if (!task_post(pool, delay, record_lateness, &ctx[i], count_done, NULL))
+            exit(1);
+    }
+    wait_completed(tasks);
+
+    for (i = 0; i < tasks; i++)
+        late[i] = ctx[i].late;
+    qsort(late, tasks, sizeof(*late), compare_double);
+    printf("pool_delay tasks=%ld workers=%d sec=%.3f tasks_per_sec=%.0f late_p50_us=%.0f late_p99_us=%.0f\n",
+           tasks, workers, now_sec() - start, tasks / (now_sec() - start),
+           late[tasks / 2] * 1e6, late[tasks * 99 / 100] * 1e6);
+    if (late[0] < 0)
+        fprintf(stderr, "pool_delay: a task ran %.0f us early\n", -late[0] * 1e6);
+
+    free(late);
+    free(ctx);
+}
+
+int main(int argc, char **argv)
+{
+    long tasks = (argc > 1) ? atol(argv[1]) : 100000;
+    int workers = (argc > 2) ? atoi(argv[2]) : 4;
+    task_pool_t *pool;
+
+    if (tasks < 1 || workers < 1)
+    {
+        fprintf(stderr, "usage: %s [tasks] [workers]\n", argv[0]);
+        return 1;
+    }
+
+    bench_pthread(tasks, workers);
+
+    pool = task_pool_create(workers);
+    if (!pool)
+    {
+        fprintf(stderr, "task_pool_create failed\n");
+        return 1;
+    }
+    bench_post(pool, tasks, workers);
+    bench_future(pool, tasks, workers);
+    bench_spawn(pool, tasks, workers);
+    bench_delay(pool, tasks, workers);
+    task_pool_destroy(pool);
+
+    return 0;
+}
@@ -0,0 +1,544 @@
+#include "task_pool.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct task
+{
+    task_fn fn;
+    void *arg;
+    task_done_fn done;
+    void *ctx;
+    task_future_t *future;
+    uint64_t expiry;        // Tick a delayed task is due
+    struct task *next;
+} task_t;
+
+struct task_future
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool ready;
+    void *result;
+};
+
+/*
+ * Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak
+ * Memory Models"). The owner pushes and takes at the bottom, thieves steal
+ * from the top.
+ */
+typedef struct
+{
+    _Alignas(64) atomic_llong top;
+    _Alignas(64) atomic_llong bottom;
+    _Atomic(task_t *) slots[TASK_DEQUE_SIZE];
+} task_deque_t;
+
+typedef struct
+{
+    pthread_t tid;
+    task_pool_t *pool;
+    uint64_t rng;
+    task_deque_t deque;
+} task_worker_t;
+
+struct task_pool
+{
+    int nworkers;               // Fixed before the workers start
+    int started;                // Workers to join
+    task_worker_t *workers;
+    atomic_long queued;         // Runnable tasks not yet taken
+    atomic_int idle;            // Workers about to sleep or sleeping on wake
+    atomic_bool stopping;
+
+    pthread_mutex_t lock;       // Injection queue and idle workers
+    pthread_cond_t wake;
+    task_t *inject_head;
+    task_t *inject_tail;
+    atomic_long injected;
+
+    pthread_t timer_tid;
+    pthread_mutex_t timer_lock;
+    pthread_cond_t timer_wake;  // CLOCK_MONOTONIC
+    task_t *wheel[TASK_WHEEL_SLOTS];
+    long timers;
+    uint64_t last_tick;
+    bool timer_stopping;
+};
+
+// Worker the calling thread is, NULL outside the pools
+static __thread task_worker_t *current_worker;
+
+static bool deque_push(task_deque_t *d, task_t *t)
+{
+    long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&d->top, memory_order_acquire);
+
+    if (b - top >= TASK_DEQUE_SIZE)
+        return false;
+    atomic_store_explicit(&d->slots[b & (TASK_DEQUE_SIZE - 1)], t, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+static task_t *deque_take(task_deque_t *d)
+{
+    long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    long long top;
+    task_t *t = NULL;
+
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (top <= b)
+    {
+        t = atomic_load_explicit(&d->slots[b & (TASK_DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (top == b)
+        {
+            // Last one, race the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed))
+                t = NULL;
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return t;
+}
+
+static task_t *deque_steal(task_deque_t *d)
+{
+    long long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    long long b;
+    task_t *t;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (top >= b)
+        return NULL;
+
+    t = atomic_load_explicit(&d->slots[top & (TASK_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return t;
+}
+
+static uint64_t now_tick(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000) / TASK_TICK_MS;
+}
+
+/**
+ * Make @param t runnable: on the calling worker's deque when it belongs to
+ * @param pool, in the injection queue otherwise. Wakes a worker if one is
+ * idle.
+ */
+static void enqueue(task_pool_t *pool, task_t *t)
+{
+    task_worker_t *w = current_worker;
+
+    if (!w || w->pool != pool || !deque_push(&w->deque, t))
+    {
+        t->next = NULL;
+        pthread_mutex_lock(&pool->lock);
+        if (pool->inject_tail)
+            pool->inject_tail->next = t;
+        else
+            pool->inject_head = t;
+        pool->inject_tail = t;
+        atomic_fetch_add(&pool->injected, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    // Pairs with the idle count a worker raises before its last look at
+    // queued, one of the two sides sees the other
+    atomic_fetch_add(&pool->queued, 1);
+    if (atomic_load(&pool->idle) > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static task_t *inject_pop(task_pool_t *pool)
+{
+    task_t *t;
+
+    if (atomic_load_explicit(&pool->injected, memory_order_relaxed) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    t = pool->inject_head;
+    if (t)
+    {
+        pool->inject_head = t->next;
+        if (!pool->inject_head)
+            pool->inject_tail = NULL;
+        atomic_fetch_sub(&pool->injected, 1);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return t;
+}
+
+static task_t *find_task(task_worker_t *w)
+{
+    task_pool_t *pool = w->pool;
+    task_t *t;
+    int i;
+
+    t = deque_take(&w->deque);
+    if (!t)
+        t = inject_pop(pool);
+    for (i = 0; !t && i < pool->nworkers; i++)
+    {
+        // xorshift64 to spread thieves over the victims
+        w->rng ^= w->rng << 13;
+        w->rng ^= w->rng >> 7;
+        w->rng ^= w->rng << 17;
+        t = deque_steal(&pool->workers[w->rng % pool->nworkers].deque);
+    }
+    if (t)
+        atomic_fetch_sub(&pool->queued, 1);
+    return t;
+}
+
+static void run_task(task_t *t)
+{
+    void *result = t->fn(t->arg);
+
+    if (t->done)
+        t->done(result, t->ctx);
+    if (t->future)
+    {
+        pthread_mutex_lock(&t->future->lock);
+        t->future->result = result;
+        t->future->ready = true;
+        pthread_cond_signal(&t->future->cond);
+        pthread_mutex_unlock(&t->future->lock);
+    }
+    free(t);
+}
+
+static void *worker_thread(void *arg)
+{
+    task_worker_t *w = arg;
+    task_pool_t *pool = w->pool;
+    task_t *t;
+
+    current_worker = w;
+    while (true)
+    {
+        t = find_task(w);
+        if (t)
+        {
+            run_task(t);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->idle, 1);
+        while (atomic_load(&pool->queued) <= 0 && !atomic_load(&pool->stopping))
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        atomic_fetch_sub(&pool->idle, 1);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (atomic_load(&pool->stopping) && atomic_load(&pool->queued) <= 0)
+            break;
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+/**
+ * Move the tasks due at or before @param now out of the wheel, or all of
+ * them when stopping. Called with timer_lock held.
+ */
+static task_t *wheel_expire(task_pool_t *pool, uint64_t now)
+{
+    uint64_t span = now - pool->last_tick;
+    task_t *ready = NULL;
+    task_t **link;
+    task_t *t;
+    uint64_t i;
+
+    if (span > TASK_WHEEL_SLOTS || pool->timer_stopping)
+        span = TASK_WHEEL_SLOTS;
+
+    for (i = 1; i <= span; i++)
+    {
+        link = &pool->wheel[(pool->last_tick + i) & (TASK_WHEEL_SLOTS - 1)];
+        while ((t = *link) != NULL)
+        {
+            if (t->expiry > now && !pool->timer_stopping)
+            {
+                // Due in a later turn of the wheel
+                link = &t->next;
+                continue;
+            }
+            *link = t->next;
+            t->next = ready;
+            ready = t;
+            pool->timers--;
+        }
+    }
+    pool->last_tick = now;
+    return ready;
+}
+
+static void *timer_thread(void *arg)
+{
+    task_pool_t *pool = arg;
+    struct timespec ts;
+    task_t *ready;
+    task_t *next;
+    uint64_t deadline;
+
+    pthread_mutex_lock(&pool->timer_lock);
+    while (true)
+    {
+        ready = wheel_expire(pool, now_tick());
+        if (ready)
+        {
+            pthread_mutex_unlock(&pool->timer_lock);
+            for (; ready; ready = next)
+            {
+                next = ready->next;
+                enqueue(pool, ready);
+            }
+            pthread_mutex_lock(&pool->timer_lock);
+            continue;
+        }
+
+        if (pool->timer_stopping && pool->timers == 0)
+            break;
+        if (pool->timers == 0)
+        {
+            pthread_cond_wait(&pool->timer_wake, &pool->timer_lock);
+            continue;
+        }
+
+        // Sleep until the next tick
+        deadline = (pool->last_tick + 1) * TASK_TICK_MS;
+        ts.tv_sec = deadline / 1000;
+        ts.tv_nsec = (deadline % 1000) * 1000000;
+        pthread_cond_timedwait(&pool->timer_wake, &pool->timer_lock, &ts);
+    }
+    pthread_mutex_unlock(&pool->timer_lock);
+    return NULL;
+}
+
+/**
+ * Start a pool of @param workers threads plus the timer thread
+ * @return NULL on failure
+ */
+task_pool_t *task_pool_create(int workers)
+{
+    task_pool_t *pool;
+    pthread_condattr_t attr;
+    int i;
+
+    if (workers < 1)
+        return NULL;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->workers = calloc(workers, sizeof(*pool->workers));
+    if (!pool->workers)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_mutex_init(&pool->timer_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->timer_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pool->last_tick = now_tick();
+
+    if (pthread_create(&pool->timer_tid, NULL, timer_thread, pool) != 0)
+        goto fail;
+
+    // Deques of workers not started yet are empty to thieves
+    pool->nworkers = workers;
+    for (i = 0; i < workers; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+    for (i = 0; i < workers; i++)
+    {
+        if (pthread_create(&pool->workers[i].tid, NULL, worker_thread, &pool->workers[i]) != 0)
+            break;
+        pool->started++;
+    }
+    if (pool->started == workers)
+        return pool;
+
+    task_pool_destroy(pool);
+    return NULL;
+
+fail:
+    pthread_cond_destroy(&pool->timer_wake);
+    pthread_mutex_destroy(&pool->timer_lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+    return NULL;
+}
+
+/**
+ * Run every submitted task, delayed ones without waiting for their delay,
+ * then stop the threads and free @param pool
+ */
+void task_pool_destroy(task_pool_t *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->timer_lock);
+    pool->timer_stopping = true;
+    pthread_cond_signal(&pool->timer_wake);
+    pthread_mutex_unlock(&pool->timer_lock);
+    pthread_join(pool->timer_tid, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stopping, true);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->started; i++)
+        pthread_join(pool->workers[i].tid, NULL);
+
+    pthread_cond_destroy(&pool->timer_wake);
+    pthread_mutex_destroy(&pool->timer_lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+static task_t *task_new(task_fn fn, void *arg, task_done_fn done, void *ctx, bool future)
+{
+    task_t *t = malloc(sizeof(*t));
+
+    if (!t)
+        return NULL;
+    t->fn = fn;
+    t->arg = arg;
+    t->done = done;
+    t->ctx = ctx;
+    t->future = NULL;
+    if (future)
+    {
+        t->future = malloc(sizeof(*t->future));
+        if (!t->future)
+        {
+            free(t);
+            return NULL;
+        }
+        pthread_mutex_init(&t->future->lock, NULL);
+        pthread_cond_init(&t->future->cond, NULL);
+        t->future->ready = false;
+        t->future->result = NULL;
+    }
+    return t;
+}
+
+static void schedule(task_pool_t *pool, task_t *t, unsigned int delay_ms)
+{
+    uint64_t slot;
+
+    if (delay_ms == 0)
+    {
+        enqueue(pool, t);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->timer_lock);
+    // The current tick is partly over, count it as not waited
+    t->expiry = now_tick() + (delay_ms + TASK_TICK_MS - 1) / TASK_TICK_MS + 1;
+    if (t->expiry <= pool->last_tick)
+        t->expiry = pool->last_tick + 1;
+    slot = t->expiry & (TASK_WHEEL_SLOTS - 1);
+    t->next = pool->wheel[slot];
+    pool->wheel[slot] = t;
+    if (pool->timers++ == 0)
+        pthread_cond_signal(&pool->timer_wake);
+    pthread_mutex_unlock(&pool->timer_lock);
+}
+
+/**
+ * Run fn(arg) on @param pool
+ * @return a future for the result, NULL if out of memory
+ */
+task_future_t *task_submit(task_pool_t *pool, task_fn fn, void *arg)
+{
+    return task_submit_after(pool, 0, fn, arg);
+}
+
+/**
+ * Run fn(arg) on @param pool once @param delay_ms passed, rounded up to
+ * TASK_TICK_MS
+ * @return a future for the result, NULL if out of memory
+ */
+task_future_t *task_submit_after(task_pool_t *pool, unsigned int delay_ms, task_fn fn, void *arg)
+{
+    task_t *t = task_new(fn, arg, NULL, NULL, true);
+    task_future_t *future;
+
+    if (!t)
+        return NULL;
+    future = t->future;
+    schedule(pool, t, delay_ms);
+    return future;
+}
+
+/**
+ * Run fn(arg) on @param pool after @param delay_ms without a future, then
+ * done(result, ctx) on the same worker when @param done is not NULL
+ * @return false if out of memory
+ */
+bool task_post(task_pool_t *pool, unsigned int delay_ms, task_fn fn, void *arg,
+               task_done_fn done, void *ctx)
+{
+    task_t *t = task_new(fn, arg, done, ctx, false);
+
+    if (!t)
+        return false;
+    schedule(pool, t, delay_ms);
+    return true;
+}
+
+/**
+ * Wait for the task behind @param future and free it
+ * @return the task's result
+ */
+void *task_future_wait(task_future_t *future)
+{
+    void *result;
+
+    pthread_mutex_lock(&future->lock);
+    while (!future->ready)
+        pthread_cond_wait(&future->cond, &future->lock);
+    result = future->result;
+    pthread_mutex_unlock(&future->lock);
+
+    pthread_cond_destroy(&future->cond);
+    pthread_mutex_destroy(&future->lock);
+    free(future);
+    return result;
+}
@@ -0,0 +1,39 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * Fixed size task runtime. Each worker owns a work-stealing deque: tasks
+ * submitted from a worker go to the bottom of its own deque, idle workers
+ * steal from the top of the others'. Tasks submitted from other threads go
+ * through a shared injection queue. Delayed tasks wait in a timer wheel
+ * with a TASK_TICK_MS resolution, driven by one timer thread, instead of
+ * occupying a thread in nanosleep().
+ *
+ * A task's result is collected either with a future, which the caller must
+ * wait on exactly once, or with a completion callback run on the worker.
+ */
+
+#define TASK_DEQUE_SIZE 1024        // Per worker, power of two
+#define TASK_WHEEL_SLOTS 512        // Power of two
+#define TASK_TICK_MS 1
+
+typedef void *(*task_fn)(void *arg);
+typedef void (*task_done_fn)(void *result, void *ctx);
+
+typedef struct task_pool task_pool_t;
+typedef struct task_future task_future_t;
+
+task_pool_t *task_pool_create(int workers);
+void task_pool_destroy(task_pool_t *pool);
+
+task_future_t *task_submit(task_pool_t *pool, task_fn fn, void *arg);
+task_future_t *task_submit_after(task_pool_t *pool, unsigned int delay_ms, task_fn fn, void *arg);
+bool task_post(task_pool_t *pool, unsigned int delay_ms, task_fn fn, void *arg,
+               task_done_fn done, void *ctx);
+
+void *task_future_wait(task_future_t *future);
+
+#endif
@@ -17,6 +17,22 @@ static void sleep_ms(int ms)
     nanosleep(&ts, NULL);
 }
 
+/**
+ * Obtain, hold and release part of threadfunc(). start_task_obtaining_mutex()
+ * runs it directly once the timer wheel waited sleep_ms.
+ */
+static void *hold_mutex(void *thread_param)
+{
+    struct thread_data *t = (struct thread_data *)thread_param;
+
+    pthread_mutex_lock(t->mutex);
+    sleep_ms(t->lock_hold_ms);
+    pthread_mutex_unlock(t->mutex);
+    t->thread_complete_success = true;
+
+    return thread_param;
+}
+
 void* threadfunc(void* thread_param)
 {
 
@@ -27,12 +43,7 @@ void* threadfunc(void* thread_param)
     t->thread_complete_success = false;
 
     sleep_ms(t->sleep_ms);
-    pthread_mutex_lock(t->mutex);
-    sleep_ms(t->lock_hold_ms);
-    pthread_mutex_unlock(t->mutex);
-    t->thread_complete_success = true;
-
-    return thread_param;
+    return hold_mutex(thread_param);
 }
 
 
@@ -48,15 +59,43 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
      */
     struct thread_data *t = (struct thread_data *)malloc(sizeof(struct thread_data));
 
+    if (!t)
+    {
+        return false;
+    }
     t->mutex = mutex;
     t->sleep_ms = wait_to_obtain_ms;
     t->lock_hold_ms = wait_to_release_ms;
 
     if (pthread_create(thread, NULL, threadfunc, t) != 0)
     {
+        free(t);
         return false;
     }
 
     return true;
 }
 
+task_future_t *start_task_obtaining_mutex(task_pool_t *pool, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    struct thread_data *t = (struct thread_data *)malloc(sizeof(struct thread_data));
+    task_future_t *future;
+
+    if (!t)
+    {
+        return NULL;
+    }
+    t->mutex = mutex;
+    t->sleep_ms = wait_to_obtain_ms;
+    t->lock_hold_ms = wait_to_release_ms;
+    t->thread_complete_success = false;
+
+    // The wait is a timer wheel entry, a worker is only taken for the hold
+    future = task_submit_after(pool, wait_to_obtain_ms > 0 ? wait_to_obtain_ms : 0, hold_mutex, t);
+    if (!future)
+    {
+        free(t);
+    }
+    return future;
+}
+
@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <pthread.h>
+#include "task_pool.h"
 
 /**
  * This structure should be dynamically allocated and passed as
@@ -41,3 +42,12 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Pooled variant of start_thread_obtaining_mutex() for callers which start many of these: instead of a
+* thread per call, the wait is an entry in the timer wheel of @param pool and the hold runs on one of
+* its workers. start_thread_obtaining_mutex() keeps its own thread since callers join it.
+* @return a future whose result, from task_future_wait(), is the thread_data structure to check and
+* free, or NULL if the task could not be submitted.
+*/
+task_future_t *start_task_obtaining_mutex(task_pool_t *pool, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms);
@@ -53,10 +53,12 @@ fi
 # make clean
 # make
 
+# One writer process for all the files, fed a NUL separated manifest so
+# WRITESTR passes through intact whatever it contains
 for i in $( seq 1 $NUMFILES)
 do
-	/usr/bin/writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\0%s\0' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | /usr/bin/writer -b -0
 
 OUTPUTSTRING=$(/usr/bin/finder.sh "$WRITEDIR" "$WRITESTR")
 
@@ -0,0 +1,397 @@
+/**
+ * @file finder.c
+ * @brief Native replacement for finder.sh
+ *
+ * Usage: finder <filesdir> <searchstr>
+ *
+ * Prints the same line as finder.sh:
+ *   The number of files are <n> and the number of matching lines are <m>
+ *
+ * <n> counts what finder.sh's find over the $FILESDIR glob lists, every entry
+ * below filesdir except top level dot entries and their contents. <m> counts the lines of regular
+ * files anywhere below filesdir containing searchstr, taken as a fixed string.
+ * finder.sh counted `grep -o` output, which is one line per occurrence.
+ * An empty searchstr is rejected, it has no defined match count.
+ *
+ * Directories are crawled by one thread per online CPU sharing a stack of
+ * directories still to read. Files are searched with Boyer-Moore-Horspool,
+ * or memchr() on the first byte for short patterns; large files are mapped
+ * rather than copied.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define BMH_MIN_PATTERN 4           // Shorter patterns use memchr() + memcmp()
+#define READ_BUFFER_SIZE (64 * 1024) // Smaller files are read(), larger mmap()ed
+
+struct matcher
+{
+    const unsigned char *pattern;
+    size_t len;
+    size_t shift[UCHAR_MAX + 1];
+};
+
+struct dir_item
+{
+    struct dir_item *next;
+    bool counted;                   // Entries below it are listed by find $FILESDIR/*
+    char path[];                    // Relative to the root directory
+};
+
+struct crawl
+{
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    struct dir_item *stack;
+    long pending;                   // Directories queued or being read
+    int root_fd;
+    const struct matcher *matcher;
+};
+
+struct crawler
+{
+    pthread_t tid;
+    struct crawl *crawl;
+    unsigned long files;
+    unsigned long lines;
+    char *buf;                      // READ_BUFFER_SIZE bytes
+};
+
+static void matcher_init(struct matcher *m, const char *pattern)
+{
+    size_t i;
+
+    m->pattern = (const unsigned char *)pattern;
+    m->len = strlen(pattern);
+    for (i = 0; i <= UCHAR_MAX; i++)
+        m->shift[i] = m->len;
+    for (i = 0; i + 1 < m->len; i++)
+        m->shift[m->pattern[i]] = m->len - 1 - i;
+}
+
+static const unsigned char *matcher_find(const struct matcher *m, const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *last;
+    size_t n = m->len;
+
+    if ((size_t)(end - p) < n)
+        return NULL;
+
+    if (n < BMH_MIN_PATTERN)
+    {
+        // glibc's memchr() is vectorised, skipping to candidates beats BMH's short shifts
+        while ((p = memchr(p, m->pattern[0], end - p - n + 1)) != NULL)
+        {
+            if (memcmp(p + 1, m->pattern + 1, n - 1) == 0)
+                return p;
+            p++;
+        }
+        return NULL;
+    }
+
+    last = end - n;
+    while (p <= last)
+    {
+        unsigned char c = p[n - 1];
+        if (c == m->pattern[n - 1] && memcmp(p, m->pattern, n - 1) == 0)
+            return p;
+        p += m->shift[c];
+    }
+    return NULL;
+}
+
+static unsigned long count_lines(const struct matcher *m, const char *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    unsigned long lines = 0;
+
+    while ((p = matcher_find(m, p, end)) != NULL)
+    {
+        lines++;
+        p = memchr(p + m->len, '\n', end - p - m->len);
+        if (!p)
+            break;
+        p++;
+    }
+    return lines;
+}
+
+static void search_file(struct crawler *c, int dir_fd, const char *name)
+{
+    struct stat st;
+    ssize_t n;
+    size_t len = 0;
+    void *map;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "finder: %s: %s\n", name, strerror(errno));
+        return;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+
+    if (st.st_size > READ_BUFFER_SIZE)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+        {
+            fprintf(stderr, "finder: %s: %s\n", name, strerror(errno));
+            return;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        c->lines += count_lines(c->crawl->matcher, map, st.st_size);
+        munmap(map, st.st_size);
+        return;
+    }
+
+    // Small files: a copy is cheaper than setting up and tearing down a mapping
+    while (len < READ_BUFFER_SIZE && (n = read(fd, c->buf + len, READ_BUFFER_SIZE - len)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "finder: %s: %s\n", name, strerror(errno));
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    c->lines += count_lines(c->crawl->matcher, c->buf, len);
+}
+
+static struct dir_item *dir_item_new(const char *parent, const char *name, bool counted)
+{
+    size_t plen = strlen(parent);
+    size_t nlen = strlen(name);
+    struct dir_item *item = malloc(sizeof(*item) + plen + nlen + 2);
+
+    if (!item)
+        return NULL;
+    item->counted = counted;
+    memcpy(item->path, parent, plen);
+    item->path[plen] = '/';
+    memcpy(item->path + plen + 1, name, nlen + 1);
+    return item;
+}
+
+/**
+ * Lists one directory. Files are searched on the spot, subdirectories are
+ * collected and pushed onto the shared stack with a single lock round trip.
+ */
+static void read_dir(struct crawler *c, struct dir_item *item)
+{
+    struct crawl *crawl = c->crawl;
+    struct dir_item *found = NULL;
+    struct dir_item *tail = NULL;
+    struct dir_item *sub;
+    struct dirent *de;
+    struct stat st;
+    bool top = strcmp(item->path, ".") == 0;
+    bool counted;
+    long nfound = 0;
+    unsigned char type;
+    DIR *dir;
+    int fd;
+
+    fd = openat(crawl->root_fd, item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || (dir = fdopendir(fd)) == NULL)
+    {
+        fprintf(stderr, "finder: %s: %s\n", item->path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (de->d_name[0] == '.' &&
+            (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+            continue;
+
+        // The shell glob in find $FILESDIR/* skips dot entries at the top only
+        counted = top ? de->d_name[0] != '.' : item->counted;
+        if (counted)
+            c->files++;
+
+        type = de->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_REG)
+        {
+            search_file(c, fd, de->d_name);
+        }
+        else if (type == DT_DIR)
+        {
+            sub = dir_item_new(item->path, de->d_name, counted);
+            if (!sub)
+            {
+                fprintf(stderr, "finder: out of memory\n");
+                exit(1);
+            }
+            sub->next = found;
+            found = sub;
+            if (!tail)
+                tail = sub;
+            nfound++;
+        }
+    }
+    closedir(dir);
+
+    if (found)
+    {
+        pthread_mutex_lock(&crawl->lock);
+        tail->next = crawl->stack;
+        crawl->stack = found;
+        crawl->pending += nfound;
+        if (nfound > 1)
+            pthread_cond_broadcast(&crawl->more);
+        else
+            pthread_cond_signal(&crawl->more);
+        pthread_mutex_unlock(&crawl->lock);
+    }
+}
+
+static void *crawler_thread(void *arg)
+{
+    struct crawler *c = arg;
+    struct crawl *crawl = c->crawl;
+    struct dir_item *item;
+
+    pthread_mutex_lock(&crawl->lock);
+    for (;;)
+    {
+        while (!crawl->stack && crawl->pending > 0)
+            pthread_cond_wait(&crawl->more, &crawl->lock);
+        if (!crawl->stack)
+            break;
+        item = crawl->stack;
+        crawl->stack = item->next;
+        pthread_mutex_unlock(&crawl->lock);
+
+        read_dir(c, item);
+        free(item);
+
+        pthread_mutex_lock(&crawl->lock);
+        if (--crawl->pending == 0)
+            pthread_cond_broadcast(&crawl->more);
+    }
+    pthread_mutex_unlock(&crawl->lock);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct crawler crawlers[MAX_THREADS];
+    struct crawl crawl;
+    struct matcher matcher;
+    struct dir_item *root;
+    unsigned long files = 0;
+    unsigned long lines = 0;
+    long nthreads;
+    int started = 0;
+    int i;
+
+    if (argc < 3)
+    {
+        printf("Error - insufficient parameters passed in. Num parameters passed in: %d\n", argc - 1);
+        return 1;
+    }
+
+    memset(&crawl, 0, sizeof(crawl));
+    crawl.root_fd = open(argv[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (crawl.root_fd < 0)
+    {
+        printf("Error - file directory does not exist\n");
+        return 1;
+    }
+
+    // The matcher needs at least one byte to look for
+    if (argv[2][0] == '\0')
+    {
+        printf("Error - search string is empty\n");
+        return 1;
+    }
+
+    matcher_init(&matcher, argv[2]);
+    crawl.matcher = &matcher;
+    pthread_mutex_init(&crawl.lock, NULL);
+    pthread_cond_init(&crawl.more, NULL);
+
+    root = malloc(sizeof(*root) + 2);
+    if (!root)
+        return 1;
+    root->next = NULL;
+    root->counted = false;
+    strcpy(root->path, ".");
+    crawl.stack = root;
+    crawl.pending = 1;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+
+    for (i = 0; i < nthreads; i++)
+    {
+        memset(&crawlers[i], 0, sizeof(crawlers[i]));
+        crawlers[i].crawl = &crawl;
+        crawlers[i].buf = malloc(READ_BUFFER_SIZE);
+        if (!crawlers[i].buf)
+            break;
+        if (i > 0 && pthread_create(&crawlers[i].tid, NULL, crawler_thread, &crawlers[i]) != 0)
+        {
+            free(crawlers[i].buf);
+            break;
+        }
+        started++;
+    }
+    if (started == 0)
+    {
+        fprintf(stderr, "finder: out of memory\n");
+        return 1;
+    }
+
+    // The main thread is crawler 0
+    crawler_thread(&crawlers[0]);
+    for (i = 0; i < started; i++)
+    {
+        if (i > 0)
+            pthread_join(crawlers[i].tid, NULL);
+        files += crawlers[i].files;
+        lines += crawlers[i].lines;
+        free(crawlers[i].buf);
+    }
+
+    close(crawl.root_fd);
+    printf("The number of files are %lu and the number of matching lines are %lu\n", files, lines);
+    return 0;
+}
@@ -13,6 +13,11 @@ if [ ! -d "$FILESDIR" ]; then
     exit 1
 fi
 
+# Use the native finder installed alongside this script when there is one
+if [ -x "$(dirname "$0")/finder" ]; then
+    exec "$(dirname "$0")/finder" "$FILESDIR" "$SEARCHSTR"
+fi
+
 num_files=$(find $FILESDIR/* | wc -l)
 num_files_matching_str=$(find $FILESDIR -type f -exec grep -o $SEARCHSTR {} + | wc -l)
 
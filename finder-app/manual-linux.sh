@@ -115,6 +115,7 @@ mkdir -p ${OUTDIR}/rootfs/home/conf
 cp conf/assignment.txt ${OUTDIR}/rootfs/home/conf
 cp conf/username.txt ${OUTDIR}/rootfs/home/conf
 cp writer ${OUTDIR}/rootfs/home
+cp finder ${OUTDIR}/rootfs/home
 cp finder.sh ${OUTDIR}/rootfs/home
 cp finder-test.sh ${OUTDIR}/rootfs/home
 cp autorun-qemu.sh ${OUTDIR}/rootfs/home
@@ -1,30 +1,628 @@
+/**
+ * @file writer.c
+ * @brief Writes strings to files
+ *
+ * Usage:
+ *   writer <file> <string>
+ *   writer -b [-m manifest] [-d dir] [-0] [-s count] [-u]
+ *
+ * The first form writes one string to one file. The second creates files in
+ * bulk from a manifest, or stdin, of records of the form
+ *   <path> TAB <content> NEWLINE
+ * or with -0
+ *   <path> NUL <content> NUL
+ * so content may contain any byte. As in the first form the content is
+ * written as is, without a trailing newline, and directories are not created.
+ *
+ *   -d dir    relative paths are relative to dir instead of the working directory
+ *   -s count  make files durable: fdatasync() them in groups of count, then
+ *             fsync() their directory once per group
+ *   -u        submit writes, syncs and closes through io_uring when available
+ *
+ * Files are opened with openat() against a cached descriptor for their
+ * directory, so consecutive records in the same directory do not look the
+ * path up again.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 // Logging example: syslog(LOG_DEBUG, "Testing %d", 1000);
 
-int main(int argc, char **argv)
+#define FILE_MODE 0666          // As fopen(), before the umask
+#define MAX_BATCH 64            // Files written per io_uring submission or fsync group
+#define RING_ENTRIES (MAX_BATCH * 4)
+
+struct record
 {
-    FILE *ptr = NULL;
-    char *filename = argv[1];
-    char *writestr = argv[2];
+    char *line;                 // Owns name and data
+    char *extra;                // Second buffer of a -0 record, or NULL
+    const char *name;           // As given in the manifest
+    const char *base;           // Last component, relative to the batch's dir_fd
+    const char *data;
+    size_t len;
+    int fd;
+};
 
-    openlog(NULL, 0, LOG_USER);
+struct dir_cache
+{
+    int base_fd;                // -d dir, or the working directory
+    char *path;                 // Directory part of the last record's path
+    int fd;
+};
+
+struct ring;
+
+struct batch
+{
+    struct record recs[MAX_BATCH];
+    size_t count;
+    size_t limit;               // Records per flush
+    int dir_fd;                 // Directory of every record in the batch
+    bool sync;
+    struct ring *ring;          // NULL for plain pwrite()
+    int failed;
+};
 
-    if (argc < 3)
+static int write_all(int fd, const char *data, size_t len)
+{
+    off_t off = 0;
+    ssize_t n;
+
+    while ((size_t)off < len)
     {
-        syslog(LOG_ERR, "Error - insufficient parameters passed in. Num parameters passed in: %d", argc);
+        n = pwrite(fd, data + off, len - off, off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static void record_failed(struct batch *b, struct record *r, const char *what, int err)
+{
+    syslog(LOG_ERR, "Could not %s file %s: %s", what, r->name, strerror(err));
+    b->failed++;
+}
+
+static void record_free(struct record *r)
+{
+    free(r->line);
+    free(r->extra);
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Minimal io_uring over the raw system calls, liburing is not part of the
+ * target's toolchain. Only what the batch needs: fill sqes, submit them all,
+ * reap as many cqes.
+ */
+struct ring
+{
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqe_map_len;
+    unsigned int tail;          // Published to *sq_tail on submission
+    unsigned int queued;        // Sqes whose cqe has not been reaped
+};
+
+enum ring_op { RING_WRITE, RING_FSYNC, RING_CLOSE };
+
+static struct ring *ring_open(void)
+{
+    struct io_uring_params p;
+    struct ring *r = calloc(1, sizeof(*r));
+
+    if (!r)
+        return NULL;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd < 0)
+    {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_map_len > r->sq_map_len)
+            r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_map = r->sq_map;
+    else
+    {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED)
+            goto fail_sq;
+    }
+    r->sqe_map_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqe_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    r->sq_head = (unsigned int *)((char *)r->sq_map + p.sq_off.head);
+    r->sq_tail = (unsigned int *)((char *)r->sq_map + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)((char *)r->sq_map + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)((char *)r->sq_map + p.sq_off.array);
+    r->cq_head = (unsigned int *)((char *)r->cq_map + p.cq_off.head);
+    r->cq_tail = (unsigned int *)((char *)r->cq_map + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)((char *)r->cq_map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+    r->tail = *r->sq_tail;
+    return r;
+
+fail_cq:
+    if (r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_len);
+fail_sq:
+    munmap(r->sq_map, r->sq_map_len);
+fail:
+    close(r->fd);
+    free(r);
+    return NULL;
+}
+
+static void ring_close(struct ring *r)
+{
+    munmap(r->sqes, r->sqe_map_len);
+    if (r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_len);
+    munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+    free(r);
+}
+
+static struct io_uring_sqe *ring_sqe(struct ring *r, enum ring_op op, struct record *rec, bool link)
+{
+    unsigned int index = r->tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = rec->fd;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    // Records are at least 8 byte aligned, the low bits carry the op
+    sqe->user_data = (uint64_t)(uintptr_t)rec | op;
+    r->sq_array[index] = index;
+    r->tail++;
+    r->queued++;
+    return sqe;
+}
+
+/**
+ * Queues write, optionally fdatasync, then close for one record, linked so
+ * each runs only once the previous one succeeded.
+ */
+static void ring_queue(struct ring *r, struct record *rec, bool sync)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_sqe(r, RING_WRITE, rec, true);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->addr = (uint64_t)(uintptr_t)rec->data;
+    sqe->len = rec->len;
+    sqe->off = 0;
+
+    if (sync)
+    {
+        sqe = ring_sqe(r, RING_FSYNC, rec, true);
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+
+    sqe = ring_sqe(r, RING_CLOSE, rec, false);
+    sqe->opcode = IORING_OP_CLOSE;
+}
+
+static void ring_run(struct ring *r, struct batch *b)
+{
+    static const char *what[] = { "write", "sync", "close" };
+    struct io_uring_cqe *cqe;
+    struct record *rec;
+    unsigned int head;
+    enum ring_op op;
+    unsigned int to_submit;
+    int ret;
+
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    while (r->queued > 0)
+    {
+        to_submit = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        ret = syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR)
+        {
+            syslog(LOG_ERR, "io_uring_enter: %s", strerror(errno));
+            exit(1);
+        }
+
+        head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &r->cqes[head & *r->cq_mask];
+            rec = (struct record *)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+            op = cqe->user_data & 3;
+
+            if (op == RING_WRITE && cqe->res >= 0 && (size_t)cqe->res != rec->len)
+                record_failed(b, rec, "write", EIO);
+            else if (cqe->res == -ECANCELED && op == RING_CLOSE)
+                close(rec->fd);     // An earlier link failed and was reported
+            else if (cqe->res < 0 && cqe->res != -ECANCELED)
+                record_failed(b, rec, what[op], -cqe->res);
+
+            head++;
+            r->queued--;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+#else
+static struct ring *ring_open(void)
+{
+    return NULL;
+}
+
+static void ring_close(struct ring *r)
+{
+    (void)r;
+}
+#endif
+
+/**
+ * Completes every record in the batch: waits for the ring, or syncs and
+ * closes the files written with pwrite(), then fsyncs the directory once so
+ * the new entries are durable too.
+ */
+static void batch_flush(struct batch *b)
+{
+    struct record *rec;
+    size_t i;
+
+    if (b->count == 0)
+        return;
+
+#ifdef HAVE_IO_URING
+    if (b->ring)
+        ring_run(b->ring, b);
+#endif
+
+    for (i = 0; i < b->count; i++)
+    {
+        rec = &b->recs[i];
+        if (!b->ring)
+        {
+            if (b->sync && fdatasync(rec->fd) != 0)
+                record_failed(b, rec, "sync", errno);
+            if (close(rec->fd) != 0)
+                record_failed(b, rec, "close", errno);
+        }
+        record_free(rec);
+    }
+    if (b->sync && fsync(b->dir_fd) != 0)
+    {
+        syslog(LOG_ERR, "Could not sync directory: %s", strerror(errno));
+        b->failed++;
+    }
+    b->count = 0;
+}
+
+/**
+ * Returns a descriptor for the directory of rec->name and points rec->base
+ * at the last component. The last directory stays open for the next record.
+ */
+static int dir_lookup(struct dir_cache *cache, struct batch *b, struct record *rec)
+{
+    const char *slash = strrchr(rec->name, '/');
+    size_t dir_len = 0;
+    char *dir;
+    int fd;
+
+    if (slash)
+        dir_len = (slash == rec->name) ? 1 : (size_t)(slash - rec->name);
+    rec->base = slash ? slash + 1 : rec->name;
+
+    if (cache->path && strlen(cache->path) == dir_len && memcmp(cache->path, rec->name, dir_len) == 0)
+        return cache->fd;
+
+    // A batch only ever covers one directory
+    batch_flush(b);
+
+    dir = strndup(rec->name, dir_len);
+    if (!dir)
+        return -1;
+    fd = dir_len ? openat(cache->base_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : cache->base_fd;
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Could not open directory %s: %s", dir, strerror(errno));
+        free(dir);
+        return -1;
+    }
+    if (cache->fd >= 0 && cache->fd != cache->base_fd)
+        close(cache->fd);
+    free(cache->path);
+    cache->path = dir;
+    cache->fd = fd;
+    return fd;
+}
+
+static void batch_add(struct batch *b, struct dir_cache *cache, struct record *rec)
+{
+    int dir_fd = dir_lookup(cache, b, rec);
+
+    if (dir_fd < 0)
+    {
+        b->failed++;
+        record_free(rec);
+        return;
+    }
+
+    rec->fd = openat(dir_fd, rec->base, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, FILE_MODE);
+    if (rec->fd < 0)
+    {
+        record_failed(b, rec, "create", errno);
+        record_free(rec);
+        return;
+    }
+
+    b->dir_fd = dir_fd;
+    b->recs[b->count] = *rec;
+    rec = &b->recs[b->count++];
+
+#ifdef HAVE_IO_URING
+    if (b->ring)
+        ring_queue(b->ring, rec, b->sync);
+#endif
+    if (!b->ring)
+    {
+        if (write_all(rec->fd, rec->data, rec->len) != 0)
+            record_failed(b, rec, "write", errno);
+        // Start writeback now so the group's fdatasync() mostly waits on I/O already in flight
+        else if (b->sync)
+            sync_file_range(rec->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        if (!b->sync)
+        {
+            if (close(rec->fd) != 0)
+                record_failed(b, rec, "close", errno);
+            record_free(rec);
+            b->count--;
+            return;
+        }
+    }
+
+    if (b->count >= b->limit)
+        batch_flush(b);
+}
+
+static int write_batch(FILE *in, const char *dir, char delim, long sync_count, bool use_ring)
+{
+    struct dir_cache cache = { -1, NULL, -1 };
+    struct batch *b = calloc(1, sizeof(*b));
+    struct record rec;
+    char *line = NULL;
+    size_t cap = 0;
+    unsigned long records = 0;
+    ssize_t n;
+    char *sep;
+    int failed;
+
+    if (!b)
+        return 1;
+    b->sync = sync_count > 0;
+    b->limit = (b->sync && sync_count < MAX_BATCH) ? (size_t)sync_count : MAX_BATCH;
+
+    // A real descriptor rather than AT_FDCWD, the directory may need an fsync()
+    cache.base_fd = open(dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache.base_fd < 0)
+    {
+        syslog(LOG_ERR, "Could not open directory %s: %s", dir ? dir : ".", strerror(errno));
+        free(b);
         return 1;
     }
+    if (use_ring)
+    {
+        b->ring = ring_open();
+        if (!b->ring)
+            syslog(LOG_WARNING, "io_uring unavailable, writing with pwrite()");
+    }
 
-    if ((ptr = fopen(filename, "w")) == NULL)
+    while ((n = getdelim(&line, &cap, delim, in)) > 0)
+    {
+        if (line[n - 1] == delim)
+            line[--n] = '\0';
+        // Blank lines, e.g. a trailing newline, carry no record
+        if (n == 0 && delim != '\0')
+            continue;
+        memset(&rec, 0, sizeof(rec));
+
+        if (delim == '\0')
+        {
+            // Path and content are separate NUL terminated fields
+            rec.extra = line;
+            rec.name = line;
+            line = NULL;
+            cap = 0;
+            n = getdelim(&line, &cap, '\0', in);
+            if (n < 0)
+            {
+                syslog(LOG_ERR, "Missing content for %s", rec.name);
+                free(rec.extra);
+                b->failed++;
+                break;
+            }
+            if (n > 0 && line[n - 1] == '\0')
+                n--;
+            rec.data = line;
+            rec.len = n;
+        }
+        else
+        {
+            sep = memchr(line, '\t', n);
+            if (!sep)
+            {
+                syslog(LOG_ERR, "Malformed record %s", line);
+                b->failed++;
+                continue;
+            }
+            *sep = '\0';
+            rec.name = line;
+            rec.data = sep + 1;
+            rec.len = line + n - rec.data;
+        }
+        rec.line = line;
+        line = NULL;
+        cap = 0;
+        batch_add(b, &cache, &rec);
+        records++;
+    }
+    batch_flush(b);
+    free(line);
+
+    syslog(LOG_DEBUG, "Wrote %lu files, %d failed", records, b->failed);
+    if (b->ring)
+        ring_close(b->ring);
+    if (cache.fd >= 0 && cache.fd != cache.base_fd)
+        close(cache.fd);
+    close(cache.base_fd);
+    free(cache.path);
+    failed = b->failed;
+    free(b);
+    return failed ? 1 : 0;
+}
+
+static int write_one(const char *filename, const char *writestr)
+{
+    int fd;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, FILE_MODE);
+    if (fd < 0)
     {
         syslog(LOG_ERR, "Could not create file %s", filename);
         return 1;
     }
 
     syslog(LOG_DEBUG, "Writing %s to %s", writestr, filename);
-    fprintf(ptr, "%s", writestr);
-
+    if (write_all(fd, writestr, strlen(writestr)) != 0)
+    {
+        syslog(LOG_ERR, "Could not write file %s: %s", filename, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    if (close(fd) != 0)
+    {
+        syslog(LOG_ERR, "Could not close file %s: %s", filename, strerror(errno));
+        return 1;
+    }
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    const char *manifest = NULL;
+    const char *dir = NULL;
+    bool batch = false;
+    bool use_ring = false;
+    char delim = '\n';
+    long sync_count = 0;
+    FILE *in = stdin;
+    int opt;
+    int ret;
+
+    openlog(NULL, 0, LOG_USER);
+
+    // Options only lead a batch invocation. The two argument form is
+    // taken as given, content like "-b" or "-foo" included. "+" stops
+    // GNU getopt from permuting a file or string that follows them. With
+    // exactly two arguments a file name like "-x" is also possible, they
+    // are only options if they make up a whole batch invocation.
+    opterr = (argc != 3);
+    while (argc > 1 && argv[1][0] == '-' && (opt = getopt(argc, argv, "+bm:d:0s:u")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                batch = true;
+                break;
+            case 'm':
+                batch = true;
+                manifest = optarg;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case '0':
+                delim = '\0';
+                break;
+            case 's':
+                sync_count = strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                use_ring = true;
+                break;
+            default:
+                if (argc == 3)
+                    return write_one(argv[1], argv[2]);
+                syslog(LOG_ERR, "Usage: %s <file> <string> | -b [-m manifest] [-d dir] [-0] [-s count] [-u]", argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc == 3 && (!batch || optind != argc))
+        return write_one(argv[1], argv[2]);
+    if (!batch)
+    {
+        if (argc - optind < 2)
+        {
+            syslog(LOG_ERR, "Error - insufficient parameters passed in. Num parameters passed in: %d", argc);
+            return 1;
+        }
+        return write_one(argv[optind], argv[optind + 1]);
+    }
+
+    if (manifest && (in = fopen(manifest, "r")) == NULL)
+    {
+        syslog(LOG_ERR, "Could not open manifest %s: %s", manifest, strerror(errno));
+        return 1;
+    }
+    ret = write_batch(in, dir, delim, sync_count, use_ring);
+    if (in != stdin)
+        fclose(in);
+    return ret;
+}
@@ -0,0 +1,269 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "aesdlog.h"
+
+#define AESDLOG_DRAIN_IDLE_MS 100
+
+typedef struct {
+    int level;
+    char msg[AESDLOG_MSG_SIZE];
+} aesdlog_record_t;
+
+typedef struct {
+    _Alignas(64) atomic_size_t head;    // Written by the owning thread
+    _Alignas(64) atomic_size_t tail;    // Written by the drain thread
+    _Alignas(64) atomic_bool owned;
+    atomic_size_t dropped;
+    aesdlog_record_t records[AESDLOG_RING_RECORDS];
+} aesdlog_ring_t;
+
+atomic_int aesdlog_level = AESDLOG_DEFAULT_LEVEL;
+static atomic_size_t payload_max = AESDLOG_DEFAULT_PAYLOAD_MAX;
+
+// Rings are never freed while running, a ring released by an exiting
+// thread is handed to the next thread which logs
+static aesdlog_ring_t *rings[AESDLOG_MAX_RINGS];
+static atomic_int nrings = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread aesdlog_ring_t *tls_ring = NULL;
+
+static pthread_t drain_tid;
+static atomic_bool running = false;
+static atomic_bool drain_idle = false;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+
+static void aesdlog_release_ring(void *ring)
+{
+    // Undrained records stay in the ring and are still drained in order
+    atomic_store_explicit(&((aesdlog_ring_t *)ring)->owned, false, memory_order_release);
+}
+
+static aesdlog_ring_t *aesdlog_claim_ring(void)
+{
+    aesdlog_ring_t *ring = NULL;
+    bool expected;
+    int n = atomic_load_explicit(&nrings, memory_order_acquire);
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        expected = false;
+        if (atomic_compare_exchange_strong(&rings[i]->owned, &expected, true))
+        {
+            ring = rings[i];
+            goto claimed;
+        }
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    n = atomic_load_explicit(&nrings, memory_order_relaxed);
+    if (n < AESDLOG_MAX_RINGS && (ring = calloc(1, sizeof(aesdlog_ring_t))) != NULL)
+    {
+        atomic_init(&ring->owned, true);
+        rings[n] = ring;
+        atomic_store_explicit(&nrings, n + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (!ring) return NULL;
+
+claimed:
+    pthread_setspecific(ring_key, ring);
+    tls_ring = ring;
+    return ring;
+}
+
+static bool aesdlog_drain_ring(aesdlog_ring_t *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t dropped;
+    aesdlog_record_t *rec;
+
+    if (tail == head && atomic_load_explicit(&ring->dropped, memory_order_relaxed) == 0)
+        return false;
+
+    for (; tail != head; tail++)
+    {
+        rec = &ring->records[tail & (AESDLOG_RING_RECORDS - 1)];
+        syslog(rec->level, "%s", rec->msg);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped)
+    {
+        syslog(LOG_WARNING, "%zu log messages dropped, log ring full", dropped);
+    }
+
+    return true;
+}
+
+static bool aesdlog_drain_all(void)
+{
+    int n = atomic_load_explicit(&nrings, memory_order_acquire);
+    bool work = false;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        work |= aesdlog_drain_ring(rings[i]);
+    }
+    return work;
+}
+
+static void *aesdlog_drain_thread(void *arg)
+{
+    struct timespec ts;
+    sigset_t set;
+
+    (void)arg;
+
+    // Leave signal handling to the main thread
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (atomic_load(&running))
+    {
+        if (aesdlog_drain_all())
+            continue;
+
+        // Nothing to do, sleep until a producer wakes us or the timeout
+        // catches messages logged while we were deciding to sleep
+        pthread_mutex_lock(&drain_lock);
+        atomic_store(&drain_idle, true);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += AESDLOG_DRAIN_IDLE_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (atomic_load(&running))
+            pthread_cond_timedwait(&drain_cond, &drain_lock, &ts);
+        atomic_store(&drain_idle, false);
+        pthread_mutex_unlock(&drain_lock);
+    }
+
+    aesdlog_drain_all();
+    return NULL;
+}
+
+static void aesdlog_wake(void)
+{
+    if (atomic_load_explicit(&drain_idle, memory_order_relaxed))
+    {
+        pthread_mutex_lock(&drain_lock);
+        pthread_cond_signal(&drain_cond);
+        pthread_mutex_unlock(&drain_lock);
+    }
+}
+
+/*
+ * Starts the drain thread. Must be called after any fork(), until then
+ * (and after aesdlog_shutdown()) messages go straight to syslog().
+ */
+int aesdlog_init(void)
+{
+    if (pthread_key_create(&ring_key, aesdlog_release_ring) != 0)
+        return -1;
+
+    atomic_store(&running, true);
+    if (pthread_create(&drain_tid, NULL, aesdlog_drain_thread, NULL) != 0)
+    {
+        atomic_store(&running, false);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stops the drain thread after flushing every ring
+ */
+void aesdlog_shutdown(void)
+{
+    if (!atomic_exchange(&running, false))
+        return;
+
+    pthread_mutex_lock(&drain_lock);
+    pthread_cond_signal(&drain_cond);
+    pthread_mutex_unlock(&drain_lock);
+    pthread_join(drain_tid, NULL);
+}
+
+void aesdlog_set_level(int level)
+{
+    if (level < LOG_EMERG) level = LOG_EMERG;
+    if (level > LOG_DEBUG) level = LOG_DEBUG;
+    atomic_store_explicit(&aesdlog_level, level, memory_order_relaxed);
+}
+
+int aesdlog_get_level(void)
+{
+    return atomic_load_explicit(&aesdlog_level, memory_order_relaxed);
+}
+
+void aesdlog_set_payload_max(size_t max)
+{
+    atomic_store_explicit(&payload_max, max, memory_order_relaxed);
+}
+
+static void aesdlog_vwrite(int level, const char *fmt, va_list ap)
+{
+    aesdlog_ring_t *ring = tls_ring;
+    aesdlog_record_t *rec;
+    size_t head;
+
+    if (!atomic_load_explicit(&running, memory_order_relaxed))
+        goto sync;
+
+    if (!ring && (ring = aesdlog_claim_ring()) == NULL)
+        goto sync;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= AESDLOG_RING_RECORDS)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    rec = &ring->records[head & (AESDLOG_RING_RECORDS - 1)];
+    rec->level = level;
+    vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    aesdlog_wake();
+    return;
+
+sync:
+    vsyslog(level, fmt, ap);
+}
+
+void aesdlog_write(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    aesdlog_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+void aesdlog_payload(int level, const char *what, const char *buf, size_t len)
+{
+    size_t max = atomic_load_explicit(&payload_max, memory_order_relaxed);
+
+    if (len > max)
+        aesdlog_write(level, "%s: %.*s... [%zu bytes]", what, (int)max, buf, len);
+    else
+        aesdlog_write(level, "%s: %.*s", what, (int)len, buf);
+}
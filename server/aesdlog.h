@@ -0,0 +1,50 @@
+#ifndef AESDLOG_H
+#define AESDLOG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <syslog.h>
+
+/*
+ * Asynchronous logging for aesdsocket's hot paths.
+ *
+ * Each thread formats messages into its own lock-free single producer ring,
+ * and a background thread drains all rings into syslog(). Messages above
+ * the current level are filtered by one relaxed atomic load in the macro,
+ * before any argument is evaluated or formatted. If a ring is full the
+ * message is dropped and counted rather than blocking the caller.
+ */
+
+#define AESDLOG_MSG_SIZE 256            // Longer messages are truncated
+#define AESDLOG_RING_RECORDS 128        // Per thread, must be a power of two
+#define AESDLOG_MAX_RINGS 256           // Threads beyond this log synchronously
+#define AESDLOG_DEFAULT_LEVEL LOG_INFO
+#define AESDLOG_DEFAULT_PAYLOAD_MAX 64  // Bytes of client payload logged
+
+extern atomic_int aesdlog_level;
+
+#define AESD_LOG_ENABLED(level) \
+    ((level) <= atomic_load_explicit(&aesdlog_level, memory_order_relaxed))
+
+#define AESD_LOG(level, ...) \
+    do { \
+        if (AESD_LOG_ENABLED(level)) aesdlog_write(level, __VA_ARGS__); \
+    } while (0)
+
+/*
+ * Logs "<what>: <payload>", truncating the payload to the configured maximum
+ */
+#define AESD_LOG_PAYLOAD(level, what, buf, len) \
+    do { \
+        if (AESD_LOG_ENABLED(level)) aesdlog_payload(level, what, buf, len); \
+    } while (0)
+
+int aesdlog_init(void);
+void aesdlog_shutdown(void);
+void aesdlog_set_level(int level);
+int aesdlog_get_level(void);
+void aesdlog_set_payload_max(size_t max);
+void aesdlog_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void aesdlog_payload(int level, const char *what, const char *buf, size_t len);
+
+#endif
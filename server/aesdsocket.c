@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -9,212 +10,1095 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <limits.h>
+#include <linux/errqueue.h>
 
 #include "aesd_ioctl.h"
 #include "aesdsocket.h"
-#include "singly_linked_list.h"
+#include "conn_table.h"
+#include "pool.h"
+#include "aesdlog.h"
+#include "metrics.h"
+#include "trace.h"
+#include "handoff.h"
+#include "proto.h"
+#include "shm.h"
+#include "datafile.h"
 
-#define ARGS "d"
+#define ARGS "db:l:t:m:s:H:w:r:S:u:f:kz:R:A:Y:"
+
+// Zero copy replies need MSG_ZEROCOPY (Linux 4.14), without it large
+// replies are plain sends from the mapping
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define AESD_ZEROCOPY
+#endif
 
 int file_fd = 0;
 int sock_fd = 0;
 int client_fd = 0;
 
-singly_linked_list_t* list = NULL;
+conn_table_t *connections = NULL;
+
+// Threads push themselves here when done so the main thread only visits
+// finished connections instead of scanning all of them on every accept
+_Atomic(thread_data_t *) completed = NULL;
+
+// Connection contexts and I/O buffers, only touched by the accept loop
+pool_t *thread_data_pool = NULL;
+pool_t *buffer_pool = NULL;
+size_t buffer_size = BUFFER_SIZE;
+
+// Outbound queue watermarks (-w), replay window (-r) and how long a client
+// may take no reply data before it is dropped (-S)
+size_t outq_high = OUTQ_HIGH_WATERMARK;
+size_t outq_low = OUTQ_HIGH_WATERMARK / OUTQ_LOW_WATERMARK_DIVISOR;
+size_t replay_limit = 0;
+int send_stall_ms = SEND_STALL_MS;
+pool_t *outq_pool = NULL;
+
+// UNIX socket for local producers (-u), NULL when disabled
+const char *unix_path = NULL;
+int unix_fd = -1;
+
+// Resolved at startup, the file may be replaced before a reload
+char exe_path[PATH_MAX] = "";
+
+// Our end of the handoff channel once reloaded, held open until we exit
+int successor_fd = -1;
+
+// Level restored when SIGUSR2 toggles debug logging off again
+int log_level = AESDLOG_DEFAULT_LEVEL;
+
+// Prometheus endpoint port, "0" disables it
+const char *metrics_port = METRICS_PORT;
 
-void signal_handler(int s)
+// Data file durability (-f), segment size (-z), retention by size (-R) and
+// age (-A), and whether it is kept and recovered across restarts (-k)
+datafile_config_t datafile_config = DATAFILE_CONFIG_DEFAULT;
+bool keep_file = false;
+
+// How replies too large for the outbound queue leave the data file, and
+// the smallest sent with MSG_ZEROCOPY (-Y)
+datafile_send_t reply_send_mode = DATAFILE_SEND_MMAP;
+size_t zerocopy_min = DATAFILE_ZEROCOPY_MIN;
+
+/*
+ * Handle everything queued on the signalfd from the event loop, so nothing
+ * runs in signal context. Returns what the event loop has to do next.
+ */
+signal_action_t handle_signals(int sig_fd)
 {
-    if (s == SIGINT || s == SIGTERM)
+    struct signalfd_siginfo si;
+    signal_action_t action = SIGNAL_NONE;
+
+    while (read(sig_fd, &si, sizeof(si)) == sizeof(si))
     {
-        syslog(LOG_DEBUG, "Caught signal, exiting");
-        close(client_fd);
-        close(sock_fd);
-        close(file_fd);
+        switch (si.ssi_signo)
+        {
+            case SIGINT:
+            case SIGTERM:
+                syslog(LOG_DEBUG, "Caught signal, exiting");
+                action = SIGNAL_STOP;
+                break;
+            case SIGHUP:
+                if (action == SIGNAL_NONE) action = SIGNAL_RELOAD;
+                break;
+            case SIGUSR1:
+                // Logs where the trace went itself
+                trace_dump(TRACE_DUMP_FILE);
+                break;
+            case SIGUSR2:
+                // Toggle debug logging at runtime
+                aesdlog_set_level(aesdlog_get_level() == LOG_DEBUG ? log_level : LOG_DEBUG);
+                break;
+            default:
+                break;
+        }
+    }
+    return action;
+}
+
+/*
+ * Hand the listening socket to a fresh copy of the binary. The metrics
+ * port cannot be shared, so the endpoint is released first and restarted
+ * if the new process does not come up. Returns 0 once it is accepting.
+ */
+int reload(char **argv)
+{
+    pid_t pid;
+    bool metrics = strcmp(metrics_port, "0") != 0;
+
+#ifdef USE_AESD_RING_HISTORY
+    // The history only lives in this process, a new one would start empty
+    syslog(LOG_ERR, "Reload unsupported with the in-process history");
+    return -1;
+#endif
+    if (exe_path[0] == '\0')
+    {
+        syslog(LOG_ERR, "Reload unavailable, executable path unknown");
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Reloading %s", exe_path);
+    if (metrics) metrics_stop();
+
+    if (handoff_start(exe_path, argv, sock_fd, &pid, &successor_fd) != 0)
+    {
+        syslog(LOG_ERR, "Reload failed, still serving");
+        if (metrics && metrics_start(metrics_port) != 0)
+            syslog(LOG_ERR, "Metrics not restarted on port %s, continuing without them", metrics_port);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Process %d is accepting, draining", (int)pid);
+    return 0;
+}
+
+#ifdef USE_AESD_DATA_FILE
+/*
+ * Append a record to the data file. Client packets and timestamps share
+ * datafile_append() so records land whole and in a single order.
+ */
+ssize_t storage_append(const char *buf, size_t len)
+{
+    return datafile_append(buf, len);
+}
+#elif defined(USE_AESD_RING_HISTORY)
+ssize_t storage_append(const char *buf, size_t len)
+{
+    return history_append(buf, len) == 0 ? (ssize_t)len : -1;
+}
+#endif
+
 #ifndef USE_AESD_CHAR_DEVICE
-        remove(FILE);
+/*
+ * Return the timestamp record for @param now, formatting it only when the
+ * cached one is for a different second
+ */
+const timestamp_cache_t *timestamp_format(timestamp_cache_t *cache, time_t now)
+{
+    struct tm tm_info;
+
+    if (cache->len > 0 && cache->sec == now)
+        return cache;
+
+    localtime_r(&now, &tm_info);
+    cache->len = strftime(cache->text, sizeof(cache->text),
+                          "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &tm_info);
+    cache->sec = now;
+    return cache;
+}
+
+/*
+ * Called from the event loop when timer_fd is readable
+ */
+void timestamp_tick(int timer_fd, timestamp_cache_t *cache, int interval)
+{
+    uint64_t expirations;
+    const timestamp_cache_t *ts;
+    time_t now;
+
+    // Several missed intervals still produce one record, as the old timer did
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    now = time(NULL);
+    ts = timestamp_format(cache, now);
+    if (storage_append(ts->text, ts->len) != (ssize_t)ts->len)
+    {
+        syslog(LOG_ERR, "Failed to write timestamp - %s", strerror(errno));
+    }
+
+    // Format the next record now so the next tick only has to append it
+    timestamp_format(cache, now + interval);
+}
+
+int init_timer(int firstRun, int interval)
+{
+    struct itimerspec ts = {0};
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to create timer - %s", strerror(errno));
+        return -1;
+    }
+
+    ts.it_value.tv_sec = firstRun;
+    ts.it_interval.tv_sec = interval;
+
+    if (timerfd_settime(fd, 0, &ts, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to start the timer - %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+#endif
+
+#ifdef USE_AESD_RING_HISTORY
+void aesd_seekto(thread_data_t *d, int str_index, int str_index_offset)
+{
+    if (str_index < 0 || str_index_offset < 0 ||
+        history_seekto(&d->fpos, str_index, str_index_offset) != 0)
+    {
+        AESD_LOG(LOG_ERR, "History seekto %d,%d out of range", str_index, str_index_offset);
+        return;
+    }
+    AESD_LOG(LOG_INFO, "History seekto set");
+}
+#elif defined(USE_AESD_DATA_FILE)
+void aesd_seekto(thread_data_t *d, int str_index, int str_index_offset)
+{
+    off_t pos = -1;
+
+    if (str_index >= 0 && str_index_offset >= 0)
+        pos = datafile_seek(str_index, str_index_offset);
+    if (pos < 0)
+    {
+        AESD_LOG(LOG_ERR, "Data file seekto %d,%d out of range", str_index, str_index_offset);
+        return;
+    }
+    // The reply to the seekto line starts here instead of at the oldest packet
+    d->seek_pos = pos;
+    AESD_LOG(LOG_INFO, "Data file seekto set");
+}
+#else
+void aesd_seekto(thread_data_t *d, int str_index, int str_index_offset)
+{
+    int fd = d->file_fd;
+    struct aesd_seekto seekto;
+
+    seekto.write_cmd = str_index;
+    seekto.write_cmd_offset = str_index_offset;
+
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) != 0)
+    {
+        AESD_LOG(LOG_ERR, "IO seekto ioctl failed - %s", strerror(errno));
+    }
+    AESD_LOG(LOG_INFO, "IO seekto ioctl set");
+}
+#endif
+
+/*
+ * Account for a reply once it has been queued and sent in full
+ */
+void reply_finish(thread_data_t *d)
+{
+    metrics_inc(METRIC_REPLAY_BYTES, d->replayed);
+    metrics_observe_ns(METRIC_REPLY_SECONDS, metrics_now_ns() - d->reply_start_ns);
+    TRACE_END(d, "reply", d->reply_start_ns, d->handle);
+    d->reply_start_ns = 0;
+}
+
+/*
+ * Start replaying history to the client, called for every received newline
+ * once the previous reply has been fully queued
+ */
+int reply_start(thread_data_t *d)
+{
+    uint64_t trace_ns = TRACE_START(d);
+
+    // The tail of the previous reply may still be queued
+    if (d->reply_start_ns != 0)
+        reply_finish(d);
+
+    d->replaying = true;
+    d->reply_start_ns = metrics_now_ns();
+    d->replayed = 0;
+
+#ifdef USE_AESD_DATA_FILE
+    // Bound the reply to what is stored now, writers keep appending
+    // while a slow client drains it
+    off_t start = datafile_start();
+    off_t end = datafile_end();
+
+    d->replay_end = end;
+    d->replay_pos = start;
+    d->replay_skip_partial = false;
+    if (d->seek_pos >= 0)
+    {
+        d->replay_pos = d->seek_pos;
+        d->seek_pos = -1;
+    }
+    else if (replay_limit > 0 && (size_t)(end - start) > replay_limit)
+    {
+        // Only the newest packets: skip through the first newline from the
+        // byte before the window, so a window starting on a packet boundary
+        // keeps that packet. A packet longer than the window is not replayed.
+        d->replay_pos = end - replay_limit - 1;
+        d->replay_skip_partial = true;
+    }
+    TRACE_END(d, "rewind", trace_ns, d->handle);
+#else
+    (void)trace_ns;
+#endif
+    AESD_LOG(LOG_DEBUG, "Packet received - sending it back!");
+    return 0;
+}
+
+/*
+ * Read the next chunk of the reply into @param buf. Returns 0 at the end.
+ */
+ssize_t reply_read(thread_data_t *d, char *buf, size_t len)
+{
+#if defined(USE_AESD_RING_HISTORY)
+    return history_read(&d->fpos, buf, len);
+#elif defined(USE_AESD_DATA_FILE)
+    ssize_t n;
+    char *nl;
+
+    while (true)
+    {
+        if ((off_t)len > d->replay_end - d->replay_pos)
+            len = d->replay_end - d->replay_pos;
+        if (len == 0)
+            return 0;
+        n = datafile_read(&d->replay_pos, buf, len);
+        if (n <= 0)
+            return n;
+        if (!d->replay_skip_partial)
+            return n;
+
+        // Drop the tail of the packet the replay window cut into
+        if ((nl = memchr(buf, '\n', n)) == NULL)
+            continue;
+        d->replay_skip_partial = false;
+        n -= nl + 1 - buf;
+        if (n > 0)
+        {
+            memmove(buf, nl + 1, n);
+            return n;
+        }
+    }
+#else
+    return read(d->file_fd, buf, len);
+#endif
+}
+
+/*
+ * Ask for MSG_ZEROCOPY on the connection, once. Not every socket takes it,
+ * the UNIX socket for one.
+ */
+bool zerocopy_enable(thread_data_t *d)
+{
+#ifdef AESD_ZEROCOPY
+    int one = 1;
+
+    if (!d->zerocopy_armed && !d->zerocopy_failed)
+    {
+        if (setsockopt(d->client_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+            d->zerocopy_armed = true;
+        else
+            d->zerocopy_failed = true;
+    }
+    return d->zerocopy_armed && !d->zerocopy_failed;
+#else
+    (void)d;
+    return false;
+#endif
+}
+
+/*
+ * Drain MSG_ZEROCOPY completions from the socket error queue. Nothing waits
+ * for them, the pages sent belong to segments which never change, but
+ * unread ones use up the socket's option memory and keep poll() reporting
+ * POLLERR. Once the kernel reports it had to copy anyway, as it does over
+ * loopback, the connection goes back to plain sends.
+ */
+void zerocopy_reap(thread_data_t *d)
+{
+#ifdef AESD_ZEROCOPY
+    union {
+        char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    if (!d->zerocopy_armed)
+        return;
+    while (true)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if (recvmsg(d->client_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !d->zerocopy_failed)
+            {
+                AESD_LOG(LOG_DEBUG, "Zero copy sends to %s were copied, using plain sends", d->client_ip);
+                d->zerocopy_failed = true;
+                d->send_flags &= ~MSG_ZEROCOPY;
+            }
+        }
+    }
+#else
+    (void)d;
+#endif
+}
+
+/*
+ * Hand the rest of the reply to reply_send() if it would not fit the
+ * outbound queue anyway. Smaller replies are still queued, so the replies
+ * to a batch of lines leave together. See -Y.
+ */
+bool reply_direct(thread_data_t *d)
+{
+#ifdef USE_AESD_DATA_FILE
+    off_t left = d->replay_end - d->replay_pos;
+
+    if (reply_send_mode == DATAFILE_SEND_READ || d->replay_skip_partial || left <= (off_t)outq_high)
+        return false;
+    d->replay_direct = true;
+    d->send_flags = MSG_NOSIGNAL;
+#ifdef AESD_ZEROCOPY
+    if (reply_send_mode == DATAFILE_SEND_MMAP && zerocopy_min > 0 &&
+        left >= (off_t)zerocopy_min && zerocopy_enable(d))
+        d->send_flags |= MSG_ZEROCOPY;
+#endif
+    return true;
+#else
+    (void)d;
+    return false;
 #endif
-        node_t *ptr = (node_t *)sll_front(list);
-        while (ptr != NULL)
+}
+
+/*
+ * Send the rest of the reply straight from the data file without copying
+ * it through the outbound queue, once everything queued before it is sent
+ */
+int reply_send(thread_data_t *d)
+{
+#ifdef USE_AESD_DATA_FILE
+    int flags = d->send_flags;
+    uint64_t trace_ns;
+    ssize_t n;
+
+    while (d->replay_pos < d->replay_end)
+    {
+        trace_ns = TRACE_START(d);
+        n = datafile_send(d->client_fd, &d->replay_pos, d->replay_end - d->replay_pos,
+                          reply_send_mode, flags);
+        TRACE_END(d, "send", trace_ns, d->handle);
+        if (n < 0)
         {
-            thread_data_t *data = (thread_data_t *)(ptr->value);
-            if (data)
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+#ifdef AESD_ZEROCOPY
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY))
             {
-                pthread_join(data->tid, NULL); // Wait for the thread to finish
-                if (data->client_fd > 0) close(data->client_fd); // Now safe to close
-                if (data->file_fd > 0) close(data->file_fd);
-                free(data);
+                // Too many zero copy sends in flight, copy this one
+                zerocopy_reap(d);
+                flags &= ~MSG_ZEROCOPY;
+                continue;
             }
-            ptr = ptr->next;
+#endif
+            AESD_LOG(LOG_ERR, "[handle_client] send error - %s", strerror(errno));
+            return -1;
         }
+        if (n == 0)
+            break;      // Dropped by retention meanwhile
+        flags = d->send_flags;
+        d->replayed += n;
+        metrics_inc(METRIC_BYTES_OUT, n);
+    }
+#endif
+    d->replay_direct = false;
+    d->replaying = false;
+    return 0;
+}
 
-        sll_destroy_list(list); // Free the linked list itself
-        exit(0);
+/*
+ * Move unsent bytes to the front of the outbound queue so the free space
+ * is contiguous
+ */
+void outq_compact(thread_data_t *d)
+{
+    if (d->outq_head > 0)
+    {
+        memmove(d->outq, d->outq + d->outq_head, d->outq_len);
+        d->outq_head = 0;
     }
 }
 
-#ifndef USE_AESD_CHAR_DEVICE
-void timer_handler(union sigval sv) {
-    (void)sv;  // Unused parameter
+/*
+ * Top up the outbound queue from storage until it reaches the high watermark
+ */
+int outq_fill(thread_data_t *d)
+{
+    ssize_t n;
+    uint64_t trace_ns;
 
-    time_t now;
-    struct tm *tm_info;
-    char timestamp[100];
+    // The queue is at or below the low watermark here
+    outq_compact(d);
+
+    while (d->replaying && d->outq_len < outq_high)
+    {
+        if (reply_direct(d))
+            break;
+        trace_ns = TRACE_START(d);
+        n = reply_read(d, d->outq + d->outq_len, outq_high - d->outq_len);
+        TRACE_END(d, "read", trace_ns, d->handle);
+        if (n < 0)
+        {
+            AESD_LOG(LOG_ERR, "[handle client] read error - %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+        {
+            d->replaying = false;
+            break;
+        }
+        AESD_LOG_PAYLOAD(LOG_DEBUG, "Read from storage", d->outq + d->outq_len, n);
+        d->outq_len += n;
+        d->replayed += n;
+    }
+    return 0;
+}
+
+/*
+ * Send as much of the outbound queue as the socket takes without blocking
+ */
+int outq_flush(thread_data_t *d)
+{
+    ssize_t n;
+    uint64_t trace_ns;
+
+    while (d->outq_len > 0)
+    {
+        trace_ns = TRACE_START(d);
+        n = send(d->client_fd, d->outq + d->outq_head, d->outq_len, MSG_NOSIGNAL);
+        TRACE_END(d, "send", trace_ns, d->handle);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            AESD_LOG(LOG_ERR, "[handle_client] send error - %s", strerror(errno));
+            return -1;
+        }
+        d->outq_head += n;
+        d->outq_len -= n;
+        metrics_inc(METRIC_BYTES_OUT, n);
+    }
+    d->outq_head = 0;
+    return 0;
+}
+
+/*
+ * Store one line received from the client, or act on a seekto command.
+ * @param buf holds a whole line, or the rest of the connection's input when
+ * it ends unterminated or a line does not fit in d->buf.
+ * Returns 1 if the line is newline terminated, 0 if not and -1 on error.
+ */
+int handle_packet(thread_data_t *d, char *buf, int bytes_read)
+{
+    int bytes_written = 0;
+    int str_index = 0;
+    int str_index_offset = 0;
+    uint64_t start_ns = 0;
+    uint64_t trace_ns = 0;
+    char command[64];
+    bool line_start = !d->mid_line;
+
+    d->mid_line = (buf[bytes_read - 1] != '\n');
+
+    AESD_LOG_PAYLOAD(LOG_DEBUG, "String received", buf, bytes_read);
+
+    // Check if "AESDCHAR_IOCSEEKTO" starts the line and if so, we override
+    // and call the ioctl. buf is not terminated, the next line follows it.
+    if (line_start && (size_t)bytes_read >= strlen(IO_SEEKTO) &&
+        strncmp(buf, IO_SEEKTO, strlen(IO_SEEKTO)) == 0)
+    {
+        snprintf(command, sizeof(command), "%.*s", bytes_read, buf);
+        if (sscanf(command, "AESDCHAR_IOCSEEKTO:%d,%d", &str_index, &str_index_offset) == 2)
+        {
+            AESD_LOG(LOG_INFO, "%s found. str_index: %d. str_index_offset: %d. Sending ioctl cmd to aesdchar driver", IO_SEEKTO, str_index, str_index_offset);
+            trace_ns = TRACE_START(d);
+            aesd_seekto(d, str_index, str_index_offset);
+            TRACE_END(d, "seekto", trace_ns, d->handle);
+            metrics_inc(METRIC_SEEKTO, 1);
+        }
+        else
+        {
+            AESD_LOG(LOG_ERR, "%s found, but could not parse str_index and str_index_offset. Skipping", IO_SEEKTO);
+        }
+    }
+    else
+    {
+        start_ns = metrics_now_ns();
+#if defined(USE_AESD_RING_HISTORY)
+        bytes_written = history_write(&d->pending, buf, bytes_read);
+#elif defined(USE_AESD_DATA_FILE)
+        bytes_written = storage_append(buf, bytes_read);
+#else
+        bytes_written = write(d->file_fd, buf, bytes_read);
+#endif
+        metrics_observe_ns(METRIC_STORAGE_WRITE_SECONDS, metrics_now_ns() - start_ns);
+        TRACE_END(d, "storage_write", start_ns, d->handle);
+        if (bytes_written < 0)
+        {
+            AESD_LOG(LOG_ERR, "[handle_client] write error - %s", strerror(errno));
+            return -1;
+        }
+        else if (bytes_written != bytes_read)
+        {
+            AESD_LOG(LOG_ERR, "[handle_client] write error - bytes mismatch. Read %d bytes, but wrote %d bytes", bytes_read, bytes_written);
+            return -1;
+        }
+    }
+
+    if (d->mid_line)
+        return 0;
+    metrics_inc(METRIC_PACKETS, 1);
+    return 1;
+}
+
+/*
+ * Execute the lines buffered in d->buf in order. A line's reply is queued in
+ * full before the next line runs, so a batch of lines gets exactly the
+ * replies it would have got one line at a time, and they leave together in
+ * as few send() calls as the outbound queue allows.
+ * Returns -1 if the connection must close.
+ */
+int text_process(thread_data_t *d, bool eof)
+{
+    size_t used = 0;
+    size_t len;
+    char *nl;
+    int rc;
+
+    while (!d->replaying && used < d->in_len)
+    {
+        nl = memchr(d->buf + used, '\n', d->in_len - used);
+        if (nl != NULL)
+            len = nl + 1 - (d->buf + used);
+        else if (eof || (used == 0 && d->in_len == d->buf_size - 1))
+            len = d->in_len - used;     // Unterminated tail, or a line longer than buf
+        else
+            break;
 
-    time(&now);
-    tm_info = localtime(&now);
-    int size = strftime(timestamp, sizeof(timestamp),
-                        "timestamp:%a, %d %b %Y %H:%M:%S %z\n", tm_info);
+        rc = handle_packet(d, d->buf + used, len);
+        used += len;
+        if (rc < 0)
+            return -1;
+        if (rc > 0 && (reply_start(d) != 0 || outq_fill(d) != 0))
+            return -1;
+    }
 
-    write(file_fd, timestamp, size);
+    if (used > 0)
+    {
+        memmove(d->buf, d->buf + used, d->in_len - used);
+        d->in_len -= used;
+    }
+    return 0;
 }
 
-int init_timer(int firstRun, int interval) {
-    struct sigevent sev;
-    timer_t timerId;
-    struct itimerspec ts;
+/*
+ * Read up to @param len bytes of history starting at @param pos. Only short
+ * at the end of history.
+ */
+ssize_t storage_read_at(thread_data_t *d, off_t pos, char *buf, size_t len)
+{
+    size_t total = 0;
+    ssize_t n;
+#ifdef USE_AESD_RING_HISTORY
+    size_t fpos = pos;
+
+    (void)d;
+#elif defined(USE_AESD_DATA_FILE)
+    (void)d;
+    // Dropped by retention
+    if (pos < datafile_start())
+    {
+        errno = ERANGE;
+        return -1;
+    }
+#endif
+
+    while (total < len)
+    {
+#ifdef USE_AESD_RING_HISTORY
+        n = history_read(&fpos, buf + total, len - total);
+#elif defined(USE_AESD_DATA_FILE)
+        n = datafile_read(&pos, buf + total, len - total);
+#else
+        n = pread(d->file_fd, buf + total, len - total, pos + total);
+#endif
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
 
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = timer_handler;
-    sev.sigev_value.sival_ptr = NULL;
+/*
+ * Resolve an AESDCHAR_IOCSEEKTO position to a history offset, -1 if it is
+ * not in the history
+ */
+off_t storage_seek(thread_data_t *d, unsigned int write_cmd, unsigned int write_cmd_offset)
+{
+#if defined(USE_AESD_RING_HISTORY)
+    size_t fpos;
 
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    sev.sigev_notify_attributes = &attr;
+    (void)d;
+    return history_seekto(&fpos, write_cmd, write_cmd_offset) == 0 ? (off_t)fpos : -1;
+#elif defined(USE_AESD_DATA_FILE)
+    (void)d;
+    return datafile_seek(write_cmd, write_cmd_offset);
+#else
+    struct aesd_seekto seekto = { .write_cmd = write_cmd, .write_cmd_offset = write_cmd_offset };
 
-    if (timer_create(CLOCK_REALTIME, &sev, &timerId) != 0) {
-        syslog(LOG_ERR, "Failed to create timer");
+    if (ioctl(d->file_fd, AESDCHAR_IOCSEEKTO, &seekto) != 0)
         return -1;
+    return lseek(d->file_fd, 0, SEEK_CUR);
+#endif
+}
+
+/*
+ * Largest binary response payload. Requests are only handled while the
+ * outbound queue is at or below the low watermark, so one always fits.
+ */
+size_t proto_max_payload(void)
+{
+    return outq_high - outq_low - PROTO_HEADER_SIZE;
+}
+
+/*
+ * Store one complete record from @param ctx (a thread_data_t), for the
+ * binary protocol and the shared ring
+ */
+ssize_t store_record(void *ctx, const char *buf, size_t len)
+{
+    thread_data_t *d = (thread_data_t *)ctx;
+    uint64_t start_ns = metrics_now_ns();
+    ssize_t n;
+
+#if defined(USE_AESD_DATA_FILE) || defined(USE_AESD_RING_HISTORY)
+    n = storage_append(buf, len);
+#else
+    n = write(d->file_fd, buf, len);
+#endif
+    metrics_observe_ns(METRIC_STORAGE_WRITE_SECONDS, metrics_now_ns() - start_ns);
+    TRACE_END(d, "storage_write", start_ns, d->handle);
+    metrics_inc(METRIC_PACKETS, 1);
+    return n;
+}
+
+/*
+ * Execute one binary request and append its response to the outbound queue
+ */
+void proto_dispatch(thread_data_t *d, const proto_header_t *req, const char *payload)
+{
+    proto_header_t rsp = { .opcode = req->opcode | PROTO_RESPONSE, .status = PROTO_OK, .seq = req->seq };
+    size_t max = proto_max_payload();
+    ssize_t n = 0;
+    off_t pos;
+    char *out;
+
+    outq_compact(d);
+    out = d->outq + d->outq_len + PROTO_HEADER_SIZE;
+
+    switch (req->opcode)
+    {
+        case PROTO_OP_APPEND:
+            if (store_record(d, payload, req->length) != (ssize_t)req->length)
+            {
+                AESD_LOG(LOG_ERR, "[proto] append error - %s", strerror(errno));
+                rsp.status = PROTO_EIO;
+            }
+            n = 0;
+            break;
+        case PROTO_OP_SEEK_READ:
+            if (req->length != 12)
+            {
+                rsp.status = PROTO_EINVAL;
+                break;
+            }
+            metrics_inc(METRIC_SEEKTO, 1);
+            pos = storage_seek(d, proto_get_u32(payload), proto_get_u32(payload + 4));
+            if (pos < 0)
+            {
+                rsp.status = PROTO_ERANGE;
+                break;
+            }
+            if (max > proto_get_u32(payload + 8))
+                max = proto_get_u32(payload + 8);
+            n = storage_read_at(d, pos, out, max);
+            break;
+        case PROTO_OP_READ_RANGE:
+            if (req->length != 12)
+            {
+                rsp.status = PROTO_EINVAL;
+                break;
+            }
+            if (max > proto_get_u32(payload + 8))
+                max = proto_get_u32(payload + 8);
+            n = storage_read_at(d, (off_t)proto_get_u64(payload), out, max);
+            if (n < 0 && errno == ERANGE)
+            {
+                rsp.status = PROTO_ERANGE;
+                n = 0;
+            }
+            break;
+        case PROTO_OP_STATS:
+            // Truncated rather than split when the queue is too small
+            n = metrics_render(out, max);
+            if ((size_t)n >= max)
+                n = max - 1;
+            break;
+        default:
+            rsp.status = PROTO_EOPNOTSUPP;
+            break;
+    }
+
+    if (n < 0)
+    {
+        AESD_LOG(LOG_ERR, "[proto] read error - %s", strerror(errno));
+        rsp.status = PROTO_EIO;
+        n = 0;
+    }
+    rsp.length = n;
+    proto_header_encode(d->outq + d->outq_len, &rsp);
+    d->outq_len += PROTO_HEADER_SIZE + n;
+    if (req->opcode == PROTO_OP_SEEK_READ || req->opcode == PROTO_OP_READ_RANGE)
+        metrics_inc(METRIC_REPLAY_BYTES, n);
+}
+
+/*
+ * Handle the complete binary requests buffered in d->buf, as many as the
+ * outbound queue has room for. Returns -1 if the connection must close.
+ */
+int proto_process(thread_data_t *d)
+{
+    proto_header_t req;
+    proto_header_t rsp = {0};
+    size_t used = 0;
+
+    while (d->outq_len <= outq_low && d->in_len - used >= PROTO_HEADER_SIZE)
+    {
+        proto_header_decode(d->buf + used, &req);
+        // One byte of buf stays reserved for text mode's terminator
+        if (req.length > d->buf_size - 1 - PROTO_HEADER_SIZE)
+        {
+            // Cannot be buffered, answer and give up on the stream
+            AESD_LOG(LOG_ERR, "[proto] %s sent a %u byte request", d->client_ip, req.length);
+            rsp.opcode = req.opcode | PROTO_RESPONSE;
+            rsp.status = PROTO_ETOOBIG;
+            rsp.seq = req.seq;
+            outq_compact(d);
+            proto_header_encode(d->outq + d->outq_len, &rsp);
+            d->outq_len += PROTO_HEADER_SIZE;
+            outq_flush(d);
+            return -1;
+        }
+        if (d->in_len - used < PROTO_HEADER_SIZE + req.length)
+            break;
+
+        proto_dispatch(d, &req, d->buf + used + PROTO_HEADER_SIZE);
+        used += PROTO_HEADER_SIZE + req.length;
+    }
+
+    if (used > 0)
+    {
+        memmove(d->buf, d->buf + used, d->in_len - used);
+        d->in_len -= used;
     }
+    return 0;
+}
 
-    pthread_attr_destroy(&attr);
-
-    ts.it_value.tv_sec = firstRun;
-    ts.it_value.tv_nsec = 0;
-    ts.it_interval.tv_sec = interval;
-    ts.it_interval.tv_nsec = 0;
+/*
+ * Pick the protocol from the first bytes of the connection. Returns 1 once
+ * decided, 0 if more bytes are needed and -1 on a bad handshake.
+ */
+int proto_negotiate(thread_data_t *d)
+{
+    int one = 1;
 
-    if (timer_settime(timerId, 0, &ts, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to start the timer");
+    if (d->buf[0] != PROTO_MAGIC[0])
+    {
+        d->proto = PROTO_TEXT;
+        return 1;
+    }
+    if (d->in_len < PROTO_MAGIC_SIZE)
+        return 0;
+    if (d->local && memcmp(d->buf, SHM_MAGIC, SHM_MAGIC_SIZE) == 0)
+    {
+        // Anything after the magic is ignored, records go through the ring
+        d->in_len = 0;
+        d->proto = PROTO_SHM;
+        AESD_LOG(LOG_INFO, "%s negotiated the shared ring", d->client_ip);
+        return 1;
+    }
+    if (memcmp(d->buf, PROTO_MAGIC, PROTO_MAGIC_SIZE) != 0)
+    {
+        AESD_LOG(LOG_ERR, "[proto] bad handshake from %s", d->client_ip);
         return -1;
     }
 
-    return 0;
+    // Echo the magic to confirm, then treat the rest as requests
+    memcpy(d->outq + d->outq_head + d->outq_len, PROTO_MAGIC, PROTO_MAGIC_SIZE);
+    d->outq_len += PROTO_MAGIC_SIZE;
+    d->in_len -= PROTO_MAGIC_SIZE;
+    memmove(d->buf, d->buf + PROTO_MAGIC_SIZE, d->in_len);
+    d->proto = PROTO_BINARY;
+    // Responses are batched in the outbound queue already, Nagle would only
+    // hold back the tail of a pipelined window until the client's delayed ACK
+    if (!d->local) setsockopt(d->client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    AESD_LOG(LOG_INFO, "%s negotiated the binary protocol", d->client_ip);
+    return 1;
 }
-#endif
 
-void aesd_seekto(int fd, int str_index, int str_index_offset)
+// Ring records never pass through recv(), count them here
+ssize_t shm_store_record(void *ctx, const char *buf, size_t len)
 {
-    struct aesd_seekto seekto;
+    metrics_inc(METRIC_BYTES_IN, len);
+    return store_record(ctx, buf, len);
+}
 
-    seekto.write_cmd = str_index;
-    seekto.write_cmd_offset = str_index_offset;
+/*
+ * Serve a local client which negotiated the shared ring until it closes the
+ * connection
+ */
+void shm_handle(thread_data_t *d)
+{
+    shm_conn_t c;
 
-    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) != 0)
-    {
-        syslog(LOG_ERR, "IO seekto ioctl failed - %s", strerror(errno));
-    }
-    syslog(LOG_INFO, "IO seekto ioctl set");
+    if (shm_accept(d->client_fd, &c) != 0)
+        return;
+    if (shm_serve(&c, d->client_fd, shm_store_record, d) != 0)
+        AESD_LOG(LOG_ERR, "Dropping shared ring client %s", d->client_ip);
+    shm_release(&c);
 }
 
 /*
 * This function will handle the communication between the client. It will:
 * 1) Receive the packets from the client, and write them to the file
 * 2) Take all packets written to the file, and send them back to the client
+*
+* Replies go through a bounded outbound queue on a non-blocking socket. Reads
+* from the client pause while a reply is still being queued or more than the
+* low watermark of it is unsent, so a client which does not drain its
+* replies cannot make the server store more on its behalf. A client which
+* takes no data for send_stall_ms is dropped. A data file reply too large
+* for the queue is sent straight from the file once the queue is empty.
+*
+* A client which opens with PROTO_MAGIC speaks the binary protocol instead,
+* see proto.h. Its requests are buffered in d->buf until complete.
 */
 void handle_client(thread_data_t *d)
 {
-    char buf[BUFFER_SIZE];
+    struct pollfd pfd = { .fd = d->client_fd };
+    bool eof = false;
+    bool reading = false;
+    bool paused = false;
+    bool sending = false;
     int bytes_read = 0;
-    int bytes_written = 0;
-    int str_index = 0;
-    int str_index_offset = 0;
+    int rc = 0;
+    uint64_t trace_ns = 0;
 
-    while(true)
+    while (!eof || d->replaying || d->outq_len > 0 || (d->proto == PROTO_TEXT && d->in_len > 0))
     {
-        bytes_read = recv(d->client_fd, buf, BUFFER_SIZE - 1, 0);
-        if (bytes_read < 0)
-        {
-            syslog(LOG_ERR, "[handle_client] recv error - %s", strerror(errno));
+        if (d->proto == PROTO_TEXT && text_process(d, eof) != 0)
+            return;
+        if (d->proto == PROTO_BINARY && proto_process(d) != 0)
+            return;
+        if (d->replaying && !d->replay_direct && d->outq_len <= outq_low && outq_fill(d) != 0)
+            return;
+        if (d->outq_len > 0 && outq_flush(d) != 0)
+            return;
+        if (d->replay_direct && d->outq_len == 0 && reply_send(d) != 0)
             return;
-        }
-        else if (bytes_read == 0)
-        {
-            // Terminated session
-            break;
-        }
 
-        buf[bytes_read] = '\0';
+        if (d->reply_start_ns != 0 && !d->replaying && d->outq_len == 0)
+            reply_finish(d);
 
-        syslog(LOG_DEBUG, "String received: %s", buf);
+        reading = !eof && !d->replaying && d->outq_len <= outq_low && d->in_len < d->buf_size - 1;
+        if (!reading && !eof && !paused)
+            metrics_inc(METRIC_READ_PAUSES, 1);
+        paused = !reading;
+
+        sending = d->outq_len > 0 || d->replay_direct;
+        pfd.events = (reading ? POLLIN : 0) | (sending ? POLLOUT : 0);
+        if (pfd.events == 0)
+            continue;
 
-        // Check if "AESDCHAR_IOCSEEKTO" is sent over
-        // and if so, we override and call the ioctl
-        if (strncmp(buf, IO_SEEKTO, strlen(IO_SEEKTO)) == 0)
+        rc = poll(&pfd, 1, sending ? send_stall_ms : -1);
+        if (rc < 0)
         {
-            if (sscanf(buf, "AESDCHAR_IOCSEEKTO:%d,%d", &str_index, &str_index_offset) == 2)
-            {
-                syslog(LOG_INFO, "%s found. str_index: %d. str_index_offset: %d. Sending ioctl cmd to aesdchar driver", IO_SEEKTO, str_index, str_index_offset);
-                aesd_seekto(d->file_fd, str_index, str_index_offset);
-            }
-            else
-            {
-                syslog(LOG_ERR, "%s found, but could not parse str_index and str_index_offset. Skipping", IO_SEEKTO);
-            }
+            if (errno == EINTR)
+                continue;
+            AESD_LOG(LOG_ERR, "[handle_client] poll error - %s", strerror(errno));
+            return;
         }
-        else
+        if (rc == 0)
         {
-            syslog(LOG_DEBUG, "Writing %s to aesd driver", buf);
-            bytes_written = write(d->file_fd, buf, bytes_read);
-            if (bytes_written < 0)
-            {
-                syslog(LOG_ERR, "[handle_client] write error - %s", strerror(errno));
-                return;
-            }
-            else if (bytes_written != bytes_read)
-            {
-                syslog(LOG_ERR, "[handle_client] write error - bytes mismatch. Read %d bytes, but wrote %d bytes", bytes_read, bytes_written);
-                return;
-            }
+            AESD_LOG(LOG_WARNING, "Dropping %s, no reply data taken for %d ms", d->client_ip, send_stall_ms);
+            metrics_inc(METRIC_STALLED_CLIENTS, 1);
+            // Tell the client now, the socket is only closed when reaped
+            shutdown(d->client_fd, SHUT_RDWR);
+            return;
         }
 
-        if (strchr(buf, '\n') == NULL)
-        {
+        if (pfd.revents & POLLERR)
+            zerocopy_reap(d);
+        if (!reading || !(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
             continue;
-        }
 
-#ifndef USE_AESD_CHAR_DEVICE
-        // Packet received - sending it back!
-        if (lseek(d->file_fd, 0, SEEK_SET) == -1)
+        trace_ns = TRACE_START(d);
+        bytes_read = recv(d->client_fd, d->buf + d->in_len, d->buf_size - 1 - d->in_len, 0);
+        TRACE_END(d, "recv", trace_ns, d->handle);
+        if (bytes_read < 0)
         {
-            syslog(LOG_ERR, "[handle_client] lseek error - %s", strerror(errno));
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            AESD_LOG(LOG_ERR, "[handle_client] recv error - %s", strerror(errno));
             return;
         }
-#endif
-        syslog(LOG_DEBUG, "Packet received - sending it back!");
-        while((bytes_read = read(d->file_fd, buf, BUFFER_SIZE)) != 0)
+        else if (bytes_read == 0)
         {
-            syslog(LOG_INFO, "Read from driver: %s", buf);
-            if (bytes_read == -1)
-            {
-                syslog(LOG_ERR, "[handle client] read error - %s", strerror(errno));
-                return;
-            }
+            // Terminated session, flush what is still queued
+            eof = true;
+            continue;
+        }
 
-            bytes_written = send(d->client_fd, buf, bytes_read, 0);
-            if (bytes_written == -1)
-            {
-                syslog(LOG_ERR, "[handle_client] send error - %s", strerror(errno));
-                return;
-            }
-            else if (bytes_written != bytes_read)
-            {
-                syslog(LOG_ERR, "[handle_client] send error - bytes mismatch. Read %d bytes, but wrote %d bytes", bytes_read, bytes_written);
-                return;
-            }
+        // Buffered until complete, handled at the top of the loop
+        d->in_len += bytes_read;
+        metrics_inc(METRIC_BYTES_IN, bytes_read);
+        if (d->proto == PROTO_UNKNOWN && proto_negotiate(d) < 0)
+            return;
+        if (d->proto == PROTO_SHM)
+        {
+            shm_handle(d);
+            return;
         }
     }
 }
@@ -222,48 +1106,228 @@ void handle_client(thread_data_t *d)
 void *client_thread(void *t)
 {
     thread_data_t *data = (thread_data_t *)t;
+    sigset_t mask;
 
+    // Leave signal handling to the accept loop
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+#ifdef USE_AESD_CHAR_DEVICE
     // Open file for storing packet data
-    data->file_fd = open(FILE, O_CREAT | O_RDWR | O_APPEND, 0644);
+    data->file_fd = open(FILE, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 0644);
     if (data->file_fd < 0)
     {
-        syslog(LOG_ERR, "Failed to open file %s - %s", FILE, strerror(errno));
+        AESD_LOG(LOG_ERR, "Failed to open file %s - %s", FILE, strerror(errno));
         goto done;
     }
+#endif
 
-    syslog(LOG_INFO, "Accepted connection from %s", (data->client_ip != NULL) ? data->client_ip : "an unknown IP");
+    AESD_LOG(LOG_INFO, "Accepted connection from %s", data->client_ip);
 
     handle_client(data);
 
-    syslog(LOG_INFO, "Closed connection from %s", (data->client_ip != NULL) ? data->client_ip : "an unknown IP");
+    AESD_LOG(LOG_INFO, "Closed connection from %s", data->client_ip);
 
+#ifdef USE_AESD_RING_HISTORY
+    // An unterminated packet is dropped with the connection
+    history_pending_free(&data->pending);
+#elif defined(USE_AESD_CHAR_DEVICE)
     close(data->file_fd);
 done:
+#endif
     data->thread_complete_success = true;
+    metrics_gauge_add(METRIC_ACTIVE_CONNECTIONS, -1);
+
+    // The reaper only runs once the accept loop wakes up, end the connection
+    // now and leave it just the close()
+    if (data->client_fd > 0) shutdown(data->client_fd, SHUT_RDWR);
+
+    // Publish to the completed stack, reaped by join_completed_threads()
+    data->next_completed = atomic_load(&completed);
+    while (!atomic_compare_exchange_weak(&completed, &data->next_completed, data))
+        ;
 
     return t;
 }
 
 void join_completed_threads()
 {
-    node_t *ptr = (node_t *)sll_front(list);
-    node_t *next = NULL;
-    thread_data_t *data = NULL;
+    // Take the whole stack at once, only the main thread consumes it
+    thread_data_t *data = atomic_exchange(&completed, NULL);
+    thread_data_t *next = NULL;
 
-    while(ptr != NULL)
+    while (data != NULL)
     {
-        data = (thread_data_t *)(ptr->value);
-        if (data->thread_complete_success)
-        {
-            pthread_join(data->tid, NULL);
-            next = ptr->next;  // Save next node
-            sll_remove_node(list, ptr->value);
-            // if (data->client_fd > 0) close(data->client_fd);
-            // if (data->file_fd > 0) close(data->file_fd);
-            free(data);
-            ptr = next;  // Move forward
-        }
-        ptr = ptr->next;
+        next = data->next_completed;
+        pthread_join(data->tid, NULL);
+        conn_table_remove(connections, data->handle);
+        if (data->client_fd > 0) close(data->client_fd);
+        pool_put(outq_pool, data->outq);
+        pool_put(buffer_pool, data->buf);
+        pool_put(thread_data_pool, data);
+        data = next;
+    }
+}
+
+/*
+ * Set up the context for an accepted connection and start its thread.
+ * Closes @param client_fd on failure.
+ */
+int start_client(int client_fd, const char *client_ip, bool local)
+{
+    thread_data_t *d = NULL;
+
+    d = (thread_data_t *)pool_get(thread_data_pool);
+    if (!d)
+    {
+        syslog(LOG_ERR, "Failed to allocate thread_data_t");
+        close(client_fd);
+        return -1;
+    }
+
+    d->buf = (char *)pool_get(buffer_pool);
+    if (!d->buf)
+    {
+        syslog(LOG_ERR, "Failed to allocate I/O buffer");
+        pool_put(thread_data_pool, d);
+        close(client_fd);
+        return -1;
+    }
+
+    d->outq = (char *)pool_get(outq_pool);
+    if (!d->outq)
+    {
+        syslog(LOG_ERR, "Failed to allocate outbound queue");
+        pool_put(buffer_pool, d->buf);
+        pool_put(thread_data_pool, d);
+        close(client_fd);
+        return -1;
+    }
+
+    d->buf_size = buffer_size;
+    d->outq_head = 0;
+    d->outq_len = 0;
+    d->replaying = false;
+    d->replay_direct = false;
+    d->send_flags = MSG_NOSIGNAL;
+    d->zerocopy_armed = false;
+    d->zerocopy_failed = false;
+    d->reply_start_ns = 0;
+    d->proto = PROTO_UNKNOWN;
+    d->in_len = 0;
+    d->mid_line = false;
+    d->local = local;
+    strncpy(d->client_ip, client_ip, sizeof(d->client_ip) - 1);
+    d->client_ip[sizeof(d->client_ip) - 1] = '\0';
+    d->file_fd = 0;
+    d->client_fd = client_fd;
+    d->thread_complete_success = false;
+    d->next_completed = NULL;
+    d->traced = trace_sample_connection();
+#ifdef USE_AESD_RING_HISTORY
+    d->pending.buf = NULL;
+    d->pending.size = 0;
+    d->fpos = 0;
+#endif
+#ifdef USE_AESD_DATA_FILE
+    d->seek_pos = -1;
+#endif
+
+    // Register before the thread starts, it may complete immediately
+    if ((d->handle = conn_table_insert(connections, d)) < 0)
+    {
+        syslog(LOG_ERR, "Failed to register connection %s", d->client_ip);
+        pool_put(outq_pool, d->outq);
+        pool_put(buffer_pool, d->buf);
+        pool_put(thread_data_pool, d);
+        close(client_fd);
+        return -1;
+    }
+
+    if (pthread_create(&d->tid, NULL, client_thread, d) != 0)
+    {
+        syslog(LOG_ERR, "Failed to spawn thread for new connection %s", d->client_ip);
+        conn_table_remove(connections, d->handle);
+        pool_put(outq_pool, d->outq);
+        pool_put(buffer_pool, d->buf);
+        pool_put(thread_data_pool, d);
+        close(client_fd);
+        return -1;
+    }
+
+    metrics_inc(METRIC_ACCEPTS, 1);
+    metrics_gauge_add(METRIC_ACTIVE_CONNECTIONS, 1);
+    return 0;
+}
+
+/*
+ * Stop reading from every client so in-flight replies finish and their
+ * threads see EOF, wait up to @param deadline_ms for them, then force-close
+ * the stragglers. Leaves the connection table empty.
+ */
+void drain_connections(int deadline_ms)
+{
+    struct timespec nap = { 0, SHUTDOWN_POLL_MS * 1000000L };
+    uint64_t deadline = metrics_now_ns() + (uint64_t)deadline_ms * 1000000;
+    conn_entry_t *entry;
+    int i;
+
+    CONN_TABLE_FOREACH(connections, i, entry)
+    {
+        shutdown(((thread_data_t *)entry->value)->client_fd, SHUT_RD);
+    }
+
+    join_completed_threads();
+    while (conn_table_size(connections) > 0 && metrics_now_ns() < deadline)
+    {
+        nanosleep(&nap, NULL);
+        join_completed_threads();
+    }
+
+    if (conn_table_size(connections) == 0)
+    {
+        return;
+    }
+
+    // Blocked send()/recv() calls fail once the socket is shut down both ways
+    syslog(LOG_WARNING, "Force closing %d connections after %d ms",
+           conn_table_size(connections), deadline_ms);
+    CONN_TABLE_FOREACH(connections, i, entry)
+    {
+        shutdown(((thread_data_t *)entry->value)->client_fd, SHUT_RDWR);
+    }
+
+    while (conn_table_size(connections) > 0)
+    {
+        nanosleep(&nap, NULL);
+        join_completed_threads();
+    }
+}
+
+/*
+ * After a reload, keep serving the connections we have until their clients
+ * close them or @param deadline_ms passes. Their reads stay open, so lines
+ * sent meanwhile are stored and answered as before. SIGINT/SIGTERM end the
+ * wait early. Whatever is left is for drain_connections().
+ */
+void serve_until_closed(int sig_fd, int deadline_ms)
+{
+    uint64_t deadline = metrics_now_ns() + (uint64_t)deadline_ms * 1000000;
+    struct pollfd pfd = { .fd = sig_fd, .events = POLLIN };
+
+    join_completed_threads();
+    while (conn_table_size(connections) > 0 && metrics_now_ns() < deadline)
+    {
+        // A further SIGHUP has nothing left to hand off
+        if (poll(&pfd, 1, SHUTDOWN_POLL_MS) > 0 && handle_signals(sig_fd) == SIGNAL_STOP)
+            return;
+        join_completed_threads();
+    }
+
+    if (conn_table_size(connections) > 0)
+    {
+        syslog(LOG_WARNING, "%d connections still open %d ms after the reload",
+               conn_table_size(connections), deadline_ms);
     }
 }
 
@@ -277,9 +1341,20 @@ int main(int argc, char **argv)
     struct addrinfo *res = NULL;
     struct sockaddr_in client_addr = {0};
     socklen_t client_addr_len = sizeof(client_addr);
+    char client_ip[INET_ADDRSTRLEN];
     struct sigaction a = {0};
+    sigset_t mask;
+    int sig_fd = -1;
+    int handoff_fd = -1;
+    bool handed_off = false;
+    signal_action_t action;
+    ssize_t len;
+    struct pollfd fds[POLL_HANDOFF + 1] = {0};
+#ifndef USE_AESD_CHAR_DEVICE
+    timestamp_cache_t timestamp = {0};
+#endif
+    int timer_fd = -1;
     pid_t pid;
-    thread_data_t *thread_data = NULL;
 
     openlog(NULL, 0, LOG_USER);
 
@@ -290,67 +1365,215 @@ int main(int argc, char **argv)
             case 'd':
                 daemon_mode = 1;
                 break;
+            case 'l':
+                log_level = atoi(optarg);
+                aesdlog_set_level(log_level);
+                break;
+            case 't':
+                aesdlog_set_payload_max(strtoul(optarg, NULL, 0));
+                break;
+            case 'm':
+                metrics_port = optarg;
+                break;
+            case 's':
+                trace_set_sample_rate(strtoul(optarg, NULL, 0));
+                break;
+            case 'w':
+                outq_high = strtoul(optarg, NULL, 0);
+                if (outq_high < OUTQ_MIN_WATERMARK)
+                {
+                    syslog(LOG_ERR, "Invalid outbound queue size %s", optarg);
+                    return -1;
+                }
+                outq_low = outq_high / OUTQ_LOW_WATERMARK_DIVISOR;
+                break;
+            case 'r':
+                replay_limit = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                send_stall_ms = atoi(optarg);
+                if (send_stall_ms <= 0)
+                {
+                    syslog(LOG_ERR, "Invalid send stall timeout %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'u':
+                unix_path = optarg;
+                break;
+            case 'H':
+#ifdef USE_AESD_RING_HISTORY
+                syslog(LOG_ERR, "Handoff unsupported with the in-process history");
+                return -1;
+#else
+                // Started by reload(), see handoff.h
+                handoff_fd = atoi(optarg);
+                break;
+#endif
+            case 'f':
+                if (datafile_parse_sync(optarg, &datafile_config.sync, &datafile_config.sync_interval_ms) != 0)
+                {
+                    syslog(LOG_ERR, "Invalid sync mode %s, expected none, line or periodic[:ms]", optarg);
+                    return -1;
+                }
+                break;
+            case 'k':
+                keep_file = true;
+                break;
+            case 'Y':
+                if (datafile_parse_send(optarg, &reply_send_mode, &zerocopy_min) != 0)
+                {
+                    syslog(LOG_ERR, "Invalid reply path %s, expected read, sendfile or mmap[:zero copy bytes]", optarg);
+                    return -1;
+                }
+                break;
+            case 'z':
+                datafile_config.segment_size = strtoll(optarg, NULL, 0);
+                if (datafile_config.segment_size < DATAFILE_MIN_SEGMENT_SIZE)
+                {
+                    syslog(LOG_ERR, "Invalid segment size %s", optarg);
+                    return -1;
+                }
+                break;
+            case 'R':
+                datafile_config.retain_bytes = strtoll(optarg, NULL, 0);
+                break;
+            case 'A':
+                datafile_config.retain_seconds = strtol(optarg, NULL, 0);
+                break;
+            case 'b':
+                buffer_size = strtoul(optarg, NULL, 0);
+                if (buffer_size < MIN_BUFFER_SIZE)
+                {
+                    syslog(LOG_ERR, "Invalid buffer size %s", optarg);
+                    return -1;
+                }
+                break;
             default:
                 break;
         }
     }
 
-    // Setup signal handler
-    a.sa_handler = signal_handler;
-    if (sigaction(SIGTERM, &a, NULL) != 0)
+    // Block the handled signals before any thread starts so they all queue
+    // on the signalfd polled by the event loop
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0)
     {
-        syslog(LOG_ERR, "Failed to register signal handler for SIGTERM - %s", strerror(errno));
+        syslog(LOG_ERR, "Failed to block signals - %s", strerror(errno));
         return -1;
     }
 
-    if (sigaction(SIGINT, &a, NULL) != 0)
+    sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd < 0)
     {
-        syslog(LOG_ERR, "Failed to register signal handler for SIGINT - %s", strerror(errno));
+        syslog(LOG_ERR, "Failed to create signalfd - %s", strerror(errno));
         return -1;
     }
 
-    if ((list = sll_init_list()) == NULL)
+    // A client going away mid reply must not kill the server
+    a.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &a, NULL) != 0)
     {
-        syslog(LOG_ERR, "Failed to create linked list");
-        rc = -1;
-        goto close_file;
+        syslog(LOG_ERR, "Failed to ignore SIGPIPE - %s", strerror(errno));
+        return -1;
     }
 
-    // Getting address info
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+#ifdef USE_AESD_RING_HISTORY
+    if (history_init() != 0)
+    {
+        syslog(LOG_ERR, "Failed to create history ring");
+        return -1;
+    }
+#endif
 
-    rc = getaddrinfo(NULL, PORT, &hints, &res);
-    if (rc != 0)
+#ifdef USE_AESD_DATA_FILE
+    // Shared by every writer through storage_append() and every reader.
+    // A reloaded process must not recover, the previous one is still appending.
+    datafile_config.recover = keep_file && handoff_fd < 0;
+    datafile_config.map = (reply_send_mode == DATAFILE_SEND_MMAP);
+    if (datafile_open(FILE, &datafile_config) != 0)
     {
-        syslog(LOG_ERR, "getaddrinfo error - %s", gai_strerror(rc));
-        goto free_list;
+        return -1;
     }
+    // Segments stay as they are until the previous process has drained
+    if (handoff_fd >= 0)
+        datafile_detach();
+#endif
 
-    // Open socket
-    sock_fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (sock_fd < 0)
+    if ((connections = conn_table_init(CONN_TABLE_INITIAL_CAPACITY)) == NULL)
     {
-        syslog(LOG_ERR, "socket error - %s", strerror(errno));
+        syslog(LOG_ERR, "Failed to create connection table");
         rc = -1;
-        goto free_addr_info;
+        goto close_file;
     }
 
-    // Allow address reuse
-    rc = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    if (rc != 0)
+    thread_data_pool = pool_init(sizeof(thread_data_t), POOL_CHUNK_OBJECTS, POOL_CHUNK_OBJECTS);
+    buffer_pool = pool_init(buffer_size, 1, POOL_CHUNK_OBJECTS);
+    outq_pool = pool_init(outq_high, 1, POOL_CHUNK_OBJECTS);
+    if (!thread_data_pool || !buffer_pool || !outq_pool)
     {
-        syslog(LOG_ERR, "setsockopt error - %s", strerror(errno));
-        goto free_addr_info;
+        syslog(LOG_ERR, "Failed to create connection pools");
+        rc = -1;
+        goto free_pools;
     }
 
-    // Bind socket to port
-    rc = bind(sock_fd, res->ai_addr, res->ai_addrlen);
-    if (rc != 0)
+    len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[len > 0 ? len : 0] = '\0';
+
+    if (handoff_fd >= 0)
     {
-        syslog(LOG_ERR, "bind error - %s", strerror(errno));
-        goto close_sock;
+        // Reloaded, the previous process passes its listening socket
+        daemon_mode = 0;
+        sock_fd = handoff_receive(handoff_fd);
+        if (sock_fd < 0)
+        {
+            rc = -1;
+            goto free_pools;
+        }
+    }
+    else
+    {
+        // Getting address info
+        hints.ai_flags = AI_PASSIVE;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        rc = getaddrinfo(NULL, PORT, &hints, &res);
+        if (rc != 0)
+        {
+            syslog(LOG_ERR, "getaddrinfo error - %s", gai_strerror(rc));
+            goto free_pools;
+        }
+
+        // Open socket, not inherited by a reloaded process
+        sock_fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock_fd < 0)
+        {
+            syslog(LOG_ERR, "socket error - %s", strerror(errno));
+            rc = -1;
+            goto free_addr_info;
+        }
+
+        // Allow address reuse
+        rc = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (rc != 0)
+        {
+            syslog(LOG_ERR, "setsockopt error - %s", strerror(errno));
+            goto free_addr_info;
+        }
+
+        // Bind socket to port
+        rc = bind(sock_fd, res->ai_addr, res->ai_addrlen);
+        if (rc != 0)
+        {
+            syslog(LOG_ERR, "bind error - %s", strerror(errno));
+            goto close_sock;
+        }
     }
 
     if (daemon_mode)
@@ -368,17 +1591,32 @@ int main(int argc, char **argv)
         }
     }
 
+    // The drain thread must be started in the process which keeps running
+    if (aesdlog_init() != 0)
+    {
+        syslog(LOG_ERR, "Failed to start log drain thread");
+        rc = -1;
+        goto close_sock;
+    }
+
+    // Optional, the data port is served either way
+    if (strcmp(metrics_port, "0") != 0 && metrics_start(metrics_port) != 0)
+    {
+        syslog(LOG_ERR, "Metrics unavailable on port %s, continuing without them", metrics_port);
+    }
+
 #ifndef USE_AESD_CHAR_DEVICE
-    // Set up timer
-    if ((rc = init_timer(1, 10)) != 0)
+    // Timestamps are appended from the event loop below
+    if ((timer_fd = init_timer(TIMESTAMP_FIRST_RUN, TIMESTAMP_INTERVAL)) < 0)
     {
+        rc = -1;
         goto close_sock;
     }
 #else
     syslog(LOG_INFO, "USE_AESD_CHAR_DEVICE is set");
 #endif
 
-    // Listen for incoming connections
+    // Listen for incoming connections, a no-op for a handed off socket
     rc = listen(sock_fd, BACKLOG);
     if (rc != 0)
     {
@@ -386,54 +1624,165 @@ int main(int argc, char **argv)
         goto close_sock;
     }
 
+    if (unix_path && (unix_fd = shm_listen(unix_path, BACKLOG)) < 0)
+    {
+        rc = -1;
+        goto close_sock;
+    }
+
+    if (handoff_fd >= 0 && handoff_ready(handoff_fd) != 0)
+    {
+        syslog(LOG_ERR, "Failed to report ready to the previous process");
+        rc = -1;
+        goto close_sock;
+    }
+
     // We don't need res anymore
     freeaddrinfo(res);
+    res = NULL;
 
-    // Server loop - accept connection and spawn thread
+    fds[POLL_LISTEN].fd = sock_fd;
+    fds[POLL_LISTEN].events = POLLIN;
+    fds[POLL_SIGNAL].fd = sig_fd;
+    fds[POLL_SIGNAL].events = POLLIN;
+    // poll() skips the slots left at -1
+    fds[POLL_UNIX].fd = unix_fd;
+    fds[POLL_UNIX].events = POLLIN;
+    fds[POLL_TIMER].fd = timer_fd;
+    fds[POLL_TIMER].events = POLLIN;
+    fds[POLL_HANDOFF].fd = handoff_fd;
+    fds[POLL_HANDOFF].events = POLLIN;
+
+    // Server loop - wait for a connection, a signal or a timestamp tick
     while (true)
     {
-        client_fd = accept(sock_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_fd < 0)
+        if (poll(fds, POLL_HANDOFF + 1, -1) < 0)
         {
-            syslog(LOG_ERR, "accept error - %s", strerror(errno));
+            if (errno != EINTR) syslog(LOG_ERR, "poll error - %s", strerror(errno));
             continue;
         }
 
-        thread_data = (thread_data_t *)malloc(sizeof(thread_data_t));
-        if (!thread_data)
+        if (fds[POLL_SIGNAL].revents & POLLIN)
         {
-            syslog(LOG_ERR, "Failed to malloc thread_data_t");
-            close(client_fd);
-            continue;
+            action = handle_signals(sig_fd);
+            if (action == SIGNAL_STOP)
+            {
+                break;
+            }
+            if (action == SIGNAL_RELOAD && handoff_fd >= 0)
+            {
+                // A third process would share the data file with both
+                syslog(LOG_WARNING, "Reload ignored, the previous process is still draining");
+            }
+            else if (action == SIGNAL_RELOAD && reload(argv) == 0)
+            {
+                // The data file now belongs to the new process
+                handed_off = true;
+#ifdef USE_AESD_DATA_FILE
+                datafile_detach();
+#endif
+                break;
+            }
         }
-        
-        thread_data->client_ip = inet_ntoa(client_addr.sin_addr);
-        thread_data->file_fd = 0;
-        thread_data->client_fd = client_fd;
-        thread_data->thread_complete_success = false;
 
-        if ((rc = pthread_create(&thread_data->tid, NULL, client_thread, thread_data)) != 0)
+        if (fds[POLL_HANDOFF].revents & (POLLIN | POLLHUP | POLLERR))
         {
-            syslog(LOG_ERR, "Failed to spawn thread for new connection %s", thread_data->client_ip);
-            free(thread_data);
-            close(client_fd);
-            continue;
+            // Only EOF is expected, the previous process has exited
+            syslog(LOG_INFO, "Previous process exited");
+            close(handoff_fd);
+            handoff_fd = -1;
+            fds[POLL_HANDOFF].fd = -1;
+#ifdef USE_AESD_DATA_FILE
+            datafile_attach();
+#endif
+        }
+
+#ifndef USE_AESD_CHAR_DEVICE
+        if (fds[POLL_TIMER].revents & POLLIN)
+        {
+            timestamp_tick(timer_fd, &timestamp, TIMESTAMP_INTERVAL);
+#ifdef USE_AESD_DATA_FILE
+            datafile_retain();
+#endif
+            join_completed_threads();
+        }
+#endif
+        if (fds[POLL_LISTEN].revents & POLLIN)
+        {
+            client_addr_len = sizeof(client_addr);
+            client_fd = accept4(sock_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd >= 0)
+            {
+                inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+                start_client(client_fd, client_ip, false);
+            }
+            else if (errno != EINTR)
+            {
+                syslog(LOG_ERR, "accept error - %s", strerror(errno));
+            }
+        }
+
+        if (fds[POLL_UNIX].revents & POLLIN)
+        {
+            client_fd = accept4(unix_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd >= 0)
+            {
+                start_client(client_fd, "local", true);
+            }
+            else if (errno != EINTR)
+            {
+                syslog(LOG_ERR, "UNIX socket accept error - %s", strerror(errno));
+            }
         }
 
-        sll_insert_node(list, (void *)thread_data);
         join_completed_threads();
     }
 
-close_sock:
+    // Stop accepting before draining so the port frees up for a restart.
+    // Never shutdown() it, after a reload the new process shares it.
     close(sock_fd);
+    sock_fd = -1;
+    if (unix_fd >= 0)
+    {
+        close(unix_fd);
+        unix_fd = -1;
+        // After a reload the path already names the new process's socket
+        if (!handed_off) unlink(unix_path);
+    }
+    if (handed_off) serve_until_closed(sig_fd, RELOAD_DRAIN_MS);
+    drain_connections(SHUTDOWN_DRAIN_MS);
+    if (handed_off) syslog(LOG_INFO, "Drained after reload, exiting");
+    rc = 0;
+
+close_sock:
+    if (timer_fd >= 0) close(timer_fd);
+    if (handoff_fd >= 0) close(handoff_fd);
+    if (unix_fd >= 0)
+    {
+        close(unix_fd);
+        unlink(unix_path);
+    }
+    if (sock_fd >= 0) close(sock_fd);
 free_addr_info:
     if (res) freeaddrinfo(res);
-free_list:
-    sll_destroy_list(list);
+free_pools:
+    pool_destroy(outq_pool);
+    pool_destroy(buffer_pool);
+    pool_destroy(thread_data_pool);
+    conn_table_destroy(connections);
 close_file:
+#ifdef USE_AESD_DATA_FILE
+    datafile_close(!handed_off && !keep_file);
+#else
     close(file_fd);
-#ifndef USE_AESD_CHAR_DEVICE
-    remove(FILE);
 #endif
+    if (sig_fd >= 0) close(sig_fd);
+    // Lets the process we handed off to take over the data file
+    if (successor_fd >= 0) close(successor_fd);
+#ifdef USE_AESD_RING_HISTORY
+    history_destroy();
+#endif
+    metrics_stop();
+    aesdlog_shutdown();
     return rc;
 }
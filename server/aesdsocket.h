@@ -2,26 +2,96 @@
 #define AESDSOCKET_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
 
 #define PORT "9000"
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE (64 * 1024)     // Default per-connection I/O buffer, see -b
+#define MIN_BUFFER_SIZE 2
+#define POOL_CHUNK_OBJECTS 16       // Connection contexts/buffers allocated per pool growth
+#define OUTQ_HIGH_WATERMARK (256 * 1024)   // Default per-connection outbound queue, see -w
+#define OUTQ_LOW_WATERMARK_DIVISOR 4        // Refill and resume reads below high / 4
+#define OUTQ_MIN_WATERMARK 64
+#define SEND_STALL_MS 30000                 // Default for -S
 #define BACKLOG 10
+#define CONN_TABLE_INITIAL_CAPACITY 64
+#define TIMESTAMP_FIRST_RUN 1       // Seconds until the first timestamp record
+#define TIMESTAMP_INTERVAL 10       // Seconds between timestamp records
+#define SHUTDOWN_DRAIN_MS 5000      // Time in-flight replies get on SIGINT/SIGTERM
+#define SHUTDOWN_POLL_MS 10
+#define RELOAD_DRAIN_MS (10 * 60 * 1000)   // Time existing clients keep being served after SIGHUP
 
-#ifdef USE_AESD_CHAR_DEVICE
+// What the event loop does after handling queued signals
+typedef enum {
+    SIGNAL_NONE,
+    SIGNAL_STOP,        // SIGINT/SIGTERM, drain and exit
+    SIGNAL_RELOAD       // SIGHUP, hand the listening socket to a new process
+} signal_action_t;
+
+// Event loop poll() slots, the timer is not used with the char device, the
+// UNIX socket only with -u and the handoff channel only after a reload,
+// until the previous process exits
+enum { POLL_LISTEN, POLL_SIGNAL, POLL_UNIX, POLL_TIMER, POLL_HANDOFF };
+
+#if defined(USE_AESD_CHAR_DEVICE)
 #define FILE "/dev/aesdchar"
+#elif defined(USE_AESD_RING_HISTORY)
+// History is kept in process, see history.c
+#include "history.h"
 #else
+#define USE_AESD_DATA_FILE
 #define FILE "/var/tmp/aesdsocketdata"
 #endif
 
 #define IO_SEEKTO "AESDCHAR_IOCSEEKTO"
 
+/*
+ * Most recently formatted timestamp record, owned by the event loop
+ */
 typedef struct {
+    time_t sec;
+    int len;
+    char text[100];
+} timestamp_cache_t;
+
+typedef struct thread_data {
     int file_fd;
     int client_fd;
-    char *client_ip;
+    char client_ip[INET_ADDRSTRLEN];
+    char *buf;                              // I/O buffer from the buffer pool
+    size_t buf_size;
+    char *outq;                             // Outbound queue from the outq pool
+    size_t outq_head;                       // Unsent bytes are outq[head, head + len)
+    size_t outq_len;
+    bool replaying;                         // Reply not yet fully queued
+    bool replay_direct;                     // Rest of the reply skips outq, see reply_send()
+    int send_flags;                         // For reply_send(), MSG_ZEROCOPY for large replies
+    bool zerocopy_armed;                    // SO_ZEROCOPY is set, completions may be queued
+    bool zerocopy_failed;                   // Not supported, or the kernel copies anyway
+    uint64_t reply_start_ns;                // 0 when no reply is in flight
+    size_t replayed;
+    int proto;                              // proto_mode_t, see proto.h
+    size_t in_len;                          // Buffered request bytes in buf
+    bool mid_line;                          // Text input continues a line stored in part
+    bool local;                             // Accepted on the UNIX socket, may use shm.h
     pthread_t tid;
     bool thread_complete_success;
+    int handle;                             // Slot in the connection table
+    struct thread_data *next_completed;     // Link in the completed stack
+    bool traced;                            // Sampled for latency tracing, see trace.h
+#ifdef USE_AESD_RING_HISTORY
+    history_pending_t pending;
+    size_t fpos;
+#endif
+#ifdef USE_AESD_DATA_FILE
+    off_t replay_pos;                       // Next offset to replay
+    off_t replay_end;                       // Log end when the reply started
+    bool replay_skip_partial;               // Replay window starts mid packet
+    off_t seek_pos;                         // Next reply starts here, set by seekto, -1 if unset
+#endif
 } thread_data_t;
 
 #endif
\ No newline at end of file
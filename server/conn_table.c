@@ -0,0 +1,145 @@
+#include <stdlib.h>
+
+#include "conn_table.h"
+
+// Link slots [from, to) into the free list in ascending order
+static void conn_table_link_free(conn_table_t *table, int from, int to) {
+    int i;
+
+    for (i = to - 1; i >= from; i--) {
+        table->slots[i].value = NULL;
+        table->slots[i].dense_index = -1;
+        table->slots[i].next_free = table->free_head;
+        table->free_head = i;
+    }
+}
+
+static int conn_table_grow(conn_table_t *table) {
+    int capacity = table->capacity * 2;
+    conn_slot_t *slots;
+    conn_entry_t *live;
+
+    slots = realloc(table->slots, capacity * sizeof(conn_slot_t));
+    if (!slots)
+        return -1;
+    table->slots = slots;
+
+    live = realloc(table->live, capacity * sizeof(conn_entry_t));
+    if (!live)
+        return -1;
+    table->live = live;
+
+    conn_table_link_free(table, table->capacity, capacity);
+    table->capacity = capacity;
+
+    return 0;
+}
+
+conn_table_t *conn_table_init(int capacity) {
+    conn_table_t *table;
+
+    if (capacity < 1)
+        capacity = 1;
+
+    table = malloc(sizeof(conn_table_t));
+    if (!table)
+        return NULL;
+
+    table->slots = malloc(capacity * sizeof(conn_slot_t));
+    table->live = malloc(capacity * sizeof(conn_entry_t));
+    if (!table->slots || !table->live) {
+        free(table->slots);
+        free(table->live);
+        free(table);
+        return NULL;
+    }
+
+    table->capacity = capacity;
+    table->size = 0;
+    table->free_head = -1;
+    conn_table_link_free(table, 0, capacity);
+
+    return table;
+}
+
+/*
+ * Frees the table only, values are owned by the caller
+ */
+void conn_table_destroy(conn_table_t *table) {
+    if (!table)
+        return;
+
+    free(table->slots);
+    free(table->live);
+    free(table);
+}
+
+/*
+ * @return the handle for @param value, or -1 if the table could not grow
+ */
+int conn_table_insert(conn_table_t *table, void *value) {
+    int handle;
+
+    if (!table)
+        return -1;
+
+    if (table->free_head < 0 && conn_table_grow(table) != 0)
+        return -1;
+
+    handle = table->free_head;
+    table->free_head = table->slots[handle].next_free;
+
+    table->slots[handle].value = value;
+    table->slots[handle].dense_index = table->size;
+    table->slots[handle].next_free = -1;
+
+    table->live[table->size].handle = handle;
+    table->live[table->size].value = value;
+    (table->size)++;
+
+    return handle;
+}
+
+/*
+ * @return the value stored at @param handle, or NULL if the handle is not live
+ */
+void *conn_table_remove(conn_table_t *table, int handle) {
+    conn_entry_t *last;
+    void *value;
+    int dense_index;
+
+    if (!table || handle < 0 || handle >= table->capacity)
+        return NULL;
+
+    dense_index = table->slots[handle].dense_index;
+    if (dense_index < 0)
+        return NULL;
+
+    value = table->slots[handle].value;
+
+    // Move the last live entry into the hole
+    last = &table->live[table->size - 1];
+    table->live[dense_index] = *last;
+    table->slots[last->handle].dense_index = dense_index;
+    (table->size)--;
+
+    table->slots[handle].value = NULL;
+    table->slots[handle].dense_index = -1;
+    table->slots[handle].next_free = table->free_head;
+    table->free_head = handle;
+
+    return value;
+}
+
+void *conn_table_get(conn_table_t *table, int handle) {
+    if (!table || handle < 0 || handle >= table->capacity)
+        return NULL;
+    if (table->slots[handle].dense_index < 0)
+        return NULL;
+    return table->slots[handle].value;
+}
+
+int conn_table_size(conn_table_t *table) {
+    if (!table) return -1;
+    return table->size;
+}
@@ -0,0 +1,51 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+/*
+ * Connection table: values are addressed by a small integer handle.
+ *
+ * Slots are preallocated and recycled through a free list, so insert and
+ * remove are O(1).  Live entries are also kept packed in a dense array
+ * (removal swaps the last live entry into the hole), so iterating over live
+ * connections touches only contiguous memory and costs O(live), not
+ * O(capacity).
+ */
+
+typedef struct {
+    int handle;
+    void *value;
+} conn_entry_t;
+
+typedef struct {
+    void *value;
+    int dense_index;    // index into live[], -1 when the slot is free
+    int next_free;      // next slot in the free list, -1 terminates
+} conn_slot_t;
+
+typedef struct conn_table {
+    conn_slot_t *slots;
+    conn_entry_t *live;
+    int capacity;
+    int size;
+    int free_head;
+} conn_table_t;
+
+conn_table_t *conn_table_init(int capacity);
+void conn_table_destroy(conn_table_t *table);
+int conn_table_insert(conn_table_t *table, void *value);
+void *conn_table_remove(conn_table_t *table, int handle);
+void *conn_table_get(conn_table_t *table, int handle);
+int conn_table_size(conn_table_t *table);
+
+/*
+ * Iterate over live entries, newest dense position first.  Iterating
+ * backwards makes it safe to conn_table_remove() the current entry.
+ * @param index is an int used by the macro for the dense position
+ * @param entry is a conn_entry_t * set to the current entry
+ */
+#define CONN_TABLE_FOREACH(table, index, entry) \
+    for ((index) = (table)->size - 1; \
+         (index) >= 0 && ((entry) = &(table)->live[(index)], 1); \
+         (index)--)
+
+#endif
@@ -0,0 +1,1061 @@
+#define _GNU_SOURCE     // memrchr(), mremap()
+/*
+ * Append only packet log behind the default build (USE_AESD_DATA_FILE).
+ *
+ * The log is a series of segment files. The newest is appended to at the
+ * configured path, as the single data file used to be. Once a line takes it
+ * past the segment size it is sealed: renamed to "<path>.<base>", where base
+ * is the logical offset of its first byte, and a new empty one takes its
+ * place. Segments always end on a newline. Logical offsets keep counting
+ * from the start of the log, so positions handed out stay valid when old
+ * segments are dropped by retention.
+ *
+ * Every segment has a sparse index holding the offset of every
+ * DATAFILE_INDEX_INTERVAL-th line. A seekto binary searches the segments by
+ * line number, jumps to the index entry at or before the line and scans at
+ * most DATAFILE_INDEX_INTERVAL lines from there. As in the driver,
+ * write_cmd 0 is the oldest line still retained.
+ *
+ * Appends are serialized by append_lock so records land whole and in a
+ * single order. The segment table is guarded by table_lock: readers hold it
+ * shared while they use a segment's descriptor, sealing and retention take
+ * it exclusively. Line counts and index entries are guarded by index_lock.
+ *
+ * How appends are made durable depends on the sync mode:
+ *
+ * DATAFILE_SYNC_LINE commits in groups. A writer whose append ends a line
+ * waits until durable covers it. The first one to find no fdatasync() in
+ * flight runs one for everything appended so far, the others wait for it,
+ * so concurrent clients share syncs instead of queueing one each.
+ *
+ * DATAFILE_SYNC_PERIODIC runs the same sync from a thread every interval,
+ * so at most one interval of packets can be lost.
+ *
+ * In both modes a segment is synced before it is sealed, so syncing the
+ * newest segment covers everything. A failed fdatasync() is sticky. The
+ * kernel may already have dropped the dirty pages, so a later successful
+ * sync would not mean the data is safe.
+ *
+ * With config.map every segment is also mapped read only, so replies are
+ * copied or send() straight from the page cache. The newest segment is
+ * mapped a segment size past its end, so appends rarely outgrow it. Growing
+ * it takes table_lock exclusively since mremap() may move it. Readers only
+ * use the mapping under the shared lock, and read anything past it from the
+ * file instead.
+ *
+ * Segments left by a previous run are indexed on open. With recovery the
+ * newest is first cut back to its last newline, dropping a packet torn by
+ * a crash mid append.
+ *
+ * During a reload both processes append to the newest segment until the
+ * old one has drained, so neither seals or drops segments meanwhile. The
+ * old one detaches when it hands off. The new one starts detached, indexes
+ * the old one's appends when it finds them ahead of its own, and attaches
+ * once the old one has exited, catching up with whatever it appended last.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "datafile.h"
+#include "metrics.h"
+
+#define DATAFILE_SCAN_CHUNK 4096
+
+typedef struct {
+    long long base;             // Logical offset of the first byte
+    long long first_line;       // Lines in the segments before it
+    atomic_llong size;
+    long long lines;            // Complete lines, index_lock
+    long long *index;           // index[k] is the offset of line k * DATAFILE_INDEX_INTERVAL
+    size_t nindex;              // index_lock
+    size_t index_cap;
+    bool index_full;            // An index entry could not be stored, stop adding any
+    time_t sealed;              // 0 while it is the newest segment
+    int fd;
+    char *map;                  // NULL unless config.map, table_lock
+    size_t map_len;
+} segment_t;
+
+static char *log_path;
+static int dir_fd = -1;
+static datafile_config_t config = DATAFILE_CONFIG_DEFAULT;
+
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+static segment_t *active;               // append_lock, and table_lock to change
+static atomic_llong appended;           // Logical end of the log
+static atomic_bool detached;
+
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static segment_t **segments;            // Oldest first, the last one is active
+static size_t nsegments;
+static size_t segments_cap;
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t synced = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wake;             // Syncer thread, CLOCK_MONOTONIC
+static long long durable;               // Logical offset known to be on disk
+static bool syncing;
+static int sync_error;
+static bool stopping;
+static pthread_t syncer;
+static bool syncer_running;
+
+int datafile_parse_sync(const char *arg, datafile_sync_t *mode, int *interval_ms)
+{
+    char *end;
+    long ms;
+
+    if (strcmp(arg, "none") == 0)
+    {
+        *mode = DATAFILE_SYNC_NONE;
+        return 0;
+    }
+    if (strcmp(arg, "line") == 0)
+    {
+        *mode = DATAFILE_SYNC_LINE;
+        return 0;
+    }
+    if (strncmp(arg, "periodic", 8) == 0 && (arg[8] == '\0' || arg[8] == ':'))
+    {
+        *mode = DATAFILE_SYNC_PERIODIC;
+        *interval_ms = DATAFILE_SYNC_INTERVAL_MS;
+        if (arg[8] == ':')
+        {
+            ms = strtol(arg + 9, &end, 10);
+            if (*end != '\0' || ms <= 0 || ms > 3600 * 1000)
+                return -1;
+            *interval_ms = ms;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+int datafile_parse_send(const char *arg, datafile_send_t *mode, size_t *zerocopy_min)
+{
+    char *end;
+    long long bytes;
+
+    if (strcmp(arg, "read") == 0)
+    {
+        *mode = DATAFILE_SEND_READ;
+        return 0;
+    }
+    if (strcmp(arg, "sendfile") == 0)
+    {
+        *mode = DATAFILE_SEND_SENDFILE;
+        return 0;
+    }
+    if (strncmp(arg, "mmap", 4) == 0 && (arg[4] == '\0' || arg[4] == ':'))
+    {
+        *mode = DATAFILE_SEND_MMAP;
+        *zerocopy_min = DATAFILE_ZEROCOPY_MIN;
+        if (arg[4] == ':')
+        {
+            bytes = strtoll(arg + 5, &end, 0);
+            if (*end != '\0' || bytes < 0)
+                return -1;
+            *zerocopy_min = bytes;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static void sealed_path(char *buf, size_t size, long long base)
+{
+    snprintf(buf, size, "%s.%lld", log_path, base);
+}
+
+static segment_t *segment_new(long long base, long long first_line, int fd)
+{
+    segment_t *seg = calloc(1, sizeof(*seg));
+
+    if (!seg)
+        return NULL;
+    seg->index_cap = 64;
+    seg->index = malloc(seg->index_cap * sizeof(*seg->index));
+    if (!seg->index)
+    {
+        free(seg);
+        return NULL;
+    }
+    seg->base = base;
+    seg->first_line = first_line;
+    seg->index[0] = 0;
+    seg->nindex = 1;
+    seg->fd = fd;
+    return seg;
+}
+
+/*
+ * Map at least the first @param len bytes of the segment, called with
+ * table_lock held exclusively or before the segment is in the table.
+ * Reads past the mapping go to the file, so a failure only costs speed.
+ */
+static void segment_map(segment_t *seg, size_t len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    void *map;
+
+    len = (len + page) / page * page;
+    if (seg->map)
+        map = mremap(seg->map, seg->map_len, len, MREMAP_MAYMOVE);
+    else
+        map = mmap(NULL, len, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        syslog(LOG_ERR, "Failed to map data file segment - %s", strerror(errno));
+        return;
+    }
+    seg->map = map;
+    seg->map_len = len;
+}
+
+static void segment_free(segment_t *seg)
+{
+    if (seg->map)
+        munmap(seg->map, seg->map_len);
+    if (seg->fd >= 0)
+        close(seg->fd);
+    free(seg->index);
+    free(seg);
+}
+
+/*
+ * Count the lines in @param buf, which was written at offset @param at of
+ * the segment, and index every DATAFILE_INDEX_INTERVAL-th line start
+ */
+static void segment_index(segment_t *seg, const char *buf, size_t len, long long at)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *nl;
+    long long *grown;
+
+    pthread_mutex_lock(&index_lock);
+    while ((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        seg->lines++;
+        p = nl + 1;
+        if (seg->lines % DATAFILE_INDEX_INTERVAL != 0 || seg->index_full)
+            continue;
+
+        if (seg->nindex == seg->index_cap)
+        {
+            grown = realloc(seg->index, 2 * seg->index_cap * sizeof(*seg->index));
+            if (!grown)
+            {
+                // Seeks past the last entry scan further instead
+                syslog(LOG_ERR, "Data file index full, seekto slows down");
+                seg->index_full = true;
+                continue;
+            }
+            seg->index = grown;
+            seg->index_cap *= 2;
+        }
+        seg->index[seg->nindex++] = at + (p - buf);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+/*
+ * Index bytes [@param from, @param to) of a segment already on disk
+ */
+static int segment_scan(segment_t *seg, long long from, long long to)
+{
+    char chunk[DATAFILE_SCAN_CHUNK];
+    size_t len;
+    ssize_t n;
+
+    while (from < to)
+    {
+        len = (to - from < (long long)sizeof(chunk)) ? (size_t)(to - from) : sizeof(chunk);
+        n = pread(seg->fd, chunk, len, from);
+        if (n <= 0)
+            return -1;
+        segment_index(seg, chunk, n, from);
+        from += n;
+    }
+    return 0;
+}
+
+static int table_push(segment_t *seg)
+{
+    segment_t **grown;
+
+    if (nsegments == segments_cap)
+    {
+        grown = realloc(segments, (segments_cap ? 2 * segments_cap : 16) * sizeof(*segments));
+        if (!grown)
+            return -1;
+        segments = grown;
+        segments_cap = segments_cap ? 2 * segments_cap : 16;
+    }
+    segments[nsegments++] = seg;
+    return 0;
+}
+
+/*
+ * Index of the last segment starting at or before logical offset @param pos,
+ * called with table_lock held
+ */
+static size_t table_find_offset(long long pos)
+{
+    size_t lo = 0;
+    size_t hi = nsegments;
+    size_t mid;
+
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (segments[mid]->base <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Make every byte up to logical offset @param end durable, sharing a sync
+ * with any other writer waiting at the same time
+ */
+static int datafile_sync_to(long long end)
+{
+    uint64_t start_ns;
+    long long target;
+    int rc = 0;
+
+    pthread_mutex_lock(&sync_lock);
+    while (durable < end && sync_error == 0)
+    {
+        if (syncing)
+        {
+            pthread_cond_wait(&synced, &sync_lock);
+            continue;
+        }
+
+        syncing = true;
+        target = atomic_load(&appended);
+        pthread_mutex_unlock(&sync_lock);
+
+        // Older segments were synced when they were sealed
+        start_ns = metrics_now_ns();
+        pthread_rwlock_rdlock(&table_lock);
+        rc = fdatasync(active->fd);
+        pthread_rwlock_unlock(&table_lock);
+        metrics_observe_ns(METRIC_STORAGE_SYNC_SECONDS, metrics_now_ns() - start_ns);
+
+        pthread_mutex_lock(&sync_lock);
+        syncing = false;
+        if (rc == 0)
+        {
+            if (target > durable)
+                durable = target;
+        }
+        else
+        {
+            sync_error = errno;
+            syslog(LOG_ERR, "Data file sync failed, packets may be lost - %s", strerror(errno));
+        }
+        pthread_cond_broadcast(&synced);
+    }
+    if (durable < end)
+    {
+        errno = sync_error;
+        rc = -1;
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return rc;
+}
+
+int datafile_sync(void)
+{
+    return datafile_sync_to(atomic_load(&appended));
+}
+
+static void *syncer_thread(void *arg)
+{
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&sync_lock);
+    while (!stopping)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += config.sync_interval_ms / 1000;
+        deadline.tv_nsec += (config.sync_interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!stopping && pthread_cond_timedwait(&wake, &sync_lock, &deadline) != ETIMEDOUT)
+            ;
+        if (stopping)
+            break;
+
+        pthread_mutex_unlock(&sync_lock);
+        datafile_sync();
+        pthread_mutex_lock(&sync_lock);
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return NULL;
+}
+
+/*
+ * Drop the oldest segments past the configured size or age. The newest
+ * segment is never dropped.
+ */
+void datafile_retain(void)
+{
+    char path[PATH_MAX];
+    segment_t *oldest;
+    long long total;
+    time_t now = time(NULL);
+
+    if (atomic_load(&detached) || (config.retain_bytes == 0 && config.retain_seconds == 0))
+        return;
+
+    while (true)
+    {
+        pthread_rwlock_wrlock(&table_lock);
+        if (nsegments < 2)
+        {
+            pthread_rwlock_unlock(&table_lock);
+            break;
+        }
+        oldest = segments[0];
+        total = atomic_load(&appended) - oldest->base;
+        if (!((config.retain_bytes > 0 && total > config.retain_bytes) ||
+              (config.retain_seconds > 0 && now - oldest->sealed > config.retain_seconds)))
+        {
+            pthread_rwlock_unlock(&table_lock);
+            break;
+        }
+        memmove(segments, segments + 1, (nsegments - 1) * sizeof(*segments));
+        nsegments--;
+        pthread_rwlock_unlock(&table_lock);
+
+        sealed_path(path, sizeof(path), oldest->base);
+        syslog(LOG_INFO, "Dropping data file segment %s", path);
+        if (unlink(path) != 0)
+            syslog(LOG_ERR, "Failed to remove %s - %s", path, strerror(errno));
+        segment_free(oldest);
+    }
+}
+
+/*
+ * Seal the newest segment and start a new one, called with append_lock
+ * held once a line took the segment past the configured size
+ */
+static int datafile_rotate(void)
+{
+    char path[PATH_MAX];
+    segment_t *seg;
+    long long size = atomic_load(&active->size);
+    int rc;
+
+    // The next syncs only cover the new segment
+    if (config.sync != DATAFILE_SYNC_NONE && fdatasync(active->fd) != 0)
+    {
+        syslog(LOG_ERR, "Failed to sync data file segment - %s", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    seg = segment_new(active->base + size, active->first_line + active->lines, -1);
+    pthread_mutex_unlock(&index_lock);
+    if (!seg)
+        return -1;
+
+    sealed_path(path, sizeof(path), active->base);
+    if (rename(log_path, path) != 0)
+    {
+        syslog(LOG_ERR, "Failed to seal data file segment %s - %s", path, strerror(errno));
+        segment_free(seg);
+        return -1;
+    }
+    seg->fd = open(log_path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 0644);
+    if (seg->fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to open file %s - %s", log_path, strerror(errno));
+        if (rename(path, log_path) != 0)
+            syslog(LOG_ERR, "Failed to restore %s - %s", log_path, strerror(errno));
+        segment_free(seg);
+        return -1;
+    }
+    if (config.sync != DATAFILE_SYNC_NONE)
+        fsync(dir_fd);
+    if (config.map)
+        segment_map(seg, config.segment_size);
+
+    pthread_rwlock_wrlock(&table_lock);
+    rc = table_push(seg);
+    if (rc == 0)
+    {
+        // Give back the room it was mapped with to grow
+        if (active->map)
+            segment_map(active, size);
+        active->sealed = time(NULL);
+        active = seg;
+    }
+    pthread_rwlock_unlock(&table_lock);
+    if (rc != 0)
+    {
+        // Carry on appending to the sealed file under its new name
+        syslog(LOG_ERR, "Failed to grow the segment table");
+        unlink(log_path);
+        rename(path, log_path);
+        segment_free(seg);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Sealed data file segment %s", path);
+    datafile_retain();
+    return 0;
+}
+
+/*
+ * Cut the file back to just after its last newline. Returns the new size.
+ */
+static off_t datafile_recover(int fd)
+{
+    char chunk[DATAFILE_SCAN_CHUNK];
+    off_t size = lseek(fd, 0, SEEK_END);
+    off_t pos = size;
+    off_t keep = 0;
+    size_t len;
+    ssize_t n;
+    char *nl;
+
+    if (size < 0)
+        return -1;
+
+    while (pos > 0)
+    {
+        len = (pos < (off_t)sizeof(chunk)) ? (size_t)pos : sizeof(chunk);
+        pos -= len;
+        n = pread(fd, chunk, len, pos);
+        if (n != (ssize_t)len)
+            return -1;
+        if ((nl = memrchr(chunk, '\n', len)) != NULL)
+        {
+            keep = pos + (nl - chunk) + 1;
+            break;
+        }
+    }
+
+    if (keep < size)
+    {
+        syslog(LOG_WARNING, "Dropping %lld bytes of an incomplete packet from the data file",
+               (long long)(size - keep));
+        if (ftruncate(fd, keep) != 0 || fdatasync(fd) != 0)
+            return -1;
+    }
+    syslog(LOG_INFO, "Recovered %lld bytes of packets", (long long)keep);
+    return keep;
+}
+
+static int compare_base(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Index the sealed segments a previous run left next to the data file
+ */
+static int datafile_load_sealed(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    size_t name_len = strlen(name);
+    long long *bases = NULL;
+    long long *grown;
+    size_t nbases = 0;
+    size_t cap = 0;
+    long long first_line = 0;
+    struct dirent *de;
+    struct stat st;
+    segment_t *seg;
+    char *end;
+    size_t i;
+    DIR *d;
+    int fd;
+
+    if ((d = opendir(dir)) == NULL)
+        return -1;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (strncmp(de->d_name, name, name_len) != 0 || de->d_name[name_len] != '.' ||
+            de->d_name[name_len + 1] < '0' || de->d_name[name_len + 1] > '9')
+            continue;
+        if (nbases == cap)
+        {
+            cap = cap ? 2 * cap : 16;
+            grown = realloc(bases, cap * sizeof(*bases));
+            if (!grown)
+                break;
+            bases = grown;
+        }
+        bases[nbases] = strtoll(de->d_name + name_len + 1, &end, 10);
+        if (*end == '\0')
+            nbases++;
+    }
+    closedir(d);
+    qsort(bases, nbases, sizeof(*bases), compare_base);
+
+    for (i = 0; i < nbases; i++)
+    {
+        sealed_path(path, sizeof(path), bases[i]);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            syslog(LOG_ERR, "Failed to open data file segment %s - %s", path, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        seg = segment_new(bases[i], first_line, fd);
+        if (!seg)
+        {
+            close(fd);
+            free(bases);
+            return -1;
+        }
+        seg->sealed = st.st_mtime;
+        atomic_store(&seg->size, st.st_size);
+        if (config.map)
+            segment_map(seg, st.st_size);
+        if (segment_scan(seg, 0, st.st_size) != 0 || table_push(seg) != 0)
+        {
+            segment_free(seg);
+            free(bases);
+            return -1;
+        }
+        first_line += seg->lines;
+    }
+    free(bases);
+    return 0;
+}
+
+/*
+ * Open the log at @param path, indexing the segments already there.
+ * Without config->recover the newest segment is used as found.
+ */
+int datafile_open(const char *path, const datafile_config_t *cfg)
+{
+    pthread_condattr_t attr;
+    const char *slash = strrchr(path, '/');
+    char dir[PATH_MAX];
+    segment_t *last;
+    long long base = 0;
+    long long first_line = 0;
+    off_t size;
+    int fd;
+
+    config = *cfg;
+    log_path = strdup(path);
+    if (!log_path)
+        return -1;
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) + (slash == path) : 1, slash ? path : ".");
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0 || datafile_load_sealed(dir, slash ? slash + 1 : path) != 0)
+    {
+        syslog(LOG_ERR, "Failed to load data file segments in %s - %s", dir, strerror(errno));
+        datafile_close(false);
+        return -1;
+    }
+
+    fd = open(path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to open file %s - %s", path, strerror(errno));
+        datafile_close(false);
+        return -1;
+    }
+    size = config.recover ? datafile_recover(fd) : lseek(fd, 0, SEEK_END);
+    if (size < 0)
+    {
+        syslog(LOG_ERR, "Failed to recover file %s - %s", path, strerror(errno));
+        close(fd);
+        datafile_close(false);
+        return -1;
+    }
+
+    if (nsegments > 0)
+    {
+        last = segments[nsegments - 1];
+        base = last->base + atomic_load(&last->size);
+        first_line = last->first_line + last->lines;
+    }
+    active = segment_new(base, first_line, fd);
+    if (!active)
+    {
+        close(fd);
+        datafile_close(false);
+        return -1;
+    }
+    if (config.map)
+        segment_map(active, size + config.segment_size);
+    if (segment_scan(active, 0, size) != 0 || table_push(active) != 0)
+    {
+        segment_free(active);
+        active = NULL;
+        datafile_close(false);
+        return -1;
+    }
+    atomic_store(&active->size, size);
+    atomic_store(&appended, base + size);
+    atomic_store(&detached, false);
+    durable = 0;
+    sync_error = 0;
+
+    if (config.sync == DATAFILE_SYNC_PERIODIC)
+    {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&wake, &attr);
+        pthread_condattr_destroy(&attr);
+        stopping = false;
+        if (pthread_create(&syncer, NULL, syncer_thread, NULL) != 0)
+        {
+            syslog(LOG_ERR, "Failed to start the data file sync thread");
+            pthread_cond_destroy(&wake);
+            datafile_close(false);
+            return -1;
+        }
+        syncer_running = true;
+    }
+    return 0;
+}
+
+/*
+ * Account for the newest segment having grown to @param pos bytes, called
+ * with append_lock held
+ */
+static void datafile_extend(off_t pos)
+{
+    atomic_store(&active->size, pos);
+    atomic_store(&appended, active->base + pos);
+    if (active->map && (size_t)pos > active->map_len)
+    {
+        pthread_rwlock_wrlock(&table_lock);
+        segment_map(active, pos + config.segment_size);
+        pthread_rwlock_unlock(&table_lock);
+    }
+}
+
+/*
+ * Append a record. In DATAFILE_SYNC_LINE mode an append ending a line only
+ * returns once the line is on disk, and fails if it can't be made durable.
+ */
+ssize_t datafile_append(const char *buf, size_t len)
+{
+    ssize_t rc;
+    long long at;
+    long long end;
+    off_t pos;
+
+    pthread_mutex_lock(&append_lock);
+    at = atomic_load(&active->size);
+    rc = write(active->fd, buf, len);
+    if (rc > 0)
+    {
+        // O_APPEND leaves the offset at the end of this write
+        pos = lseek(active->fd, 0, SEEK_CUR);
+        if (pos < at + rc)
+            pos = at + rc;
+        if (pos > at + rc)
+            segment_scan(active, at, pos - rc);     // Appended by the process we replaced
+        segment_index(active, buf, rc, pos - rc);
+        datafile_extend(pos);
+
+        if (pos >= config.segment_size && rc == (ssize_t)len && buf[len - 1] == '\n' &&
+            !atomic_load(&detached))
+            datafile_rotate();
+    }
+    end = atomic_load(&appended);
+    pthread_mutex_unlock(&append_lock);
+
+    if (config.sync == DATAFILE_SYNC_LINE && rc == (ssize_t)len && len > 0 &&
+        buf[len - 1] == '\n' && datafile_sync_to(end) != 0)
+        return -1;
+    return rc;
+}
+
+off_t datafile_start(void)
+{
+    off_t start;
+
+    pthread_rwlock_rdlock(&table_lock);
+    start = nsegments ? segments[0]->base : 0;
+    pthread_rwlock_unlock(&table_lock);
+    return start;
+}
+
+off_t datafile_end(void)
+{
+    return atomic_load(&appended);
+}
+
+/*
+ * Segment holding logical offset *@param pos, with *@param len cut to the
+ * bytes it has from there. A position before the oldest retained byte or in
+ * a gap left by a failed segment moves up to the next one. NULL at the end
+ * of the log. Called with table_lock held.
+ */
+static segment_t *table_find_read(off_t *pos, size_t *len)
+{
+    segment_t *seg;
+    long long size;
+    size_t i;
+
+    if (nsegments > 0 && *pos < segments[0]->base)
+        *pos = segments[0]->base;
+    for (i = nsegments ? table_find_offset(*pos) : 0; i < nsegments; i++)
+    {
+        seg = segments[i];
+        size = atomic_load(&seg->size);
+        if (*pos < seg->base)
+            *pos = seg->base;
+        if (*pos >= seg->base + size)
+            continue;
+        if ((long long)*len > seg->base + size - *pos)
+            *len = seg->base + size - *pos;
+        return seg;
+    }
+    return NULL;
+}
+
+/*
+ * Read from logical offset *@param pos, which is advanced past what was
+ * read. A position before the oldest retained byte moves up to it. Short
+ * at segment ends, 0 at the end of the log.
+ */
+ssize_t datafile_read(off_t *pos, char *buf, size_t len)
+{
+    segment_t *seg;
+    size_t off;
+    ssize_t n = 0;
+
+    pthread_rwlock_rdlock(&table_lock);
+    if ((seg = table_find_read(pos, &len)) != NULL)
+    {
+        off = *pos - seg->base;
+        if (seg->map && off + len <= seg->map_len)
+        {
+            memcpy(buf, seg->map + off, len);
+            n = len;
+        }
+        else
+        {
+            n = pread(seg->fd, buf, len, off);
+        }
+        if (n > 0)
+            *pos += n;
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return n;
+}
+
+/*
+ * Send up to @param len bytes from logical offset *@param pos to
+ * @param sockfd as datafile_read() would read them, without copying them
+ * through a buffer. DATAFILE_SEND_MMAP send()s from the mapping with
+ * @param flags, which may include MSG_ZEROCOPY since segments never change
+ * under the pages, and falls back to sendfile() past it. Returns what the
+ * socket took, 0 at the end of the log.
+ */
+ssize_t datafile_send(int sockfd, off_t *pos, size_t len, datafile_send_t mode, int flags)
+{
+    segment_t *seg;
+    off_t off;
+    ssize_t n = 0;
+
+    pthread_rwlock_rdlock(&table_lock);
+    if ((seg = table_find_read(pos, &len)) != NULL)
+    {
+        off = *pos - seg->base;
+        if (mode == DATAFILE_SEND_MMAP && seg->map && off + len <= seg->map_len)
+            n = send(sockfd, seg->map + off, len, flags);
+        else
+            n = sendfile(sockfd, seg->fd, &off, len);
+        if (n > 0)
+            *pos += n;
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return n;
+}
+
+/*
+ * Resolve an AESDCHAR_IOCSEEKTO position to a logical offset, -1 if it is
+ * not in the retained log. The offset may point at the record's newline.
+ */
+off_t datafile_seek(unsigned int write_cmd, unsigned int write_cmd_offset)
+{
+    char chunk[DATAFILE_SCAN_CHUNK];
+    segment_t *seg = NULL;
+    long long line;
+    long long skip;
+    long long pos;
+    long long line_start;
+    off_t result = -1;
+    size_t lo, hi, mid, k;
+    ssize_t n;
+    char *p;
+    char *nl;
+
+    pthread_rwlock_rdlock(&table_lock);
+    if (nsegments == 0)
+        goto out;
+    line = segments[0]->first_line + write_cmd;
+
+    // Last segment whose first line is at or before the line
+    lo = 0;
+    hi = nsegments;
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (segments[mid]->first_line <= line)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    seg = segments[lo];
+
+    pthread_mutex_lock(&index_lock);
+    skip = line - seg->first_line;
+    if (skip >= seg->lines)
+    {
+        pthread_mutex_unlock(&index_lock);
+        goto out;
+    }
+    k = skip / DATAFILE_INDEX_INTERVAL;
+    if (k >= seg->nindex)
+        k = seg->nindex - 1;
+    pos = seg->index[k];
+    skip -= (long long)k * DATAFILE_INDEX_INTERVAL;
+    pthread_mutex_unlock(&index_lock);
+
+    // Skip to the line's start, then find its newline
+    line_start = (skip == 0) ? pos : -1;
+    while (true)
+    {
+        n = pread(seg->fd, chunk, sizeof(chunk), pos);
+        if (n <= 0)
+            goto out;
+        p = chunk;
+        while ((nl = memchr(p, '\n', chunk + n - p)) != NULL)
+        {
+            if (skip == 0)
+            {
+                if (write_cmd_offset <= pos + (nl - chunk) - line_start)
+                    result = seg->base + line_start + write_cmd_offset;
+                goto out;
+            }
+            if (--skip == 0)
+                line_start = pos + (nl - chunk) + 1;
+            p = nl + 1;
+        }
+        pos += n;
+    }
+
+out:
+    pthread_rwlock_unlock(&table_lock);
+    return result;
+}
+
+/*
+ * Stop sealing and dropping segments while another process appends to the
+ * newest one: the process started by a reload once we hand off, or the
+ * one we replaced until it has drained.
+ */
+void datafile_detach(void)
+{
+    atomic_store(&detached, true);
+}
+
+/*
+ * Own the segments again once the process we replaced has exited. Its last
+ * appends may not have been followed by one of ours, index them first.
+ */
+void datafile_attach(void)
+{
+    long long at;
+    off_t pos;
+
+    pthread_mutex_lock(&append_lock);
+    at = atomic_load(&active->size);
+    pos = lseek(active->fd, 0, SEEK_END);
+    if (pos > at && segment_scan(active, at, pos) == 0)
+        datafile_extend(pos);
+    atomic_store(&detached, false);
+    pthread_mutex_unlock(&append_lock);
+}
+
+/*
+ * Stop the sync thread, make whatever is left durable and close every
+ * segment, removing them with @param remove_files
+ */
+void datafile_close(bool remove_files)
+{
+    char path[PATH_MAX];
+    segment_t *seg;
+    size_t i;
+
+    if (syncer_running)
+    {
+        pthread_mutex_lock(&sync_lock);
+        stopping = true;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&sync_lock);
+        pthread_join(syncer, NULL);
+        pthread_cond_destroy(&wake);
+        syncer_running = false;
+    }
+    if (active && config.sync != DATAFILE_SYNC_NONE)
+        datafile_sync();
+
+    for (i = 0; i < nsegments; i++)
+    {
+        seg = segments[i];
+        if (remove_files)
+        {
+            if (seg == active)
+                snprintf(path, sizeof(path), "%s", log_path);
+            else
+                sealed_path(path, sizeof(path), seg->base);
+            unlink(path);
+        }
+        segment_free(seg);
+    }
+    free(segments);
+    segments = NULL;
+    nsegments = segments_cap = 0;
+    active = NULL;
+
+    if (dir_fd >= 0)
+        close(dir_fd);
+    dir_fd = -1;
+    free(log_path);
+    log_path = NULL;
+}
@@ -0,0 +1,62 @@
+#ifndef DATAFILE_H
+#define DATAFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define DATAFILE_SYNC_INTERVAL_MS 1000  // Default period of DATAFILE_SYNC_PERIODIC, see -f
+#define DATAFILE_SEGMENT_SIZE (16 * 1024 * 1024)    // Default segment size, see -z
+#define DATAFILE_MIN_SEGMENT_SIZE 4096
+#define DATAFILE_INDEX_INTERVAL 64      // Lines between sparse index entries
+#define DATAFILE_ZEROCOPY_MIN (1024 * 1024) // Default smallest reply sent with MSG_ZEROCOPY, see -Y
+
+/*
+ * When appended packets reach the disk
+ */
+typedef enum {
+    DATAFILE_SYNC_NONE,     // Whenever the kernel writes them back
+    DATAFILE_SYNC_PERIODIC, // One fdatasync() per interval covers every append since the last
+    DATAFILE_SYNC_LINE      // A newline terminated append returns once it is on disk
+} datafile_sync_t;
+
+/*
+ * How replies are read out of the log
+ */
+typedef enum {
+    DATAFILE_SEND_READ,     // Copied into the outbound queue with pread()
+    DATAFILE_SEND_MMAP,     // send() straight from the mapped segments
+    DATAFILE_SEND_SENDFILE  // sendfile() from the segment files
+} datafile_send_t;
+
+typedef struct {
+    datafile_sync_t sync;
+    int sync_interval_ms;
+    bool recover;           // Cut a torn packet off the end of the newest segment
+    off_t segment_size;     // Seal the newest segment once a line takes it past this
+    off_t retain_bytes;     // Drop the oldest segments past this total, 0 keeps all
+    time_t retain_seconds;  // Drop segments sealed longer ago than this, 0 keeps all
+    bool map;               // Keep every segment mapped for datafile_read() and datafile_send()
+} datafile_config_t;
+
+#define DATAFILE_CONFIG_DEFAULT { DATAFILE_SYNC_NONE, DATAFILE_SYNC_INTERVAL_MS, false, \
+                                  DATAFILE_SEGMENT_SIZE, 0, 0, false }
+
+int datafile_parse_sync(const char *arg, datafile_sync_t *mode, int *interval_ms);
+int datafile_parse_send(const char *arg, datafile_send_t *mode, size_t *zerocopy_min);
+int datafile_open(const char *path, const datafile_config_t *config);
+ssize_t datafile_append(const char *buf, size_t len);
+int datafile_sync(void);
+void datafile_close(bool remove_files);
+
+off_t datafile_start(void);
+off_t datafile_end(void);
+ssize_t datafile_read(off_t *pos, char *buf, size_t len);
+ssize_t datafile_send(int sockfd, off_t *pos, size_t len, datafile_send_t mode, int flags);
+off_t datafile_seek(unsigned int write_cmd, unsigned int write_cmd_offset);
+void datafile_retain(void);
+void datafile_detach(void);
+void datafile_attach(void);
+
+#endif
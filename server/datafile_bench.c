@@ -0,0 +1,177 @@
+/*
+ * Append latency and throughput of the data file under each sync mode:
+ *
+ *   none     - writes only, the kernel writes back when it likes
+ *   periodic - a fdatasync() every DATAFILE_SYNC_INTERVAL_MS from a thread
+ *   line     - every append waits for a group fdatasync() covering it
+ *
+ * Every thread appends newline terminated records for a fixed time, timing
+ * each datafile_append() call. Run it on the filesystem the server uses,
+ * the cost of line mode is the device's flush latency.
+ *
+ * Usage: datafile_bench [path] [threads] [record size] [seconds]
+ * Prints one line per mode:
+ *   <mode> threads=<n> size=<n> appends=<n> appends_per_sec=<n> syncs=<n> p50_us=<n> p99_us=<n> max_us=<n>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "datafile.h"
+#include "metrics.h"
+
+#define MAX_SAMPLES_PER_THREAD (1 << 20)
+#define METRICS_TEXT_SIZE (64 * 1024)
+
+typedef struct {
+    pthread_t tid;
+    size_t size;
+    uint64_t end_ns;
+    uint64_t appends;
+    uint64_t *samples;
+    size_t nsamples;
+    int failed;
+} bench_thread_t;
+
+static void *bench_threadfunc(void *arg)
+{
+    bench_thread_t *t = arg;
+    char *record = malloc(t->size);
+    uint64_t start;
+
+    if (!record)
+    {
+        t->failed = 1;
+        return NULL;
+    }
+    memset(record, 'x', t->size - 1);
+    record[t->size - 1] = '\n';
+
+    while ((start = metrics_now_ns()) < t->end_ns)
+    {
+        if (datafile_append(record, t->size) != (ssize_t)t->size)
+        {
+            t->failed = 1;
+            break;
+        }
+        if (t->nsamples < MAX_SAMPLES_PER_THREAD)
+            t->samples[t->nsamples++] = metrics_now_ns() - start;
+        t->appends++;
+    }
+    free(record);
+    return NULL;
+}
+
+/*
+ * fdatasync() calls so far, read back from the histogram the data file
+ * records them in
+ */
+static unsigned long long sync_count(void)
+{
+    static char text[METRICS_TEXT_SIZE];
+    unsigned long long count = 0;
+    const char *p;
+
+    metrics_render(text, sizeof(text));
+    p = strstr(text, "aesdsocket_storage_sync_seconds_count ");
+    if (p)
+        sscanf(p, "%*s %llu", &count);
+    return count;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int bench(const char *path, const char *mode_name, int threads, size_t size, double seconds)
+{
+    bench_thread_t *t = calloc(threads, sizeof(*t));
+    datafile_config_t config = DATAFILE_CONFIG_DEFAULT;
+    unsigned long long syncs;
+    uint64_t *all;
+    uint64_t appends = 0;
+    uint64_t start;
+    double elapsed;
+    size_t n = 0;
+    int failed = 0;
+    int i;
+
+    if (!t || datafile_parse_sync(mode_name, &config.sync, &config.sync_interval_ms) != 0)
+        return 1;
+    unlink(path);
+    if (datafile_open(path, &config) != 0)
+        return 1;
+
+    syncs = sync_count();
+    start = metrics_now_ns();
+    for (i = 0; i < threads; i++)
+    {
+        t[i].size = size;
+        t[i].end_ns = start + (uint64_t)(seconds * 1e9);
+        t[i].samples = malloc(MAX_SAMPLES_PER_THREAD * sizeof(uint64_t));
+        if (!t[i].samples || pthread_create(&t[i].tid, NULL, bench_threadfunc, &t[i]) != 0)
+        {
+            fprintf(stderr, "failed to start thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(t[i].tid, NULL);
+        appends += t[i].appends;
+        n += t[i].nsamples;
+        failed |= t[i].failed;
+    }
+    elapsed = (metrics_now_ns() - start) / 1e9;
+    syncs = sync_count() - syncs;
+    datafile_close(true);
+
+    all = malloc((n ? n : 1) * sizeof(uint64_t));
+    if (!all)
+        return 1;
+    n = 0;
+    for (i = 0; i < threads; i++)
+    {
+        memcpy(all + n, t[i].samples, t[i].nsamples * sizeof(uint64_t));
+        n += t[i].nsamples;
+        free(t[i].samples);
+    }
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+
+    printf("%s threads=%d size=%zu appends=%llu appends_per_sec=%.0f syncs=%llu p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+           mode_name, threads, size, (unsigned long long)appends, appends / elapsed, syncs,
+           n ? all[n / 2] / 1e3 : 0, n ? all[n * 99 / 100] / 1e3 : 0, n ? all[n - 1] / 1e3 : 0);
+
+    free(all);
+    free(t);
+    if (failed)
+        fprintf(stderr, "%s: appends failed\n", mode_name);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "/var/tmp/datafile_bench";
+    int threads = (argc > 2) ? atoi(argv[2]) : 4;
+    size_t size = (argc > 3) ? strtoul(argv[3], NULL, 0) : 64;
+    double seconds = (argc > 4) ? atof(argv[4]) : 2.0;
+    const char *modes[] = { "none", "periodic", "line" };
+    int rc = 0;
+    size_t i;
+
+    if (threads < 1 || size < 1 || seconds <= 0)
+    {
+        fprintf(stderr, "usage: %s [path] [threads] [record size] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        rc |= bench(path, modes[i], threads, size, seconds);
+    return rc;
+}
@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "handoff.h"
+
+#define HANDOFF_READY 'R'
+
+/*
+ * Copy @param argv without "-d" (the new process is already detached) and
+ * append HANDOFF_OPTION @param fd_arg
+ */
+static char **handoff_argv(char *const argv[], char *fd_arg)
+{
+    char **args;
+    int argc = 0;
+    int n = 0;
+
+    while (argv[argc] != NULL)
+        argc++;
+
+    args = malloc((argc + 3) * sizeof(*args));
+    if (!args)
+        return NULL;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-d") != 0)
+            args[n++] = argv[i];
+    }
+    args[n++] = HANDOFF_OPTION;
+    args[n++] = fd_arg;
+    args[n] = NULL;
+    return args;
+}
+
+static int handoff_send_fd(int channel, int fd)
+{
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(channel, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/*
+ * Exec @param exe with @param argv plus the handoff option, pass it
+ * @param listen_fd and wait up to HANDOFF_TIMEOUT_MS for it to report ready.
+ * Returns 0 with the new process id in @param pid and our end of the
+ * channel in @param channel, to be held open until we exit. Returns -1
+ * after killing it.
+ */
+int handoff_start(const char *exe, char *const argv[], int listen_fd, pid_t *pid, int *channel)
+{
+    struct pollfd pfd;
+    char fd_arg[16];
+    char **args;
+    char byte = 0;
+    int sv[2];
+    int rc = -1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        syslog(LOG_ERR, "handoff socketpair error - %s", strerror(errno));
+        return -1;
+    }
+
+    snprintf(fd_arg, sizeof(fd_arg), "%d", sv[1]);
+    args = handoff_argv(argv, fd_arg);
+    if (!args) {
+        syslog(LOG_ERR, "handoff: out of memory");
+        goto close_pair;
+    }
+
+    *pid = fork();
+    if (*pid < 0) {
+        syslog(LOG_ERR, "handoff fork failed - %s", strerror(errno));
+        goto free_args;
+    }
+    if (*pid == 0) {
+        // Only async-signal-safe calls until exec, the parent is threaded
+        fcntl(sv[1], F_SETFD, 0);
+        execv(exe, args);
+        _exit(127);
+    }
+    close(sv[1]);
+    sv[1] = -1;
+
+    if (handoff_send_fd(sv[0], listen_fd) != 0) {
+        syslog(LOG_ERR, "handoff: failed to pass listening socket - %s", strerror(errno));
+        goto kill_child;
+    }
+
+    // EOF here means the new process exited before it was ready
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, HANDOFF_TIMEOUT_MS) != 1 || read(sv[0], &byte, 1) != 1 || byte != HANDOFF_READY) {
+        syslog(LOG_ERR, "handoff: new process %d did not become ready", (int)*pid);
+        goto kill_child;
+    }
+
+    *channel = sv[0];
+    sv[0] = -1;
+    rc = 0;
+    goto free_args;
+
+kill_child:
+    kill(*pid, SIGKILL);
+    waitpid(*pid, NULL, 0);
+free_args:
+    free(args);
+close_pair:
+    if (sv[0] >= 0)
+        close(sv[0]);
+    if (sv[1] >= 0)
+        close(sv[1]);
+    return rc;
+}
+
+/*
+ * In the new process: receive the listening socket from @param channel
+ */
+int handoff_receive(int channel)
+{
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    int fd = -1;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        syslog(LOG_ERR, "handoff recvmsg error - %s", strerror(errno));
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        syslog(LOG_ERR, "handoff: no socket received");
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/*
+ * In the new process: tell the old one to stop accepting. @param channel
+ * stays open and reads EOF once the old one has exited.
+ */
+int handoff_ready(int channel)
+{
+    char byte = HANDOFF_READY;
+
+    // Not inherited by the process a later reload starts
+    fcntl(channel, F_SETFD, FD_CLOEXEC);
+    return (send(channel, &byte, 1, MSG_NOSIGNAL) == 1) ? 0 : -1;
+}
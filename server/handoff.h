@@ -0,0 +1,27 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>
+
+/*
+ * Zero-downtime reload: the running server starts a fresh copy of its binary
+ * with "-H <fd>" and passes it the listening socket over a UNIX socket pair
+ * (SCM_RIGHTS). The listen queue is shared, so connections keep being
+ * accepted throughout. Once the new process reports ready the old one stops
+ * accepting and keeps serving the connections it has until their clients
+ * close them, or RELOAD_DRAIN_MS passes. Builds keeping the history in
+ * process (USE_AESD_RING_HISTORY) cannot hand it over and refuse to reload.
+ *
+ * The old process keeps its end of the socket pair open until it exits, so
+ * the new one reads EOF on its end once the old one has drained. Until then
+ * both may append to the data file, see datafile_attach().
+ */
+
+#define HANDOFF_OPTION "-H"
+#define HANDOFF_TIMEOUT_MS 5000     // Time the new process gets to report ready
+
+int handoff_start(const char *exe, char *const argv[], int listen_fd, pid_t *pid, int *channel);
+int handoff_receive(int channel);
+int handoff_ready(int channel);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * In-process history store built on the userspace aesd_mpmc_ring.
+ *
+ * Mirrors the behaviour of the aesdchar driver: complete (newline terminated)
+ * packets are kept as entries, only the most recent HISTORY_MAX_ENTRIES are
+ * retained, reads walk the concatenated entries from a caller owned file
+ * position and seekto resolves (write_cmd, write_cmd_offset) to a position.
+ *
+ * Appenders push into the ring without taking a lock. Everything which
+ * removes or dereferences entries (eviction, read, seekto) is a consumer and
+ * is serialized by consumer_lock, so an entry can't be freed while a reader
+ * copies out of it.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "aesd-ring.h"
+#include "history.h"
+
+static struct aesd_mpmc_slot slots[HISTORY_RING_CAPACITY];
+static struct aesd_mpmc_ring ring;
+static pthread_mutex_t consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Must be called with consumer_lock held
+static void history_evict(size_t keep)
+{
+    struct aesd_buffer_entry entry;
+
+    while (aesd_mpmc_ring_count(&ring) > keep && aesd_mpmc_ring_pop(&ring, &entry))
+    {
+        free((void *)entry.buffptr);
+    }
+}
+
+int history_init(void)
+{
+    return aesd_mpmc_ring_init(&ring, slots, HISTORY_RING_CAPACITY);
+}
+
+void history_destroy(void)
+{
+    pthread_mutex_lock(&consumer_lock);
+    history_evict(0);
+    pthread_mutex_unlock(&consumer_lock);
+}
+
+/*
+ * Takes ownership of @param buf (malloc'd, @param len bytes) and publishes it
+ * as a single entry, evicting the oldest entries past HISTORY_MAX_ENTRIES.
+ */
+static void history_publish(char *buf, size_t len)
+{
+    struct aesd_buffer_entry entry = { .buffptr = buf, .size = len };
+
+    while (!aesd_mpmc_ring_push(&ring, &entry))
+    {
+        // Ring is full of entries nobody evicted yet, make room ourselves
+        pthread_mutex_lock(&consumer_lock);
+        history_evict(HISTORY_MAX_ENTRIES - 1);
+        pthread_mutex_unlock(&consumer_lock);
+    }
+
+    if (aesd_mpmc_ring_count(&ring) > HISTORY_MAX_ENTRIES)
+    {
+        pthread_mutex_lock(&consumer_lock);
+        history_evict(HISTORY_MAX_ENTRIES);
+        pthread_mutex_unlock(&consumer_lock);
+    }
+}
+
+/*
+ * Appends a complete record (e.g. a timestamp line) as one entry
+ */
+int history_append(const char *buf, size_t len)
+{
+    char *copy = malloc(len);
+
+    if (!copy) return -1;
+
+    memcpy(copy, buf, len);
+    history_publish(copy, len);
+
+    return 0;
+}
+
+/*
+ * Accumulates @param buf into @param pending and publishes an entry for
+ * every newline terminated packet found.
+ * @return len on success, -1 on allocation failure
+ */
+ssize_t history_write(history_pending_t *pending, const char *buf, size_t len)
+{
+    const char *start = buf;
+    const char *end = buf + len;
+    const char *nl;
+    size_t chunk;
+    char *tmp;
+
+    while (start < end)
+    {
+        nl = memchr(start, '\n', end - start);
+        chunk = (nl ? nl + 1 : end) - start;
+
+        tmp = realloc(pending->buf, pending->size + chunk);
+        if (!tmp) return -1;
+
+        memcpy(tmp + pending->size, start, chunk);
+        pending->buf = tmp;
+        pending->size += chunk;
+        start += chunk;
+
+        if (nl)
+        {
+            history_publish(pending->buf, pending->size);
+            pending->buf = NULL;
+            pending->size = 0;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * Copies up to @param len bytes starting at *@param fpos into @param buf and
+ * advances *fpos. Like the driver, returns 0 and rewinds *fpos to 0 once the
+ * end of the history is reached.
+ */
+ssize_t history_read(size_t *fpos, char *buf, size_t len)
+{
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset = 0;
+    size_t n = 0;
+
+    pthread_mutex_lock(&consumer_lock);
+
+    entry = aesd_mpmc_ring_find_entry_offset_for_fpos(&ring, *fpos, &entry_offset);
+    if (entry == NULL)
+    {
+        *fpos = 0;
+        goto done;
+    }
+
+    n = entry->size - entry_offset;
+    n = (len > n) ? n : len;
+    memcpy(buf, entry->buffptr + entry_offset, n);
+    *fpos += n;
+
+done:
+    pthread_mutex_unlock(&consumer_lock);
+    return n;
+}
+
+/*
+ * Sets *@param fpos to byte @param write_cmd_offset of the @param write_cmd
+ * oldest entry.
+ * @return 0 on success, -EINVAL if the entry or offset does not exist
+ */
+int history_seekto(size_t *fpos, unsigned int write_cmd, unsigned int write_cmd_offset)
+{
+    struct aesd_buffer_entry *entry;
+    size_t pos;
+    size_t start;
+    size_t offset = 0;
+    int rc = -EINVAL;
+
+    pthread_mutex_lock(&consumer_lock);
+
+    start = atomic_load_explicit(&ring.dequeue_pos, memory_order_acquire);
+    AESD_MPMC_RING_FOREACH(entry, &ring, pos)
+    {
+        if (pos - start == write_cmd)
+        {
+            if (write_cmd_offset < entry->size)
+            {
+                *fpos = offset + write_cmd_offset;
+                rc = 0;
+            }
+            break;
+        }
+        offset += entry->size;
+    }
+
+    pthread_mutex_unlock(&consumer_lock);
+    return rc;
+}
+
+void history_pending_free(history_pending_t *pending)
+{
+    free(pending->buf);
+    pending->buf = NULL;
+    pending->size = 0;
+}
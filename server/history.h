@@ -0,0 +1,30 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "aesd-circular-buffer.h"
+
+// Ring capacity must be a power of two and leave headroom above the retained
+// entry count so concurrent appenders rarely have to wait on eviction
+#define HISTORY_RING_CAPACITY 16
+#define HISTORY_MAX_ENTRIES AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+/*
+ * Partial (not yet newline terminated) packet accumulated for one writer
+ */
+typedef struct {
+    char *buf;
+    size_t size;
+} history_pending_t;
+
+int history_init(void);
+void history_destroy(void);
+int history_append(const char *buf, size_t len);
+ssize_t history_write(history_pending_t *pending, const char *buf, size_t len);
+ssize_t history_read(size_t *fpos, char *buf, size_t len);
+int history_seekto(size_t *fpos, unsigned int write_cmd, unsigned int write_cmd_offset);
+void history_pending_free(history_pending_t *pending);
+
+#endif
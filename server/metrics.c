@@ -0,0 +1,363 @@
+#define _GNU_SOURCE     // accept4()
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+
+#define METRICS_RENDER_SIZE (16 * 1024)
+#define METRICS_REQUEST_TIMEOUT_MS 500
+
+typedef struct {
+    atomic_uint_fast64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_ns;
+} metrics_hist_t;
+
+typedef struct {
+    _Alignas(64) atomic_bool owned;
+    atomic_uint_fast64_t counters[METRIC_COUNTER_MAX];
+    atomic_int_fast64_t gauges[METRIC_GAUGE_MAX];
+    metrics_hist_t histograms[METRIC_HISTOGRAM_MAX];
+} metrics_shard_t;
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTER_MAX] = {
+    [METRIC_ACCEPTS] = { "aesdsocket_accepts_total", "Connections accepted" },
+    [METRIC_BYTES_IN] = { "aesdsocket_bytes_in_total", "Bytes received from clients" },
+    [METRIC_BYTES_OUT] = { "aesdsocket_bytes_out_total", "Bytes sent to clients" },
+    [METRIC_PACKETS] = { "aesdsocket_packets_total", "Newline terminated packets received" },
+    [METRIC_REPLAY_BYTES] = { "aesdsocket_replay_bytes_total", "Bytes of history replayed to clients" },
+    [METRIC_SEEKTO] = { "aesdsocket_seekto_total", "AESDCHAR_IOCSEEKTO commands" },
+    [METRIC_READ_PAUSES] = { "aesdsocket_read_pauses_total", "Times reads from a client were paused for undrained replies" },
+    [METRIC_STALLED_CLIENTS] = { "aesdsocket_stalled_clients_total", "Clients dropped for not draining replies" },
+}, gauge_info[METRIC_GAUGE_MAX] = {
+    [METRIC_ACTIVE_CONNECTIONS] = { "aesdsocket_active_connections", "Connections currently open" },
+}, histogram_info[METRIC_HISTOGRAM_MAX] = {
+    [METRIC_STORAGE_WRITE_SECONDS] = { "aesdsocket_storage_write_seconds", "Latency of writes to packet storage" },
+    [METRIC_REPLY_SECONDS] = { "aesdsocket_reply_seconds", "Latency of replaying history to a client" },
+    [METRIC_STORAGE_SYNC_SECONDS] = { "aesdsocket_storage_sync_seconds", "Latency of fdatasync() of the data file" },
+};
+
+// Shards are recycled, never freed, so totals survive their thread exiting.
+// The overflow shard is shared by threads which found no free shard and is
+// therefore updated with atomic adds instead of load/store.
+static metrics_shard_t *shards[METRICS_MAX_SHARDS];
+static metrics_shard_t overflow_shard;
+static atomic_int nshards = 0;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread metrics_shard_t *tls_shard = NULL;
+
+static int listen_fd = -1;
+static pthread_t server_tid;
+static bool server_running = false;
+
+static void metrics_release_shard(void *shard)
+{
+    atomic_store_explicit(&((metrics_shard_t *)shard)->owned, false, memory_order_release);
+}
+
+static void metrics_create_key(void)
+{
+    pthread_key_create(&shard_key, metrics_release_shard);
+}
+
+static metrics_shard_t *metrics_shard(void)
+{
+    metrics_shard_t *shard = tls_shard;
+    bool expected;
+    int n;
+    int i;
+
+    if (shard)
+        return shard;
+
+    pthread_once(&shard_key_once, metrics_create_key);
+
+    n = atomic_load_explicit(&nshards, memory_order_acquire);
+    for (i = 0; i < n; i++)
+    {
+        expected = false;
+        if (atomic_compare_exchange_strong(&shards[i]->owned, &expected, true))
+        {
+            shard = shards[i];
+            goto claimed;
+        }
+    }
+
+    pthread_mutex_lock(&shards_lock);
+    n = atomic_load_explicit(&nshards, memory_order_relaxed);
+    if (n < METRICS_MAX_SHARDS && (shard = aligned_alloc(64, sizeof(metrics_shard_t))) != NULL)
+    {
+        memset(shard, 0, sizeof(*shard));
+        atomic_init(&shard->owned, true);
+        shards[n] = shard;
+        atomic_store_explicit(&nshards, n + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&shards_lock);
+
+    if (!shard)
+    {
+        tls_shard = &overflow_shard;
+        return tls_shard;
+    }
+
+claimed:
+    pthread_setspecific(shard_key, shard);
+    tls_shard = shard;
+    return shard;
+}
+
+static inline void metrics_add_u64(metrics_shard_t *shard, atomic_uint_fast64_t *v, uint64_t n)
+{
+    if (shard == &overflow_shard)
+        atomic_fetch_add_explicit(v, n, memory_order_relaxed);
+    else
+        atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metrics_inc(metrics_counter_t counter, uint64_t n)
+{
+    metrics_shard_t *shard = metrics_shard();
+    metrics_add_u64(shard, &shard->counters[counter], n);
+}
+
+void metrics_gauge_add(metrics_gauge_t gauge, int64_t n)
+{
+    metrics_shard_t *shard = metrics_shard();
+    atomic_int_fast64_t *v = &shard->gauges[gauge];
+
+    if (shard == &overflow_shard)
+        atomic_fetch_add_explicit(v, n, memory_order_relaxed);
+    else
+        atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metrics_observe_ns(metrics_histogram_t histogram, uint64_t ns)
+{
+    metrics_shard_t *shard = metrics_shard();
+    metrics_hist_t *h = &shard->histograms[histogram];
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    // Bucket i holds observations <= 2^i us, the last one is +Inf
+    if (us > 1)
+        bucket = 64 - __builtin_clzll(us - 1);
+    if (bucket > METRICS_HISTOGRAM_BUCKETS - 1)
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+
+    metrics_add_u64(shard, &h->buckets[bucket], 1);
+    metrics_add_u64(shard, &h->count, 1);
+    metrics_add_u64(shard, &h->sum_ns, ns);
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t metrics_sum(size_t offset)
+{
+    int n = atomic_load_explicit(&nshards, memory_order_acquire);
+    uint64_t total = atomic_load_explicit((atomic_uint_fast64_t *)((char *)&overflow_shard + offset),
+                                          memory_order_relaxed);
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        total += atomic_load_explicit((atomic_uint_fast64_t *)((char *)shards[i] + offset),
+                                      memory_order_relaxed);
+    }
+    return total;
+}
+
+#define RENDER(...) \
+    do { \
+        if (used < len) used += snprintf(buf + used, len - used, __VA_ARGS__); \
+    } while (0)
+
+/*
+ * Merges all shards into Prometheus text exposition format.
+ * @return number of bytes written (truncated output if len is too small)
+ */
+size_t metrics_render(char *buf, size_t len)
+{
+    size_t used = 0;
+    uint64_t cumulative;
+    int m;
+    int b;
+
+    for (m = 0; m < METRIC_COUNTER_MAX; m++)
+    {
+        RENDER("# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+               counter_info[m].name, counter_info[m].help, counter_info[m].name, counter_info[m].name,
+               (unsigned long long)metrics_sum(offsetof(metrics_shard_t, counters[m])));
+    }
+
+    for (m = 0; m < METRIC_GAUGE_MAX; m++)
+    {
+        RENDER("# HELP %s %s\n# TYPE %s gauge\n%s %lld\n",
+               gauge_info[m].name, gauge_info[m].help, gauge_info[m].name, gauge_info[m].name,
+               (long long)metrics_sum(offsetof(metrics_shard_t, gauges[m])));
+    }
+
+    for (m = 0; m < METRIC_HISTOGRAM_MAX; m++)
+    {
+        RENDER("# HELP %s %s\n# TYPE %s histogram\n",
+               histogram_info[m].name, histogram_info[m].help, histogram_info[m].name);
+        cumulative = 0;
+        for (b = 0; b < METRICS_HISTOGRAM_BUCKETS - 1; b++)
+        {
+            cumulative += metrics_sum(offsetof(metrics_shard_t, histograms[m].buckets[b]));
+            RENDER("%s_bucket{le=\"%.9g\"} %llu\n", histogram_info[m].name,
+                   (double)(1ULL << b) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += metrics_sum(offsetof(metrics_shard_t, histograms[m].buckets[b]));
+        RENDER("%s_bucket{le=\"+Inf\"} %llu\n", histogram_info[m].name, (unsigned long long)cumulative);
+        RENDER("%s_sum %.9f\n", histogram_info[m].name,
+               metrics_sum(offsetof(metrics_shard_t, histograms[m].sum_ns)) / 1e9);
+        RENDER("%s_count %llu\n", histogram_info[m].name,
+               (unsigned long long)metrics_sum(offsetof(metrics_shard_t, histograms[m].count)));
+    }
+
+    return (used < len) ? used : len;
+}
+
+static void metrics_serve(int fd)
+{
+    static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+    char *body = malloc(METRICS_RENDER_SIZE);
+    char request[1024];
+    struct timeval tv = { .tv_sec = 0, .tv_usec = METRICS_REQUEST_TIMEOUT_MS * 1000 };
+    size_t len;
+
+    if (!body)
+        return;
+
+    // The request itself is ignored, every path returns the metrics. Read it
+    // so closing the socket does not reset the connection before the reply.
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (recv(fd, request, sizeof(request), 0) < 0)
+    {
+        syslog(LOG_DEBUG, "metrics request recv error - %s", strerror(errno));
+    }
+
+    len = metrics_render(body, METRICS_RENDER_SIZE);
+    if (send(fd, header, sizeof(header) - 1, MSG_NOSIGNAL) > 0)
+        send(fd, body, len, MSG_NOSIGNAL);
+
+    free(body);
+}
+
+static void *metrics_thread(void *arg)
+{
+    sigset_t set;
+    int fd;
+
+    (void)arg;
+
+    // Leave signal handling to the main thread
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (true)
+    {
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // metrics_stop() shut the listening socket down
+            break;
+        }
+        metrics_serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts serving metrics on 127.0.0.1:@param port from a dedicated thread.
+ * Must be called after any fork().
+ * @return 0 on success, -1 on error
+ */
+int metrics_start(const char *port)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *res = NULL;
+    int opt = 1;
+    int rc;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    rc = getaddrinfo("127.0.0.1", port, &hints, &res);
+    if (rc != 0)
+    {
+        syslog(LOG_ERR, "metrics getaddrinfo error - %s", gai_strerror(rc));
+        return -1;
+    }
+
+    listen_fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        syslog(LOG_ERR, "metrics socket error - %s", strerror(errno));
+        goto free_addr_info;
+    }
+
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(listen_fd, res->ai_addr, res->ai_addrlen) != 0 || listen(listen_fd, 4) != 0)
+    {
+        syslog(LOG_ERR, "metrics bind/listen error on port %s - %s", port, strerror(errno));
+        goto close_sock;
+    }
+
+    if (pthread_create(&server_tid, NULL, metrics_thread, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to start metrics thread");
+        goto close_sock;
+    }
+
+    server_running = true;
+    freeaddrinfo(res);
+    return 0;
+
+close_sock:
+    close(listen_fd);
+    listen_fd = -1;
+free_addr_info:
+    freeaddrinfo(res);
+    return -1;
+}
+
+void metrics_stop(void)
+{
+    if (!server_running)
+        return;
+
+    // Wakes the blocked accept() with an error
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(server_tid, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    server_running = false;
+}
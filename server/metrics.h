@@ -0,0 +1,52 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Operational metrics for aesdsocket, exposed as Prometheus text.
+ *
+ * Every thread updates its own cache line aligned shard with relaxed atomic
+ * stores (each shard has a single writer), so the hot path never contends
+ * on a shared counter.  Shards are merged when the endpoint is scraped.
+ */
+
+#define METRICS_PORT "9001"
+#define METRICS_MAX_SHARDS 256          // Threads beyond this share one overflow shard
+#define METRICS_HISTOGRAM_BUCKETS 24    // Powers of two from 1us up to ~8s, plus +Inf
+
+typedef enum {
+    METRIC_ACCEPTS,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_PACKETS,
+    METRIC_REPLAY_BYTES,
+    METRIC_SEEKTO,
+    METRIC_READ_PAUSES,
+    METRIC_STALLED_CLIENTS,
+    METRIC_COUNTER_MAX
+} metrics_counter_t;
+
+typedef enum {
+    METRIC_ACTIVE_CONNECTIONS,
+    METRIC_GAUGE_MAX
+} metrics_gauge_t;
+
+typedef enum {
+    METRIC_STORAGE_WRITE_SECONDS,
+    METRIC_REPLY_SECONDS,
+    METRIC_STORAGE_SYNC_SECONDS,
+    METRIC_HISTOGRAM_MAX
+} metrics_histogram_t;
+
+void metrics_inc(metrics_counter_t counter, uint64_t n);
+void metrics_gauge_add(metrics_gauge_t gauge, int64_t n);
+void metrics_observe_ns(metrics_histogram_t histogram, uint64_t ns);
+uint64_t metrics_now_ns(void);
+
+size_t metrics_render(char *buf, size_t len);
+int metrics_start(const char *port);
+void metrics_stop(void);
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+#define POOL_ALIGN 16
+
+static int pool_grow(pool_t *pool) {
+    void **chunks;
+    char *chunk;
+    size_t i;
+
+    chunks = realloc(pool->chunks, (pool->nchunks + 1) * sizeof(void *));
+    if (!chunks)
+        return -1;
+    pool->chunks = chunks;
+
+    chunk = malloc(pool->obj_size * pool->objs_per_chunk);
+    if (!chunk)
+        return -1;
+    pool->chunks[pool->nchunks++] = chunk;
+
+    // Push in reverse so objects are handed out in address order
+    for (i = pool->objs_per_chunk; i > 0; i--) {
+        void *obj = chunk + (i - 1) * pool->obj_size;
+        *(void **)obj = pool->free_head;
+        pool->free_head = obj;
+    }
+    pool->total += pool->objs_per_chunk;
+
+    return 0;
+}
+
+/*
+ * @param obj_size size of each object, rounded up to a 16 byte multiple
+ * @param objs_per_chunk number of objects allocated each time the pool grows
+ * @param prealloc number of objects to allocate up front
+ */
+pool_t *pool_init(size_t obj_size, size_t objs_per_chunk, size_t prealloc) {
+    pool_t *pool;
+
+    if (obj_size < sizeof(void *))
+        obj_size = sizeof(void *);
+    obj_size = (obj_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    if (objs_per_chunk < 1)
+        objs_per_chunk = 1;
+
+    pool = malloc(sizeof(pool_t));
+    if (!pool)
+        return NULL;
+
+    pool->obj_size = obj_size;
+    pool->objs_per_chunk = objs_per_chunk;
+    pool->free_head = NULL;
+    pool->chunks = NULL;
+    pool->nchunks = 0;
+    pool->in_use = 0;
+    pool->total = 0;
+
+    while ((size_t)pool->total < prealloc) {
+        if (pool_grow(pool) != 0) {
+            pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+/*
+ * Releases all chunks, objects still handed out become invalid
+ */
+void pool_destroy(pool_t *pool) {
+    int i;
+
+    if (!pool)
+        return;
+
+    for (i = 0; i < pool->nchunks; i++)
+        free(pool->chunks[i]);
+    free(pool->chunks);
+    free(pool);
+}
+
+/*
+ * @return an uninitialized object, or NULL if the pool could not grow
+ */
+void *pool_get(pool_t *pool) {
+    void *obj;
+
+    if (!pool)
+        return NULL;
+
+    if (pool->free_head == NULL && pool_grow(pool) != 0)
+        return NULL;
+
+    obj = pool->free_head;
+    pool->free_head = *(void **)obj;
+    (pool->in_use)++;
+
+    return obj;
+}
+
+void pool_put(pool_t *pool, void *obj) {
+    if (!pool || !obj)
+        return;
+
+    *(void **)obj = pool->free_head;
+    pool->free_head = obj;
+    (pool->in_use)--;
+}
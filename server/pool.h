@@ -0,0 +1,31 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * Fixed size object pool.
+ *
+ * Objects are carved out of chunks of objs_per_chunk objects and recycled
+ * through a free list threaded through the free objects themselves, so once
+ * the pool has grown to the steady state working set get/put never call
+ * malloc/free.  A pool is not thread safe, it is meant to be owned by the
+ * one thread which both allocates and releases from it (in aesdsocket, the
+ * accept loop, which also reaps finished connections).
+ */
+typedef struct pool {
+    size_t obj_size;
+    size_t objs_per_chunk;
+    void *free_head;
+    void **chunks;
+    int nchunks;
+    int in_use;
+    int total;
+} pool_t;
+
+pool_t *pool_init(size_t obj_size, size_t objs_per_chunk, size_t prealloc);
+void pool_destroy(pool_t *pool);
+void *pool_get(pool_t *pool);
+void pool_put(pool_t *pool, void *obj);
+
+#endif
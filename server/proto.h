@@ -0,0 +1,103 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * Binary protocol, negotiated by sending PROTO_MAGIC as the first bytes of
+ * a connection (a text client never starts with a non ASCII byte). The
+ * server echoes the magic, after which both sides exchange messages made of
+ * a fixed header and a payload of header.length bytes. Integers are big
+ * endian. Requests may be pipelined, responses come back in order carrying
+ * the request's seq and opcode | PROTO_RESPONSE.
+ *
+ *   0      1      2      4        8        12
+ *   +------+------+------+--------+--------+--------------
+ *   |opcode|status| rsvd | length |  seq   | payload ...
+ *   +------+------+------+--------+--------+--------------
+ *
+ * Request payloads:
+ *   PROTO_OP_APPEND     bytes to store as one record
+ *   PROTO_OP_SEEK_READ  u32 write_cmd, u32 write_cmd_offset, u32 max_len
+ *   PROTO_OP_READ_RANGE u64 offset, u32 max_len
+ *   PROTO_OP_STATS      empty
+ *
+ * Response payloads are empty for APPEND, the history bytes for the reads
+ * and Prometheus text for STATS, never more than the connection's
+ * outbound queue allows (see proto_max_payload in aesdsocket.c).
+ */
+
+#define PROTO_MAGIC "\xae\x5d\x0b\x01"
+#define PROTO_MAGIC_SIZE 4
+#define PROTO_HEADER_SIZE 12
+#define PROTO_RESPONSE 0x80
+
+typedef enum {
+    PROTO_UNKNOWN,      // Nothing received yet
+    PROTO_TEXT,
+    PROTO_BINARY,
+    PROTO_SHM           // UNIX socket client pushing through a shared ring, see shm.h
+} proto_mode_t;
+
+typedef enum {
+    PROTO_OP_APPEND = 1,
+    PROTO_OP_SEEK_READ = 2,
+    PROTO_OP_READ_RANGE = 3,
+    PROTO_OP_STATS = 4
+} proto_op_t;
+
+typedef enum {
+    PROTO_OK = 0,
+    PROTO_EINVAL = 1,       // Malformed request
+    PROTO_ERANGE = 2,       // Seek target not in history
+    PROTO_EIO = 3,          // Storage error
+    PROTO_EOPNOTSUPP = 4,   // Unknown opcode
+    PROTO_ETOOBIG = 5       // Request larger than the input buffer, connection is closed
+} proto_status_t;
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t status;
+    uint32_t length;
+    uint32_t seq;
+} proto_header_t;
+
+static inline uint32_t proto_get_u32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static inline void proto_put_u32(char *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint64_t proto_get_u64(const char *p)
+{
+    return ((uint64_t)proto_get_u32(p) << 32) | proto_get_u32(p + 4);
+}
+
+static inline void proto_header_decode(const char *p, proto_header_t *h)
+{
+    h->opcode = (uint8_t)p[0];
+    h->status = (uint8_t)p[1];
+    h->length = proto_get_u32(p + 4);
+    h->seq = proto_get_u32(p + 8);
+}
+
+static inline void proto_header_encode(char *p, const proto_header_t *h)
+{
+    p[0] = (char)h->opcode;
+    p[1] = (char)h->status;
+    p[2] = 0;
+    p[3] = 0;
+    proto_put_u32(p + 4, h->length);
+    proto_put_u32(p + 8, h->seq);
+}
+
+#endif
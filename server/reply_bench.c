@@ -0,0 +1,314 @@
+#define _GNU_SOURCE     // RUSAGE_THREAD
+/*
+ * Throughput of replaying the whole data file to a client, by how a reply
+ * leaves the file:
+ *
+ *   read      - pread() into a queue the size of the default outbound
+ *               queue, then send() it, as replies were before -Y
+ *   mmap-read - the same loop copying from the mapped segments
+ *   mmap      - send() straight from the mapping
+ *   zerocopy  - the same with MSG_ZEROCOPY
+ *   sendfile  - sendfile() from the segment files
+ *
+ * The history is written once, then every mode replays it to a thread
+ * draining a TCP loopback connection. Loopback always copies MSG_ZEROCOPY
+ * data, so zerocopy only shows its bookkeeping cost here. Run it against a
+ * real client on another host to see what it saves.
+ *
+ * Usage: reply_bench [path] [history MiB] [replies]
+ * Prints one line per mode:
+ *   <mode> bytes=<n> MB_per_sec=<n> sender_cpu_ms=<n> copied=<yes|no|->
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#include "datafile.h"
+#include "metrics.h"
+
+#define REPLY_QUEUE_SIZE (256 * 1024)   // OUTQ_HIGH_WATERMARK
+#define RECV_SIZE (1024 * 1024)
+#define SEGMENT_SIZE (16 * 1024 * 1024)
+
+typedef enum {
+    MODE_READ,
+    MODE_MMAP_READ,
+    MODE_MMAP,
+    MODE_ZEROCOPY,
+    MODE_SENDFILE
+} reply_mode_t;
+
+static const char *mode_names[] = { "read", "mmap-read", "mmap", "zerocopy", "sendfile" };
+
+typedef struct {
+    int fd;
+    unsigned long long expected;
+    unsigned long long received;
+} drain_t;
+
+static void *drain_threadfunc(void *arg)
+{
+    drain_t *d = arg;
+    char *buf = malloc(RECV_SIZE);
+    ssize_t n;
+
+    while (buf && d->received < d->expected)
+    {
+        n = recv(d->fd, buf, RECV_SIZE, 0);
+        if (n <= 0)
+            break;
+        d->received += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * A connected TCP loopback pair, @param fds[0] sends
+ */
+static int loopback_pair(int fds[2])
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 1) != 0 || getsockname(listen_fd, (struct sockaddr *)&addr, &len) != 0)
+        return -1;
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[0] < 0 || connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        return -1;
+    fds[1] = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    return fds[1] < 0 ? -1 : 0;
+}
+
+/*
+ * Drain MSG_ZEROCOPY completions, noting whether the kernel copied
+ */
+static void zerocopy_reap(int fd, int *copied)
+{
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    union {
+        char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    while (true)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                *copied = (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) ? 1 : 0;
+        }
+    }
+#else
+    (void)fd;
+    (void)copied;
+#endif
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Replay the log from its start to @param fd once
+ */
+static int reply(int fd, reply_mode_t mode, char *queue, int *copied)
+{
+    off_t pos = datafile_start();
+    off_t end = datafile_end();
+    int flags = MSG_NOSIGNAL;
+    size_t len;
+    ssize_t n;
+
+#ifdef MSG_ZEROCOPY
+    if (mode == MODE_ZEROCOPY)
+        flags |= MSG_ZEROCOPY;
+#endif
+    while (pos < end)
+    {
+        if (mode == MODE_READ || mode == MODE_MMAP_READ)
+        {
+            len = 0;
+            while (len < REPLY_QUEUE_SIZE && pos < end)
+            {
+                n = datafile_read(&pos, queue + len, REPLY_QUEUE_SIZE - len);
+                if (n <= 0)
+                    return -1;
+                len += n;
+            }
+            if (send_all(fd, queue, len) != 0)
+                return -1;
+            continue;
+        }
+
+        n = datafile_send(fd, &pos, end - pos,
+                          mode == MODE_SENDFILE ? DATAFILE_SEND_SENDFILE : DATAFILE_SEND_MMAP, flags);
+        if (mode == MODE_ZEROCOPY)
+            zerocopy_reap(fd, copied);
+        if (n < 0 && errno == ENOBUFS)
+            continue;   // Completions reaped above, try again
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n == 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int bench(const char *path, reply_mode_t mode, int replies)
+{
+    datafile_config_t config = DATAFILE_CONFIG_DEFAULT;
+    struct rusage before, after;
+    char *queue = malloc(REPLY_QUEUE_SIZE);
+    pthread_t tid;
+    drain_t drain;
+    uint64_t start;
+    double elapsed, cpu_ms;
+    int copied = -1;
+    int one = 1;
+    int fds[2];
+    int rc = 0;
+    int i;
+
+    config.map = (mode != MODE_READ && mode != MODE_SENDFILE);
+    config.segment_size = SEGMENT_SIZE;
+    if (!queue || datafile_open(path, &config) != 0 || loopback_pair(fds) != 0)
+        return 1;
+#ifdef SO_ZEROCOPY
+    if (mode == MODE_ZEROCOPY && setsockopt(fds[0], SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+        fprintf(stderr, "SO_ZEROCOPY - %s\n", strerror(errno));
+#else
+    (void)one;
+#endif
+
+    drain.fd = fds[1];
+    drain.expected = (unsigned long long)(datafile_end() - datafile_start()) * replies;
+    drain.received = 0;
+    if (pthread_create(&tid, NULL, drain_threadfunc, &drain) != 0)
+        return 1;
+
+    getrusage(RUSAGE_THREAD, &before);
+    start = metrics_now_ns();
+    for (i = 0; i < replies && rc == 0; i++)
+        rc = reply(fds[0], mode, queue, &copied);
+    getrusage(RUSAGE_THREAD, &after);
+    pthread_join(tid, NULL);
+    elapsed = (metrics_now_ns() - start) / 1e9;
+    if (mode == MODE_ZEROCOPY)
+        zerocopy_reap(fds[0], &copied);
+
+    cpu_ms = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1e3 +
+             (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e3 +
+             (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e3 +
+             (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e3;
+    printf("%s bytes=%llu MB_per_sec=%.0f sender_cpu_ms=%.0f copied=%s\n",
+           mode_names[mode], drain.received, drain.received / elapsed / 1e6, cpu_ms,
+           copied < 0 ? "-" : (copied ? "yes" : "no"));
+
+    close(fds[0]);
+    close(fds[1]);
+    datafile_close(false);
+    free(queue);
+    if (rc != 0 || drain.received != drain.expected)
+    {
+        fprintf(stderr, "%s: reply failed - %s\n", mode_names[mode], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Write @param mib MiB of newline terminated records of varying length
+ */
+static int fill(const char *path, size_t mib)
+{
+    datafile_config_t config = DATAFILE_CONFIG_DEFAULT;
+    char record[256];
+    char filler[200];
+    size_t total = 0;
+    int len;
+    int i = 0;
+
+    memset(filler, 'x', sizeof(filler));
+    config.segment_size = SEGMENT_SIZE;
+    unlink(path);
+    if (datafile_open(path, &config) != 0)
+        return -1;
+    while (total < mib * 1024 * 1024)
+    {
+        len = snprintf(record, sizeof(record), "record %08d %.*s\n", i, 40 + i % 160, filler);
+        if (datafile_append(record, len) != len)
+        {
+            datafile_close(true);
+            return -1;
+        }
+        total += len;
+        i++;
+    }
+    datafile_close(false);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "/var/tmp/reply_bench";
+    size_t mib = (argc > 2) ? strtoul(argv[2], NULL, 0) : 64;
+    int replies = (argc > 3) ? atoi(argv[3]) : 8;
+    datafile_config_t config = DATAFILE_CONFIG_DEFAULT;
+    int rc = 0;
+    int mode;
+
+    if (mib < 1 || replies < 1)
+    {
+        fprintf(stderr, "usage: %s [path] [history MiB] [replies]\n", argv[0]);
+        return 1;
+    }
+    if (fill(path, mib) != 0)
+    {
+        fprintf(stderr, "failed to write %s\n", path);
+        return 1;
+    }
+
+    for (mode = MODE_READ; mode <= MODE_SENDFILE; mode++)
+        rc |= bench(path, mode, replies);
+
+    // Opened once more only to remove every segment
+    if (datafile_open(path, &config) == 0)
+        datafile_close(true);
+    return rc;
+}
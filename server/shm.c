@@ -0,0 +1,477 @@
+#define _GNU_SOURCE     // memfd_create()
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "shm.h"
+
+#define SHM_FDS 3
+#define SHM_WAKE_DIVISOR 4
+
+/*
+ * Send SHM_MAGIC with @param fds attached
+ */
+static int shm_send_fds(int sock_fd, const int fds[SHM_FDS])
+{
+    char magic[SHM_MAGIC_SIZE];
+    struct iovec iov = { .iov_base = magic, .iov_len = SHM_MAGIC_SIZE };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+
+    memcpy(magic, SHM_MAGIC, SHM_MAGIC_SIZE);
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SHM_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, SHM_FDS * sizeof(int));
+
+    return sendmsg(sock_fd, &msg, MSG_NOSIGNAL) == SHM_MAGIC_SIZE ? 0 : -1;
+}
+
+static int shm_recv_fds(int sock_fd, int fds[SHM_FDS])
+{
+    char magic[SHM_MAGIC_SIZE];
+    struct iovec iov = { .iov_base = magic, .iov_len = SHM_MAGIC_SIZE };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != SHM_MAGIC_SIZE)
+        return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(SHM_FDS * sizeof(int))) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), SHM_FDS * sizeof(int));
+    if (memcmp(magic, SHM_MAGIC, SHM_MAGIC_SIZE) != 0) {
+        for (int i = 0; i < SHM_FDS; i++)
+            close(fds[i]);
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Look at the oldest record. Returns 1 with it in @param rec and
+ * @param len, 0 if the ring is empty and -1 if the producer corrupted it.
+ * Bounds come from @param capacity, never from the shared header. Records
+ * start SHM_ALIGN aligned, so the length word of one never crosses the end.
+ */
+static int shm_ring_peek(shm_ring_t *r, uint32_t capacity, const char **rec, uint32_t *len)
+{
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t off;
+    uint32_t n;
+
+    while (tail != head) {
+        if (head - tail > capacity || tail % SHM_ALIGN != 0)
+            return -1;
+        off = tail & (capacity - 1);
+        memcpy(&n, r->data + off, sizeof(n));
+        if (n != SHM_WRAP) {
+            if (n > SHM_MAX_RECORD(capacity) || SHM_RECORD_SIZE(n) > head - tail ||
+                off + SHM_RECORD_SIZE(n) > capacity)
+                return -1;
+            *rec = r->data + off + sizeof(uint32_t);
+            *len = n;
+            return 1;
+        }
+        // Skip the unused end of the data area
+        tail += capacity - off;
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    return 0;
+}
+
+static void shm_ring_consume(shm_ring_t *r, uint32_t len)
+{
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&r->tail, tail + SHM_RECORD_SIZE(len), memory_order_release);
+}
+
+/*
+ * Copy a record into the ring. Returns 1 on success and 0 if it is full.
+ */
+static int shm_ring_push(shm_ring_t *r, const void *buf, uint32_t len)
+{
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t need = SHM_RECORD_SIZE(len);
+    size_t off = head & (r->capacity - 1);
+    size_t skip = (r->capacity - off < need) ? r->capacity - off : 0;
+
+    if (head + skip + need - tail > r->capacity)
+        return 0;
+
+    if (skip) {
+        uint32_t wrap = SHM_WRAP;
+        memcpy(r->data + off, &wrap, sizeof(wrap));
+        off = 0;
+    }
+    memcpy(r->data + off, &len, sizeof(len));
+    memcpy(r->data + off + sizeof(len), buf, len);
+    atomic_store_explicit(&r->head, head + skip + need, memory_order_release);
+    return 1;
+}
+
+/*
+ * Wake the other side if it announced it sleeps on @param fd. The fence
+ * orders our last ring update before reading @param waiting, pairing with
+ * the sleeper setting the flag before its final check of the ring.
+ */
+static void shm_wake(_Atomic uint32_t *waiting, int fd)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed))
+        eventfd_write(fd, 1);
+}
+
+/*
+ * Bind a UNIX socket at @param path and listen on it. The socket is bound
+ * under a temporary name and renamed over @param path, so a process
+ * started by a reload replaces the old socket without a window in which
+ * connects fail.
+ */
+int shm_listen(const char *path, int backlog)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%d", path, (int)getpid()) >= (int)sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "UNIX socket path too long - %s", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "UNIX socket error - %s", strerror(errno));
+        return -1;
+    }
+
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, backlog) != 0) {
+        syslog(LOG_ERR, "UNIX socket bind error - %s", strerror(errno));
+        goto close_fd;
+    }
+    if (rename(addr.sun_path, path) != 0) {
+        syslog(LOG_ERR, "Failed to move UNIX socket to %s - %s", path, strerror(errno));
+        unlink(addr.sun_path);
+        goto close_fd;
+    }
+    return fd;
+
+close_fd:
+    close(fd);
+    return -1;
+}
+
+/*
+ * Create the ring and eventfds for a client which sent SHM_MAGIC on
+ * @param sock_fd, and pass them to it
+ */
+int shm_accept(int sock_fd, shm_conn_t *c)
+{
+    int fds[SHM_FDS] = { -1, -1, -1 };
+    int mem_fd;
+
+    c->ring = MAP_FAILED;
+    c->map_size = sizeof(shm_ring_t) + SHM_RING_SIZE;
+    c->data_fd = -1;
+    c->space_fd = -1;
+
+    mem_fd = memfd_create("aesdsocket-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mem_fd < 0) {
+        syslog(LOG_ERR, "memfd_create error - %s", strerror(errno));
+        return -1;
+    }
+
+    // Sealed so the client cannot shrink it under our mapping (SIGBUS)
+    if (ftruncate(mem_fd, c->map_size) != 0 ||
+        fcntl(mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        syslog(LOG_ERR, "Failed to size shared ring - %s", strerror(errno));
+        goto fail;
+    }
+
+    c->ring = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (c->ring == MAP_FAILED) {
+        syslog(LOG_ERR, "mmap error - %s", strerror(errno));
+        goto fail;
+    }
+    memcpy(&c->ring->magic, SHM_MAGIC, sizeof(c->ring->magic));
+    c->capacity = SHM_RING_SIZE;
+    c->ring->capacity = c->capacity;
+
+    c->data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    c->space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (c->data_fd < 0 || c->space_fd < 0) {
+        syslog(LOG_ERR, "eventfd error - %s", strerror(errno));
+        goto fail;
+    }
+
+    fds[0] = mem_fd;
+    fds[1] = c->data_fd;
+    fds[2] = c->space_fd;
+    if (shm_send_fds(sock_fd, fds) != 0) {
+        syslog(LOG_ERR, "Failed to pass shared ring - %s", strerror(errno));
+        goto fail;
+    }
+
+    // The mapping keeps the memory alive
+    close(mem_fd);
+    return 0;
+
+fail:
+    close(mem_fd);
+    shm_release(c);
+    return -1;
+}
+
+/*
+ * Consume records from @param c into @param store until the client closes
+ * @param sock_fd. Returns 0 once everything published before the close was
+ * stored, -1 on a storage error or a corrupted ring.
+ */
+int shm_serve(shm_conn_t *c, int sock_fd, shm_store_fn store, void *ctx)
+{
+    shm_ring_t *r = c->ring;
+    struct pollfd pfd[2] = {
+        { .fd = c->data_fd, .events = POLLIN },
+        { .fd = sock_fd, .events = POLLIN },
+    };
+    const char *rec;
+    char discard[64];
+    eventfd_t value;
+    uint32_t len;
+    size_t freed = 0;
+    bool eof = false;
+    int rc;
+
+    while (true) {
+        while ((rc = shm_ring_peek(r, c->capacity, &rec, &len)) > 0) {
+            if (store(ctx, rec, len) != (ssize_t)len)
+                return -1;
+            shm_ring_consume(r, len);
+            // A full producer is woken once a quarter of the ring is free
+            // rather than per record, each wakeup is a context switch
+            freed += SHM_RECORD_SIZE(len);
+            if (freed >= c->capacity / SHM_WAKE_DIVISOR) {
+                shm_wake(&r->producer_waiting, c->space_fd);
+                freed = 0;
+            }
+        }
+        shm_wake(&r->producer_waiting, c->space_fd);
+        freed = 0;
+        if (rc < 0) {
+            syslog(LOG_ERR, "Shared ring corrupted by client");
+            return -1;
+        }
+        if (eof)
+            return 0;
+
+        // Announce the sleep, then look once more so a record published
+        // before the producer saw the flag is not missed
+        atomic_store(&r->consumer_waiting, 1);
+        if (atomic_load(&r->head) != atomic_load_explicit(&r->tail, memory_order_relaxed)) {
+            atomic_store_explicit(&r->consumer_waiting, 0, memory_order_relaxed);
+            continue;
+        }
+
+        rc = poll(pfd, 2, -1);
+        atomic_store_explicit(&r->consumer_waiting, 0, memory_order_relaxed);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "shared ring poll error - %s", strerror(errno));
+            return -1;
+        }
+        if (pfd[0].revents & POLLIN)
+            eventfd_read(c->data_fd, &value);
+        if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            // Nothing but the close is expected on the socket
+            rc = recv(sock_fd, discard, sizeof(discard), 0);
+            if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EINTR))
+                eof = true;
+        }
+    }
+}
+
+void shm_release(shm_conn_t *c)
+{
+    if (c->ring != MAP_FAILED)
+        munmap(c->ring, c->map_size);
+    if (c->data_fd >= 0)
+        close(c->data_fd);
+    if (c->space_fd >= 0)
+        close(c->space_fd);
+    c->ring = MAP_FAILED;
+    c->data_fd = -1;
+    c->space_fd = -1;
+}
+
+/*
+ * Client side: connect to the server's UNIX socket at @param path and map
+ * the ring it hands out
+ */
+int shm_client_connect(const char *path, shm_client_t *c)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fds[SHM_FDS];
+    struct stat st;
+
+    c->ring = MAP_FAILED;
+    c->data_fd = -1;
+    c->space_fd = -1;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    c->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->sock_fd < 0)
+        return -1;
+    if (connect(c->sock_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        send(c->sock_fd, SHM_MAGIC, SHM_MAGIC_SIZE, MSG_NOSIGNAL) != SHM_MAGIC_SIZE ||
+        shm_recv_fds(c->sock_fd, fds) != 0)
+        goto fail;
+
+    c->data_fd = fds[1];
+    c->space_fd = fds[2];
+    if (fstat(fds[0], &st) != 0 || (size_t)st.st_size < sizeof(shm_ring_t)) {
+        close(fds[0]);
+        goto fail;
+    }
+    c->map_size = st.st_size;
+    c->ring = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (c->ring == MAP_FAILED)
+        goto fail;
+    if (c->ring->capacity > c->map_size - sizeof(shm_ring_t)) {
+        errno = EPROTO;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    shm_client_close(c);
+    return -1;
+}
+
+/*
+ * Wait on the space eventfd until @param done holds. Fails with EPIPE if
+ * the server closed the connection.
+ */
+static int shm_client_wait(shm_client_t *c, bool (*done)(shm_client_t *, const void *, size_t),
+                           const void *buf, size_t len)
+{
+    shm_ring_t *r = c->ring;
+    struct pollfd pfd[2] = {
+        { .fd = c->space_fd, .events = POLLIN },
+        { .fd = c->sock_fd, .events = POLLIN },
+    };
+    eventfd_t value;
+    int rc = 0;
+
+    while (true) {
+        atomic_store(&r->producer_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (done(c, buf, len))
+            break;
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+            rc = -1;
+            break;
+        }
+        if (pfd[0].revents & POLLIN)
+            eventfd_read(c->space_fd, &value);
+        if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            errno = EPIPE;
+            rc = -1;
+            break;
+        }
+    }
+    atomic_store_explicit(&r->producer_waiting, 0, memory_order_relaxed);
+    return rc;
+}
+
+static bool shm_client_pushed(shm_client_t *c, const void *buf, size_t len)
+{
+    return shm_ring_push(c->ring, buf, len) == 1;
+}
+
+static bool shm_client_drained(shm_client_t *c, const void *buf, size_t len)
+{
+    (void)buf;
+    (void)len;
+    return atomic_load(&c->ring->tail) == atomic_load_explicit(&c->ring->head, memory_order_relaxed);
+}
+
+/*
+ * Publish one record, waiting for space if the ring is full. Only a sleeping
+ * server costs a syscall.
+ */
+int shm_client_push(shm_client_t *c, const void *buf, size_t len)
+{
+    if (len > SHM_MAX_RECORD(c->ring->capacity)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (!shm_client_pushed(c, buf, len) && shm_client_wait(c, shm_client_pushed, buf, len) != 0)
+        return -1;
+    shm_wake(&c->ring->consumer_waiting, c->data_fd);
+    return 0;
+}
+
+/*
+ * Wait until the server consumed every published record
+ */
+int shm_client_flush(shm_client_t *c)
+{
+    if (shm_client_drained(c, NULL, 0))
+        return 0;
+    return shm_client_wait(c, shm_client_drained, NULL, 0);
+}
+
+void shm_client_close(shm_client_t *c)
+{
+    if (c->ring != MAP_FAILED)
+        munmap(c->ring, c->map_size);
+    if (c->data_fd >= 0)
+        close(c->data_fd);
+    if (c->space_fd >= 0)
+        close(c->space_fd);
+    if (c->sock_fd >= 0)
+        close(c->sock_fd);
+    c->ring = MAP_FAILED;
+    c->data_fd = -1;
+    c->space_fd = -1;
+    c->sock_fd = -1;
+}
@@ -0,0 +1,81 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Shared-memory transport for producers on the same host. A client connects
+ * to the UNIX socket given with -u and sends SHM_MAGIC. The server answers
+ * with the magic and three descriptors (SCM_RIGHTS): a memfd holding an
+ * shm_ring_t, an eventfd the client signals when it published records while
+ * the server sleeps, and an eventfd the server signals when it freed space
+ * while the client waits. Either side only makes the wakeup syscall when the
+ * other one announced it is about to sleep, so a busy producer pushes lines
+ * without a syscall per message.
+ *
+ * Each record is stored as is, like a binary PROTO_OP_APPEND, and gets no
+ * reply. The ring has one producer and one consumer. The connection ends
+ * when the client closes the socket, after the server consumed what was
+ * published before.
+ *
+ * Records are a native endian u32 length followed by the payload, padded to
+ * SHM_ALIGN. A length of SHM_WRAP means the rest of the data area is unused
+ * and the next record starts at offset 0.
+ */
+
+#define SHM_MAGIC "\xae\x5d\x0b\x02"
+#define SHM_MAGIC_SIZE 4
+#define SHM_RING_SIZE (1024 * 1024)     // Data area, power of two
+#define SHM_ALIGN 8
+#define SHM_WRAP 0xffffffffu
+#define SHM_CACHELINE 64
+
+#define SHM_RECORD_SIZE(len) (((size_t)(len) + sizeof(uint32_t) + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1))
+#define SHM_MAX_RECORD(capacity) ((capacity) / 2 - sizeof(uint32_t))
+
+typedef struct {
+    uint32_t magic;         // First bytes of SHM_MAGIC, native endian
+    uint32_t capacity;      // Bytes in data[]
+    _Alignas(SHM_CACHELINE) _Atomic uint64_t head;     // Written by the producer
+    _Atomic uint32_t producer_waiting;
+    _Alignas(SHM_CACHELINE) _Atomic uint64_t tail;     // Written by the consumer
+    _Atomic uint32_t consumer_waiting;
+    _Alignas(SHM_CACHELINE) char data[];
+} shm_ring_t;
+
+// Server side, one per connection
+typedef struct {
+    shm_ring_t *ring;
+    size_t map_size;
+    uint32_t capacity;      // ring->capacity as created, the client can overwrite that one
+    int data_fd;            // eventfd, client -> server
+    int space_fd;           // eventfd, server -> client
+} shm_conn_t;
+
+// Client side
+typedef struct {
+    shm_ring_t *ring;
+    size_t map_size;
+    int sock_fd;
+    int data_fd;
+    int space_fd;
+} shm_client_t;
+
+typedef ssize_t (*shm_store_fn)(void *ctx, const char *buf, size_t len);
+
+int shm_accept(int sock_fd, shm_conn_t *c);
+int shm_serve(shm_conn_t *c, int sock_fd, shm_store_fn store, void *ctx);
+void shm_release(shm_conn_t *c);
+
+int shm_listen(const char *path, int backlog);
+
+int shm_client_connect(const char *path, shm_client_t *c);
+int shm_client_push(shm_client_t *c, const void *buf, size_t len);
+int shm_client_flush(shm_client_t *c);
+void shm_client_close(shm_client_t *c);
+
+#endif
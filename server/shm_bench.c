@@ -0,0 +1,188 @@
+/*
+ * Throughput of a running aesdsocket's local transports:
+ *
+ *   shm - records pushed through the shared ring on the UNIX socket (-u)
+ *   tcp - the same records as pipelined binary PROTO_OP_APPEND requests to
+ *         the loopback port, BENCH_WINDOW requests per round trip
+ *
+ * Each case ends once the server stored every record. Both append to the
+ * server's history, run it against a scratch instance.
+ *
+ * Usage: shm_bench <unix socket path> [records] [record size] [port]
+ * Prints one line per case: <case> records=<n> size=<n> sec=<s> ns_per_record=<ns>
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "proto.h"
+#include "shm.h"
+
+#define BENCH_WINDOW 64
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long records, size_t size, double sec)
+{
+    printf("%s records=%ld size=%zu sec=%.3f ns_per_record=%.1f\n", name, records, size, sec, sec * 1e9 / records);
+}
+
+static int bench_shm(const char *path, long records, const char *line, size_t size)
+{
+    shm_client_t c;
+    double start;
+    long i;
+
+    if (shm_client_connect(path, &c) != 0)
+    {
+        fprintf(stderr, "shm connect to %s failed - %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    start = now_sec();
+    for (i = 0; i < records; i++)
+    {
+        if (shm_client_push(&c, line, size) != 0)
+        {
+            fprintf(stderr, "shm push failed - %s\n", strerror(errno));
+            shm_client_close(&c);
+            return -1;
+        }
+    }
+    if (shm_client_flush(&c) != 0)
+    {
+        fprintf(stderr, "shm flush failed - %s\n", strerror(errno));
+        shm_client_close(&c);
+        return -1;
+    }
+    report("shm", records, size, now_sec() - start);
+
+    shm_client_close(&c);
+    return 0;
+}
+
+static int read_full(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = recv(fd, buf, len, 0);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int tcp_connect(const char *port)
+{
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    int one = 1;
+    int fd;
+
+    if (getaddrinfo("127.0.0.1", port, &hints, &res) != 0)
+        return -1;
+    fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int bench_tcp(const char *port, long records, const char *line, size_t size)
+{
+    size_t req_size = PROTO_HEADER_SIZE + size;
+    char *batch = malloc(BENCH_WINDOW * req_size);
+    char rsp[BENCH_WINDOW * PROTO_HEADER_SIZE];
+    proto_header_t h = { .opcode = PROTO_OP_APPEND, .length = size };
+    double start;
+    long sent;
+    int n, i;
+    int fd = tcp_connect(port);
+    int rc = -1;
+
+    if (fd < 0 || !batch)
+    {
+        fprintf(stderr, "tcp connect to port %s failed\n", port);
+        goto out;
+    }
+    if (send(fd, PROTO_MAGIC, PROTO_MAGIC_SIZE, 0) != PROTO_MAGIC_SIZE ||
+        read_full(fd, rsp, PROTO_MAGIC_SIZE) != 0 || memcmp(rsp, PROTO_MAGIC, PROTO_MAGIC_SIZE) != 0)
+    {
+        fprintf(stderr, "binary protocol handshake failed\n");
+        goto out;
+    }
+
+    start = now_sec();
+    for (sent = 0; sent < records; sent += n)
+    {
+        n = (records - sent < BENCH_WINDOW) ? records - sent : BENCH_WINDOW;
+        for (i = 0; i < n; i++)
+        {
+            h.seq = sent + i;
+            proto_header_encode(batch + i * req_size, &h);
+            memcpy(batch + i * req_size + PROTO_HEADER_SIZE, line, size);
+        }
+        if (send(fd, batch, n * req_size, 0) != (ssize_t)(n * req_size) ||
+            read_full(fd, rsp, n * PROTO_HEADER_SIZE) != 0)
+        {
+            fprintf(stderr, "tcp append failed\n");
+            goto out;
+        }
+    }
+    report("tcp", records, size, now_sec() - start);
+    rc = 0;
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(batch);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    long records = (argc > 2) ? atol(argv[2]) : 100000;
+    size_t size = (argc > 3) ? strtoul(argv[3], NULL, 0) : 64;
+    const char *port = (argc > 4) ? argv[4] : "9000";
+    char *line;
+    int rc = 0;
+
+    if (argc < 2 || records < 1 || size < 1 || size > SHM_MAX_RECORD(SHM_RING_SIZE))
+    {
+        fprintf(stderr, "usage: %s <unix socket path> [records] [record size] [port]\n", argv[0]);
+        return 1;
+    }
+
+    line = malloc(size);
+    if (!line)
+        return 1;
+    memset(line, 'a', size - 1);
+    line[size - 1] = '\n';
+
+    rc |= bench_shm(argv[1], records, line, size);
+    rc |= bench_tcp(port, records, line, size);
+
+    free(line);
+    return rc ? 1 : 0;
+}
@@ -3,6 +3,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 typedef struct node {
     void *value;
@@ -26,4 +28,111 @@ node_t *sll_front(singly_linked_list_t *list);
 node_t *sll_back(singly_linked_list_t *list);
 void sll_pretty_print_list(singly_linked_list_t *list);
 
+/*
+ * Intrusive list: the link lives inside the payload struct, so inserting
+ * needs no allocation and the payload is reached without a pointer chase.
+ * Links are doubly linked around a sentinel, giving O(1) unlink of any
+ * element and O(1) access to both ends.
+ *
+ * Example:
+ *   struct conn { int fd; ilist_link_t link; };
+ *   ilist_t list;
+ *   struct conn *c, *tmp;
+ *   ilist_init(&list);
+ *   ilist_push_back(&list, &c->link);
+ *   ilist_for_each_entry_safe(c, tmp, &list, link) {
+ *       if (c->fd < 0) ilist_unlink(&list, &c->link);
+ *   }
+ */
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+typedef struct ilist_link {
+    struct ilist_link *next;
+    struct ilist_link *prev;
+} ilist_link_t;
+
+typedef struct ilist {
+    ilist_link_t head;
+    int size;
+} ilist_t;
+
+#define ilist_entry(link, type, member) container_of(link, type, member)
+
+static inline void ilist_init(ilist_t *list) {
+    list->head.next = &list->head;
+    list->head.prev = &list->head;
+    list->size = 0;
+}
+
+static inline bool ilist_empty(const ilist_t *list) {
+    return list->head.next == &list->head;
+}
+
+static inline int ilist_size(const ilist_t *list) {
+    return list->size;
+}
+
+static inline void ilist_insert_between(ilist_t *list, ilist_link_t *link,
+                                        ilist_link_t *prev, ilist_link_t *next) {
+    link->prev = prev;
+    link->next = next;
+    prev->next = link;
+    next->prev = link;
+    (list->size)++;
+}
+
+static inline void ilist_push_back(ilist_t *list, ilist_link_t *link) {
+    ilist_insert_between(list, link, list->head.prev, &list->head);
+}
+
+static inline void ilist_push_front(ilist_t *list, ilist_link_t *link) {
+    ilist_insert_between(list, link, &list->head, list->head.next);
+}
+
+static inline void ilist_unlink(ilist_t *list, ilist_link_t *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = NULL;
+    link->prev = NULL;
+    (list->size)--;
+}
+
+static inline ilist_link_t *ilist_front(ilist_t *list) {
+    return ilist_empty(list) ? NULL : list->head.next;
+}
+
+static inline ilist_link_t *ilist_back(ilist_t *list) {
+    return ilist_empty(list) ? NULL : list->head.prev;
+}
+
+static inline ilist_link_t *ilist_pop_front(ilist_t *list) {
+    ilist_link_t *link = ilist_front(list);
+    if (link)
+        ilist_unlink(list, link);
+    return link;
+}
+
+/*
+ * Iterate over payloads. @param pos is a pointer to the payload type,
+ * @param member is the name of the ilist_link_t inside it.
+ */
+#define ilist_for_each_entry(pos, list, member) \
+    for ((pos) = ilist_entry((list)->head.next, __typeof__(*(pos)), member); \
+         &(pos)->member != &(list)->head; \
+         (pos) = ilist_entry((pos)->member.next, __typeof__(*(pos)), member))
+
+/*
+ * As ilist_for_each_entry, but @param pos may be unlinked (and freed) inside
+ * the loop body. @param tmp is a second payload pointer used as scratch.
+ */
+#define ilist_for_each_entry_safe(pos, tmp, list, member) \
+    for ((pos) = ilist_entry((list)->head.next, __typeof__(*(pos)), member), \
+         (tmp) = ilist_entry((pos)->member.next, __typeof__(*(pos)), member); \
+         &(pos)->member != &(list)->head; \
+         (pos) = (tmp), (tmp) = ilist_entry((tmp)->member.next, __typeof__(*(pos)), member))
+
 #endif
\ No newline at end of file
@@ -0,0 +1,145 @@
+/*
+ * Microbenchmark of the intrusive ilist against the allocating
+ * singly_linked_list, modelled on aesdsocket's per-connection bookkeeping:
+ *
+ *   churn   - allocate a payload, insert it, then remove and free a random
+ *             live payload (one connection accepted, one reaped)
+ *   iterate - walk all live payloads and read a field
+ *
+ * Usage: sll_bench [live entries] [operations]
+ * Prints one line per case: <case> impl=<sll|ilist> live=<n> ops=<n> ns_per_op=<ns>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "singly_linked_list.h"
+
+typedef struct payload {
+    int fd;
+    char pad[48];       // roughly the size of thread_data_t
+    ilist_link_t link;
+} payload_t;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, const char *impl, int live, long ops, double elapsed_ns)
+{
+    printf("%s impl=%s live=%d ops=%ld ns_per_op=%.1f\n", name, impl, live, ops, elapsed_ns / ops);
+}
+
+static void bench_sll(int live, long ops)
+{
+    singly_linked_list_t *list = sll_init_list();
+    payload_t **slots = malloc(live * sizeof(*slots));
+    payload_t *p;
+    node_t *node;
+    long sum = 0;
+    long i;
+    int victim;
+    double start;
+
+    for (i = 0; i < live; i++)
+    {
+        slots[i] = malloc(sizeof(payload_t));
+        slots[i]->fd = i;
+        sll_insert_node(list, slots[i]);
+    }
+
+    srand(1);
+    start = now_ns();
+    for (i = 0; i < ops; i++)
+    {
+        victim = rand() % live;
+        sll_remove_node(list, slots[victim]);
+        free(slots[victim]);
+
+        p = malloc(sizeof(payload_t));
+        p->fd = i;
+        sll_insert_node(list, p);
+        slots[victim] = p;
+    }
+    report("churn", "sll", live, ops, now_ns() - start);
+
+    start = now_ns();
+    for (i = 0; i < ops; i++)
+    {
+        for (node = sll_front(list); node != NULL; node = node->next)
+            sum += ((payload_t *)node->value)->fd;
+    }
+    report("iterate", "sll", live, ops * live, now_ns() - start);
+
+    // sll_destroy_list frees the values too
+    sll_destroy_list(list);
+    free(slots);
+    if (sum == 42) printf("\n");
+}
+
+static void bench_ilist(int live, long ops)
+{
+    ilist_t list;
+    payload_t **slots = malloc(live * sizeof(*slots));
+    payload_t *p;
+    long sum = 0;
+    long i;
+    int victim;
+    double start;
+
+    ilist_init(&list);
+    for (i = 0; i < live; i++)
+    {
+        slots[i] = malloc(sizeof(payload_t));
+        slots[i]->fd = i;
+        ilist_push_back(&list, &slots[i]->link);
+    }
+
+    srand(1);
+    start = now_ns();
+    for (i = 0; i < ops; i++)
+    {
+        victim = rand() % live;
+        ilist_unlink(&list, &slots[victim]->link);
+        free(slots[victim]);
+
+        p = malloc(sizeof(payload_t));
+        p->fd = i;
+        ilist_push_back(&list, &p->link);
+        slots[victim] = p;
+    }
+    report("churn", "ilist", live, ops, now_ns() - start);
+
+    start = now_ns();
+    for (i = 0; i < ops; i++)
+    {
+        ilist_for_each_entry(p, &list, link)
+            sum += p->fd;
+    }
+    report("iterate", "ilist", live, ops * live, now_ns() - start);
+
+    while (!ilist_empty(&list))
+        free(ilist_entry(ilist_pop_front(&list), payload_t, link));
+    free(slots);
+    if (sum == 42) printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int live = (argc > 1) ? atoi(argv[1]) : 1000;
+    long ops = (argc > 2) ? atol(argv[2]) : 10000;
+
+    if (live < 1 || ops < 1)
+    {
+        fprintf(stderr, "usage: %s [live entries] [operations]\n", argv[0]);
+        return 1;
+    }
+
+    bench_sll(live, ops);
+    bench_ilist(live, ops);
+
+    return 0;
+}
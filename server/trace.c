@@ -0,0 +1,209 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef struct {
+    const char *name;       // Must be a string literal
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    int conn;
+    // Position this event was written for plus one, stored last so a dump
+    // racing with the writer can detect a torn or overwritten event
+    atomic_size_t seq;
+} trace_event_t;
+
+typedef struct {
+    atomic_bool owned;
+    atomic_size_t head;
+    trace_event_t events[TRACE_EVENTS_PER_THREAD];
+} trace_buffer_t;
+
+static atomic_uint sample_rate = 0;
+static atomic_uint sample_counter = 0;
+
+// Buffers are recycled, never freed, so events of finished connections
+// stay available to the next dump
+static trace_buffer_t *buffers[TRACE_MAX_BUFFERS];
+static atomic_int nbuffers = 0;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+static __thread trace_buffer_t *tls_buffer = NULL;
+
+static void trace_release_buffer(void *buffer)
+{
+    atomic_store_explicit(&((trace_buffer_t *)buffer)->owned, false, memory_order_release);
+}
+
+static void trace_create_key(void)
+{
+    pthread_key_create(&buffer_key, trace_release_buffer);
+}
+
+static trace_buffer_t *trace_buffer(void)
+{
+    trace_buffer_t *buffer = tls_buffer;
+    bool expected;
+    int n;
+    int i;
+
+    if (buffer)
+        return buffer;
+
+    pthread_once(&buffer_key_once, trace_create_key);
+
+    n = atomic_load_explicit(&nbuffers, memory_order_acquire);
+    for (i = 0; i < n; i++)
+    {
+        expected = false;
+        if (atomic_compare_exchange_strong(&buffers[i]->owned, &expected, true))
+        {
+            buffer = buffers[i];
+            goto claimed;
+        }
+    }
+
+    pthread_mutex_lock(&buffers_lock);
+    i = atomic_load_explicit(&nbuffers, memory_order_relaxed);
+    if (i < TRACE_MAX_BUFFERS && (buffer = calloc(1, sizeof(trace_buffer_t))) != NULL)
+    {
+        atomic_init(&buffer->owned, true);
+        buffers[i] = buffer;
+        atomic_store_explicit(&nbuffers, i + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&buffers_lock);
+
+    if (!buffer)
+        return NULL;
+
+claimed:
+    pthread_setspecific(buffer_key, buffer);
+    tls_buffer = buffer;
+    return buffer;
+}
+
+/*
+ * Trace one connection in @param one_in, 0 disables tracing
+ */
+void trace_set_sample_rate(unsigned int one_in)
+{
+    atomic_store(&sample_rate, one_in);
+}
+
+/*
+ * Called once per connection, @return true if it should be traced
+ */
+bool trace_sample_connection(void)
+{
+    unsigned int rate = atomic_load_explicit(&sample_rate, memory_order_relaxed);
+
+    if (rate == 0)
+        return false;
+
+    return atomic_fetch_add_explicit(&sample_counter, 1, memory_order_relaxed) % rate == 0;
+}
+
+uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Records a span named @param name from @param start_ns until now
+ */
+void trace_span(const char *name, uint64_t start_ns, int conn)
+{
+    trace_buffer_t *buffer = trace_buffer();
+    trace_event_t *ev;
+    size_t head;
+
+    if (!buffer)
+        return;
+
+    head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    ev = &buffer->events[head & (TRACE_EVENTS_PER_THREAD - 1)];
+
+    atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    ev->name = name;
+    ev->start_ns = start_ns;
+    ev->dur_ns = trace_now_ns() - start_ns;
+    ev->conn = conn;
+    atomic_store_explicit(&ev->seq, head + 1, memory_order_release);
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+static void trace_dump_buffer(FILE *f, trace_buffer_t *buffer, int tid, bool *first)
+{
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    size_t pos = (head > TRACE_EVENTS_PER_THREAD) ? head - TRACE_EVENTS_PER_THREAD : 0;
+    trace_event_t *ev;
+    trace_event_t copy;
+    pid_t pid = getpid();
+
+    for (; pos < head; pos++)
+    {
+        ev = &buffer->events[pos & (TRACE_EVENTS_PER_THREAD - 1)];
+        if (atomic_load_explicit(&ev->seq, memory_order_acquire) != pos + 1)
+            continue;
+        copy.name = ev->name;
+        copy.start_ns = ev->start_ns;
+        copy.dur_ns = ev->dur_ns;
+        copy.conn = ev->conn;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&ev->seq, memory_order_relaxed) != pos + 1)
+            continue;
+
+        fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"aesdsocket\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                   "\"pid\":%d,\"tid\":%d,\"args\":{\"conn\":%d}}",
+                *first ? "" : ",", copy.name, copy.start_ns / 1e3, copy.dur_ns / 1e3,
+                (int)pid, tid, copy.conn);
+        *first = false;
+    }
+}
+
+/*
+ * Writes all recorded events to @param path as Chrome trace-event JSON.
+ * Safe to call while connections are still being traced.
+ * @return 0 on success, -1 on error
+ */
+int trace_dump(const char *path)
+{
+    int n = atomic_load_explicit(&nbuffers, memory_order_acquire);
+    bool first = true;
+    FILE *f;
+    int i;
+
+    f = fopen(path, "w");
+    if (!f)
+    {
+        syslog(LOG_ERR, "Failed to open trace file %s - %s", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (i = 0; i < n; i++)
+    {
+        trace_dump_buffer(f, buffers[i], i + 1, &first);
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0)
+    {
+        syslog(LOG_ERR, "Failed to write trace file %s - %s", path, strerror(errno));
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Trace written to %s", path);
+    return 0;
+}
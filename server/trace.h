@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sampled per-connection latency tracing.
+ *
+ * A sampled connection records a span (name, CLOCK_MONOTONIC start and
+ * duration) for every stage of handle_client() into a per-thread ring of
+ * events, overwriting the oldest. Connections which are not sampled only
+ * pay for testing a bool. trace_dump() writes every ring as Chrome
+ * trace-event JSON (load it in chrome://tracing or Perfetto).
+ */
+
+#define TRACE_EVENTS_PER_THREAD 4096    // Must be a power of two
+#define TRACE_MAX_BUFFERS 256           // Sampled threads beyond this are not traced
+#define TRACE_DUMP_FILE "/var/tmp/aesdsocket-trace.json"
+
+void trace_set_sample_rate(unsigned int one_in);
+bool trace_sample_connection(void);
+uint64_t trace_now_ns(void);
+void trace_span(const char *name, uint64_t start_ns, int conn);
+int trace_dump(const char *path);
+
+/*
+ * Helpers for a context with a bool traced member
+ */
+#define TRACE_START(ctx) ((ctx)->traced ? trace_now_ns() : 0)
+#define TRACE_END(ctx, name, start_ns, conn) \
+    do { \
+        if ((ctx)->traced) trace_span(name, start_ns, conn); \
+    } while (0)
+
+#endif